@@ -0,0 +1,105 @@
+//
+//  AccessTrace.cpp
+//  TestFileManager
+//
+//  Created by Stanislav on 20.01.14.
+//  Copyright (c) 2014 Redsteep. All rights reserved.
+//
+
+#include "AccessTrace.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+
+static const char* kAccessTraceHeader = "# access trace v1";
+
+AccessTrace::AccessTrace() :
+    recording(false)
+{
+}
+
+void AccessTrace::start() {
+    std::lock_guard<std::mutex> lock(mutex);
+    
+    entriesList.clear();
+    startTime = std::chrono::steady_clock::now();
+    recording = true;
+}
+
+void AccessTrace::stop() {
+    recording = false;
+}
+
+void AccessTrace::record(const std::string& filename, const std::string& archivePath, const std::string& entryPath,
+                         uint64_t offset, uint64_t size) {
+    if (!isRecording()) return;
+    
+    AccessTraceEntry entry;
+    entry.offset      = offset;
+    entry.size        = size;
+    entry.filename    = filename;
+    entry.archivePath = archivePath;
+    entry.entryPath   = entryPath;
+    
+    std::lock_guard<std::mutex> lock(mutex);
+    entry.timestamp = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+    entriesList.push_back(entry);
+}
+
+std::vector<AccessTraceEntry> AccessTrace::entries() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return entriesList;
+}
+
+bool AccessTrace::save(const std::string& tracePath) const {
+    std::ofstream out(tracePath.c_str(), std::ios::out | std::ios::trunc);
+    if (!out) return false;
+    
+    out << kAccessTraceHeader << "\n";
+    
+    for (auto& entry : entries()) {
+        out << entry.timestamp << '\t'
+            << entry.offset << '\t'
+            << entry.size << '\t'
+            << entry.filename << '\t'
+            << entry.archivePath << '\t'
+            << entry.entryPath << '\n';
+    }
+    
+    return out.good();
+}
+
+bool AccessTrace::load(const std::string& tracePath, std::vector<AccessTraceEntry>& entries) {
+    std::ifstream in(tracePath.c_str());
+    if (!in) return false;
+    
+    std::string line;
+    if (!std::getline(in, line) || line != kAccessTraceHeader) return false;
+    
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        
+        std::vector<std::string> fields;
+        std::stringstream lineStream(line);
+        std::string field;
+        while (std::getline(lineStream, field, '\t')) {
+            fields.push_back(field);
+        }
+        
+        // trailing empty fields are dropped by getline
+        fields.resize(6);
+        if (fields[3].empty()) continue;
+        
+        AccessTraceEntry entry;
+        entry.timestamp   = strtoull(fields[0].c_str(), NULL, 10);
+        entry.offset      = strtoull(fields[1].c_str(), NULL, 10);
+        entry.size        = strtoull(fields[2].c_str(), NULL, 10);
+        entry.filename    = fields[3];
+        entry.archivePath = fields[4];
+        entry.entryPath   = fields[5];
+        entries.push_back(entry);
+    }
+    
+    return true;
+}
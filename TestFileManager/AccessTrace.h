@@ -0,0 +1,55 @@
+//
+//  AccessTrace.h
+//  TestFileManager
+//
+//  Created by Stanislav on 20.01.14.
+//  Copyright (c) 2014 Redsteep. All rights reserved.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+struct AccessTraceEntry {
+    uint64_t timestamp;       // microseconds since recording started
+    uint64_t offset;          // offset in uncompressed data
+    uint64_t size;            // 0 for stream open
+    std::string filename;     // name as requested by the caller
+    std::string archivePath;  // empty for regular files
+    std::string entryPath;    // path inside archive or on disk
+};
+
+//
+// Records resource accesses in the order they happen. The saved trace is a
+// tab separated text file, one access per line, so it can be replayed as
+// prefetch on the next start or fed to the archive repacking tool.
+//
+
+class AccessTrace {
+public:
+    AccessTrace();
+    
+    void start();
+    void stop();
+    bool isRecording() const { return recording.load(std::memory_order_relaxed); }
+    
+    void record(const std::string& filename, const std::string& archivePath, const std::string& entryPath,
+                uint64_t offset, uint64_t size);
+    
+    std::vector<AccessTraceEntry> entries() const;
+    
+    bool save(const std::string& tracePath) const;
+    static bool load(const std::string& tracePath, std::vector<AccessTraceEntry>& entries);
+    
+private:
+    std::atomic<bool> recording;
+    std::chrono::steady_clock::time_point startTime;
+    
+    mutable std::mutex mutex;
+    std::vector<AccessTraceEntry> entriesList;
+};
@@ -0,0 +1,183 @@
+//
+//  Crc32.cpp
+//  TestFileManager
+//
+//  Created by Stanislav on 07.02.14.
+//  Copyright (c) 2014 Redsteep. All rights reserved.
+//
+
+#include "Crc32.h"
+
+#include <string.h>
+#include <limits.h>
+
+#include <algorithm>
+
+#include "zlib.h"
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32_ARMV8
+#elif (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define CRC32_PCLMUL
+#endif
+
+static uint32_t crc32Zlib(uint32_t crc, const unsigned char* data, size_t size) {
+    // zlib takes uInt lengths
+    while (size > 0) {
+        uInt chunk = (uInt)std::min<size_t>(size, UINT_MAX);
+        crc = (uint32_t)crc32(crc, data, chunk);
+        data += chunk;
+        size -= chunk;
+    }
+    return crc;
+}
+
+#if defined(CRC32_ARMV8)
+
+uint32_t crc32Update(uint32_t crc, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    crc = ~crc;
+    
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        crc = __crc32d(crc, word);
+        bytes += 8;
+        size -= 8;
+    }
+    
+    while (size > 0) {
+        crc = __crc32b(crc, *bytes++);
+        size--;
+    }
+    
+    return ~crc;
+}
+
+const char* crc32Implementation() {
+    return "armv8";
+}
+
+#elif defined(CRC32_PCLMUL)
+
+// folding runs need at least four 16 byte lanes
+static const size_t kFoldMinimumSize = 64;
+
+// Carry-less multiplication folding from Intel's "Fast CRC Computation for
+// Generic Polynomials Using PCLMULQDQ Instruction", with the bit-reflected
+// constants for the zip polynomial given at the end of the paper. size is a
+// multiple of 16 and at least kFoldMinimumSize, crc is taken and returned
+// without the final inversion.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32Fold(uint32_t crc, const unsigned char* data, size_t size) {
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    
+    data += 64;
+    size -= 64;
+    
+    // four lanes in parallel, 64 bytes per step
+    while (size >= 64) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(data + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(data + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(data + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(data + 0x30)));
+        
+        data += 64;
+        size -= 64;
+    }
+    
+    // the four lanes into one
+    __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+    
+    // remaining 16 byte blocks
+    while (size >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)data)), x5);
+        
+        data += 16;
+        size -= 16;
+    }
+    
+    // 128 bits to 64
+    __m128i x2Fold = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2Fold);
+    
+    __m128i high = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, high);
+    
+    // Barrett reduction to 32 bits
+    __m128i reduced = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+    reduced = _mm_clmulepi64_si128(_mm_and_si128(reduced, mask32), poly, 0x00);
+    x1 = _mm_xor_si128(x1, reduced);
+    
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static bool hasPclmul() {
+    // the fold ends with pextrd from sse4.1, so both are required
+    static const bool supported = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+    return supported;
+}
+
+uint32_t crc32Update(uint32_t crc, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    
+    if (size >= kFoldMinimumSize && hasPclmul()) {
+        size_t foldSize = size & ~(size_t)15;
+        crc = ~crc32Fold(~crc, bytes, foldSize);
+        bytes += foldSize;
+        size -= foldSize;
+    }
+    
+    return crc32Zlib(crc, bytes, size);
+}
+
+const char* crc32Implementation() {
+    return hasPclmul() ? "pclmul" : "zlib";
+}
+
+#else
+
+uint32_t crc32Update(uint32_t crc, const void* data, size_t size) {
+    return crc32Zlib(crc, (const unsigned char*)data, size);
+}
+
+const char* crc32Implementation() {
+    return "zlib";
+}
+
+#endif
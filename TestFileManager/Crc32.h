@@ -0,0 +1,25 @@
+//
+//  Crc32.h
+//  TestFileManager
+//
+//  Created by Stanislav on 07.02.14.
+//  Copyright (c) 2014 Redsteep. All rights reserved.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// CRC-32 as stored in zip entries, same results as zlib's crc32(). Long runs
+// are folded 64 bytes at a time with PCLMULQDQ when the x86 CPU has it (checked
+// once at run time), or taken 8 bytes per instruction on ARMv8 targets built
+// with the CRC extension; everything else goes through zlib.
+//
+
+// continues crc over data, start with 0
+uint32_t crc32Update(uint32_t crc, const void* data, size_t size);
+
+// name of the code path crc32Update takes on this machine
+const char* crc32Implementation();
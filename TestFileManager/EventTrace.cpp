@@ -0,0 +1,144 @@
+//
+//  EventTrace.cpp
+//  TestFileManager
+//
+//  Created by Stanislav on 27.01.14.
+//  Copyright (c) 2014 Redsteep. All rights reserved.
+//
+
+#include "EventTrace.h"
+
+#include <string.h>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+static void appendEscaped(std::stringstream& out, const char* string) {
+    for (const char* c = string; *c; c++) {
+        switch (*c) {
+            case '"':  out << "\\\""; break;
+            case '\\': out << "\\\\"; break;
+            default:
+                if ((unsigned char)*c < 0x20) out << ' ';
+                else out << *c;
+        }
+    }
+}
+
+EventTrace::EventTrace() :
+    recording(false),
+    startTimestamp(0),
+    creationTime(std::chrono::steady_clock::now())
+{
+    pthread_key_create(&ringKey, NULL);
+}
+
+EventTrace::~EventTrace() {
+    pthread_key_delete(ringKey);
+}
+
+void EventTrace::start() {
+    // rings are not cleared, events older than the start are skipped on export
+    startTimestamp = now();
+    recording = true;
+}
+
+void EventTrace::stop() {
+    recording = false;
+}
+
+uint64_t EventTrace::now() const {
+    auto elapsed = std::chrono::steady_clock::now() - creationTime;
+    return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+EventTrace::ThreadRing* EventTrace::threadRing() {
+    ThreadRing* ring = static_cast<ThreadRing*>(pthread_getspecific(ringKey));
+    if (ring) return ring;
+    
+    // first event on this thread
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    
+    ring = new ThreadRing();
+    ring->threadIndex = (uint32_t)rings.size() + 1;
+    ring->head = 0;
+    rings.push_back(std::unique_ptr<ThreadRing>(ring));
+    
+    pthread_setspecific(ringKey, ring);
+    
+    return ring;
+}
+
+void EventTrace::record(const char* name, const char* category, uint64_t timestamp, uint64_t duration, const std::string* detail) {
+    ThreadRing* ring = threadRing();
+    
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    TraceEvent& event = ring->events[head % kRingCapacity];
+    
+    event.name = name;
+    event.category = category;
+    event.timestamp = timestamp;
+    event.duration = duration;
+    
+    size_t detailSize = 0;
+    if (detail) {
+        // keep the tail, the file name is more telling than the root folder
+        detailSize = std::min(detail->size(), sizeof(event.detail) - 1);
+        memcpy(event.detail, detail->data() + detail->size() - detailSize, detailSize);
+    }
+    event.detail[detailSize] = 0;
+    
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+std::string EventTrace::toJSON() const {
+    std::stringstream out;
+    out << "{\"traceEvents\":[";
+    
+    uint64_t minTimestamp = startTimestamp.load();
+    bool first = true;
+    
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    
+    for (auto& ring : rings) {
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t begin = (head > kRingCapacity) ? head - kRingCapacity : 0;
+        
+        for (uint64_t i = begin; i < head; i++) {
+            const TraceEvent& event = ring->events[i % kRingCapacity];
+            if (event.timestamp < minTimestamp) continue;
+            
+            if (!first) out << ",";
+            first = false;
+            
+            out << "{\"name\":\"" << event.name << "\","
+                << "\"cat\":\"" << event.category << "\","
+                << "\"ph\":\"X\","
+                << "\"ts\":" << event.timestamp << ","
+                << "\"dur\":" << event.duration << ","
+                << "\"pid\":1,"
+                << "\"tid\":" << ring->threadIndex;
+            
+            if (event.detail[0]) {
+                out << ",\"args\":{\"name\":\"";
+                appendEscaped(out, event.detail);
+                out << "\"}";
+            }
+            
+            out << "}";
+        }
+    }
+    
+    out << "],\"displayTimeUnit\":\"ms\"}";
+    
+    return out.str();
+}
+
+bool EventTrace::save(const std::string& tracePath) const {
+    std::ofstream out(tracePath.c_str(), std::ios::out | std::ios::trunc);
+    if (!out) return false;
+    
+    out << toJSON();
+    
+    return out.good();
+}
@@ -0,0 +1,110 @@
+//
+//  EventTrace.h
+//  TestFileManager
+//
+//  Created by Stanislav on 27.01.14.
+//  Copyright (c) 2014 Redsteep. All rights reserved.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <pthread.h>
+#include <stdint.h>
+
+struct TraceEvent {
+    const char* name;         // static string
+    const char* category;     // static string
+    uint64_t timestamp;       // microseconds since recorder creation
+    uint64_t duration;
+    char detail[40];          // resource name, tail kept when truncated
+};
+
+//
+// Scoped duration events written into per-thread ring buffers and exported in
+// Chrome trace JSON format (chrome://tracing, ui.perfetto.dev). Each ring has
+// a single writer, its owner thread, so recording takes no locks; the oldest
+// events are overwritten when a ring is full. When tracing is disabled a scope
+// costs one relaxed atomic load.
+//
+
+class EventTrace {
+public:
+    EventTrace();
+    ~EventTrace();
+    
+    void start();
+    void stop();
+    bool isRecording() const { return recording.load(std::memory_order_relaxed); }
+    
+    uint64_t now() const;
+    void record(const char* name, const char* category, uint64_t timestamp, uint64_t duration, const std::string* detail);
+    
+    // export is meant to run after stop(), events written during export may be torn
+    std::string toJSON() const;
+    bool save(const std::string& tracePath) const;
+    
+private:
+    static const size_t kRingCapacity = 4096;
+    
+    struct ThreadRing {
+        uint32_t threadIndex;
+        std::atomic<uint64_t> head;
+        TraceEvent events[kRingCapacity];
+    };
+    
+    std::atomic<bool> recording;
+    std::atomic<uint64_t> startTimestamp;
+    std::chrono::steady_clock::time_point creationTime;
+    
+    pthread_key_t ringKey;
+    mutable std::mutex ringsMutex;
+    std::vector<std::unique_ptr<ThreadRing>> rings;
+    
+    ThreadRing* threadRing();
+    
+    EventTrace(const EventTrace&);
+    EventTrace &operator=(const EventTrace&);
+};
+
+class TraceEventScope {
+public:
+    TraceEventScope(EventTrace& eventTrace, const char* name, const char* category) :
+        eventTrace(eventTrace.isRecording() ? &eventTrace : nullptr),
+        name(name),
+        category(category),
+        detail(nullptr),
+        timestamp(this->eventTrace ? eventTrace.now() : 0)
+    {
+    }
+    
+    // detail must outlive the scope
+    TraceEventScope(EventTrace& eventTrace, const char* name, const char* category, const std::string& detail) :
+        eventTrace(eventTrace.isRecording() ? &eventTrace : nullptr),
+        name(name),
+        category(category),
+        detail(&detail),
+        timestamp(this->eventTrace ? eventTrace.now() : 0)
+    {
+    }
+    
+    ~TraceEventScope() {
+        if (!eventTrace) return;
+        eventTrace->record(name, category, timestamp, eventTrace->now() - timestamp, detail);
+    }
+    
+private:
+    TraceEventScope(const TraceEventScope&);
+    TraceEventScope &operator=(const TraceEventScope&);
+    
+    EventTrace* eventTrace;
+    const char* name;
+    const char* category;
+    const std::string* detail;
+    uint64_t timestamp;
+};
@@ -0,0 +1,478 @@
+//
+//  IOEngine.cpp
+//  TestFileManager
+//
+//  Created by Stanislav on 03.02.14.
+//  Copyright (c) 2014 Redsteep. All rights reserved.
+//
+
+#include "IOEngine.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#if defined(HAVE_IO_URING) && defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <map>
+#define IO_ENGINE_URING
+#endif
+
+// pread workers, more only add contention on the same device queue
+static const unsigned kMaxPreadThreads = 16;
+
+//
+// pread thread pool
+//
+
+class PreadEngine : public IOEngine {
+public:
+    PreadEngine(unsigned queueDepth) :
+        batch(nullptr),
+        nextRequest(0),
+        pendingRequests(0),
+        stopping(false)
+    {
+        unsigned threadCount = std::max(1u, std::min(queueDepth, kMaxPreadThreads));
+        for (unsigned i = 0; i < threadCount; i++) {
+            workers.push_back(std::thread(&PreadEngine::work, this));
+        }
+    }
+    
+    ~PreadEngine() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        workAvailable.notify_all();
+        
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+    
+    IOEngineType type() const { return IOEnginePread; }
+    const char* name() const { return "pread"; }
+    
+    void submit(std::vector<IORequest>& requests) {
+        if (requests.empty()) return;
+        
+        std::unique_lock<std::mutex> lock(mutex);
+        batch = &requests;
+        nextRequest = 0;
+        pendingRequests = requests.size();
+        workAvailable.notify_all();
+        
+        batchDone.wait(lock, [this] { return pendingRequests == 0; });
+        batch = nullptr;
+    }
+    
+    char* stagingBuffer(size_t size) {
+        if (staging.size() < size) staging.resize(size);
+        return staging.data();
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable workAvailable;
+    std::condition_variable batchDone;
+    
+    std::vector<IORequest>* batch;
+    size_t nextRequest;
+    size_t pendingRequests;
+    bool stopping;
+    
+    std::vector<char> staging;
+    
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        
+        while (true) {
+            workAvailable.wait(lock, [this] { return stopping || (batch && nextRequest < batch->size()); });
+            if (stopping) return;
+            
+            IORequest& request = (*batch)[nextRequest++];
+            lock.unlock();
+            
+            request.result = readFully(request);
+            
+            lock.lock();
+            if (--pendingRequests == 0)
+                batchDone.notify_one();
+        }
+    }
+    
+    static ssize_t readFully(const IORequest& request) {
+        size_t done = 0;
+        
+        while (done < request.length) {
+            ssize_t ret = pread(request.fd, (char*)request.buffer + done, request.length - done, request.offset + done);
+            if (ret < 0 && errno == EINTR) continue;
+            if (ret < 0) return -errno;
+            if (ret == 0) break;
+            
+            done += ret;
+        }
+        
+        return done;
+    }
+};
+
+//
+// io_uring
+//
+
+#ifdef IO_ENGINE_URING
+
+// files of one batch are registered in these slots for the time of the batch
+static const unsigned kRegisteredFileSlots = 64;
+// a single read is capped by the 32 bit sqe length
+static const size_t kMaxUringReadLength = 1u << 30;
+
+class UringEngine : public IOEngine {
+public:
+    static std::unique_ptr<IOEngine> create(unsigned queueDepth) {
+        std::unique_ptr<UringEngine> engine(new UringEngine(queueDepth));
+        if (!engine->setup()) return nullptr;
+        
+        return std::unique_ptr<IOEngine>(engine.release());
+    }
+    
+    ~UringEngine() {
+        if (stagingData) munmap(stagingData, stagingCapacity);
+        if (sqes) munmap(sqes, sqesSize);
+        if (cqRing && cqRing != sqRing) munmap(cqRing, cqRingSize);
+        if (sqRing) munmap(sqRing, sqRingSize);
+        if (ringFd >= 0) close(ringFd);
+    }
+    
+    IOEngineType type() const { return IOEngineUring; }
+    const char* name() const { return "io_uring"; }
+    
+    void submit(std::vector<IORequest>& requests);
+    char* stagingBuffer(size_t size);
+
+private:
+    unsigned queueDepth;
+    int ringFd;
+    
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    io_uring_sqe* sqes;
+    size_t sqesSize;
+    
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned sqMask;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    io_uring_cqe* cqes;
+    
+    bool filesRegistered;
+    bool buffersRegistered;     // staging memory, READ_FIXED only when it is
+    
+    char* stagingData;
+    size_t stagingCapacity;
+    
+    UringEngine(unsigned queueDepth) :
+        queueDepth(queueDepth),
+        ringFd(-1),
+        sqRing(nullptr), sqRingSize(0),
+        cqRing(nullptr), cqRingSize(0),
+        sqes(nullptr), sqesSize(0),
+        filesRegistered(false),
+        buffersRegistered(false),
+        stagingData(nullptr),
+        stagingCapacity(0)
+    {
+    }
+    
+    bool setup();
+    bool supportsOpcode(unsigned opcode) const;
+    void registerFiles(const std::vector<int>& fds);
+    void fillRead(IORequest& request, size_t index, int fileSlot);
+    unsigned reapCompletions(std::vector<IORequest>& requests, std::vector<size_t>* queue);
+    void drain(std::vector<IORequest>& requests, unsigned inFlight);
+    
+    static int enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+        return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+    }
+    
+    static int registerResource(int fd, unsigned opcode, const void* arg, unsigned count) {
+        return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+    }
+};
+
+bool UringEngine::setup() {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    
+    ringFd = (int)syscall(__NR_io_uring_setup, queueDepth, &params);
+    if (ringFd < 0) return false;
+    
+    // IORING_OP_READ came with 5.6, older kernels fail these reads with -EINVAL
+    // and are left to the pread pool; so are kernels without the probe itself
+    if (!supportsOpcode(IORING_OP_READ) || !supportsOpcode(IORING_OP_READ_FIXED)) return false;
+    
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) { sqRing = nullptr; return false; }
+    
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cqRing = sqRing;
+    }
+    else {
+        cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) { cqRing = nullptr; return false; }
+    }
+    
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqesMemory = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sqesMemory == MAP_FAILED) return false;
+    sqes = (io_uring_sqe*)sqesMemory;
+    
+    char* sq = (char*)sqRing;
+    sqHead = (unsigned*)(sq + params.sq_off.head);
+    sqTail = (unsigned*)(sq + params.sq_off.tail);
+    sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    
+    // sqes are used in ring order, the indirection array maps slots to themselves
+    unsigned* sqArray = (unsigned*)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        sqArray[i] = i;
+    }
+    
+    char* cq = (char*)cqRing;
+    cqHead = (unsigned*)(cq + params.cq_off.head);
+    cqTail = (unsigned*)(cq + params.cq_off.tail);
+    cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    
+    queueDepth = std::min(queueDepth, params.sq_entries);
+    
+    // empty slots, filled per batch; plain descriptors are used if this fails
+    std::vector<int> emptySlots(kRegisteredFileSlots, -1);
+    filesRegistered = registerResource(ringFd, IORING_REGISTER_FILES, emptySlots.data(), kRegisteredFileSlots) == 0;
+    
+    return true;
+}
+
+bool UringEngine::supportsOpcode(unsigned opcode) const {
+    const unsigned opCount = 256;
+    std::vector<char> probeMemory(sizeof(io_uring_probe) + opCount * sizeof(io_uring_probe_op), 0);
+    io_uring_probe* probe = (io_uring_probe*)probeMemory.data();
+    if (registerResource(ringFd, IORING_REGISTER_PROBE, probe, opCount) < 0) return false;
+    
+    return opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+}
+
+void UringEngine::registerFiles(const std::vector<int>& fds) {
+    io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = 0;
+    update.fds = (uint64_t)(uintptr_t)fds.data();
+    
+    if (registerResource(ringFd, IORING_REGISTER_FILES_UPDATE, &update, (unsigned)fds.size()) < 0)
+        filesRegistered = false;
+}
+
+char* UringEngine::stagingBuffer(size_t size) {
+    if (size <= stagingCapacity) return stagingData;
+    
+    if (stagingData) {
+        if (buffersRegistered)
+            registerResource(ringFd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+        buffersRegistered = false;
+        munmap(stagingData, stagingCapacity);
+        stagingData = nullptr;
+        stagingCapacity = 0;
+    }
+    
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t capacity = (size + pageSize - 1) / pageSize * pageSize;
+    
+    void* data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) return nullptr;
+    
+    stagingData = (char*)data;
+    stagingCapacity = capacity;
+    
+    // reads landing here use READ_FIXED, the pages stay pinned instead of
+    // being mapped for every request; plain reads when pinning fails, e.g.
+    // over RLIMIT_MEMLOCK
+    iovec staging = { stagingData, stagingCapacity };
+    buffersRegistered = registerResource(ringFd, IORING_REGISTER_BUFFERS, &staging, 1) == 0;
+    
+    return stagingData;
+}
+
+void UringEngine::fillRead(IORequest& request, size_t index, int fileSlot) {
+    unsigned tail = *sqTail;
+    io_uring_sqe* sqe = &sqes[tail & sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    
+    // result holds the bytes read so far until the request completes
+    size_t done = request.result;
+    char* buffer = (char*)request.buffer + done;
+    
+    bool fixedBuffer = buffersRegistered && buffer >= stagingData && buffer < stagingData + stagingCapacity;
+    
+    sqe->opcode = fixedBuffer ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = fileSlot >= 0 ? fileSlot : request.fd;
+    sqe->flags = fileSlot >= 0 ? IOSQE_FIXED_FILE : 0;
+    sqe->off = request.offset + done;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = (unsigned)std::min(request.length - done, kMaxUringReadLength);
+    sqe->buf_index = 0;
+    sqe->user_data = index;
+    
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// completions posted so far; interrupted and short reads go back to the
+// queue, or stay as they are without one
+unsigned UringEngine::reapCompletions(std::vector<IORequest>& requests, std::vector<size_t>* queue) {
+    unsigned head = *cqHead;
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    unsigned reaped = 0;
+    
+    for (; head != tail; head++, reaped++) {
+        const io_uring_cqe& cqe = cqes[head & cqMask];
+        IORequest& request = requests[cqe.user_data];
+        
+        if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+            if (queue) queue->push_back(cqe.user_data);
+        }
+        else if (cqe.res < 0) {
+            request.result = cqe.res;
+        }
+        else if (cqe.res > 0) {
+            request.result += cqe.res;
+            
+            // short read before the end of the file
+            if (queue && (size_t)request.result < request.length)
+                queue->push_back(cqe.user_data);
+        }
+    }
+    
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    
+    return reaped;
+}
+
+// waits until the kernel is done with submitted reads
+void UringEngine::drain(std::vector<IORequest>& requests, unsigned inFlight) {
+    while (inFlight > 0) {
+        unsigned reaped = reapCompletions(requests, nullptr);
+        inFlight -= std::min(reaped, inFlight);
+        if (reaped || inFlight == 0) continue;
+        
+        if (enter(ringFd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            break;
+    }
+}
+
+void UringEngine::submit(std::vector<IORequest>& requests) {
+    if (requests.empty()) return;
+    
+    // every distinct descriptor of the batch gets a registered slot while there are any
+    std::map<int, int> fileSlots;
+    std::vector<int> slotFds;
+    if (filesRegistered) {
+        for (auto& request : requests) {
+            if (fileSlots.count(request.fd) || slotFds.size() == kRegisteredFileSlots) continue;
+            
+            fileSlots[request.fd] = (int)slotFds.size();
+            slotFds.push_back(request.fd);
+        }
+        registerFiles(slotFds);
+        if (!filesRegistered) fileSlots.clear();
+    }
+    
+    std::vector<size_t> queue;
+    for (size_t i = requests.size(); i > 0; i--) {
+        requests[i - 1].result = 0;
+        queue.push_back(i - 1);
+    }
+    
+    unsigned inFlight = 0;
+    
+    while (!queue.empty() || inFlight > 0) {
+        while (!queue.empty() && inFlight < queueDepth) {
+            size_t index = queue.back();
+            queue.pop_back();
+            
+            auto it = fileSlots.find(requests[index].fd);
+            fillRead(requests[index], index, it != fileSlots.end() ? it->second : -1);
+            inFlight++;
+        }
+        
+        unsigned toSubmit = *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        int ret = enter(ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            // the ring is unusable; the kernel may still write into buffers
+            // of reads it took, wait for them, then finish the batch with
+            // plain reads
+            unsigned unsubmitted = *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+            __atomic_store_n(sqTail, *sqTail - unsubmitted, __ATOMIC_RELEASE);
+            drain(requests, inFlight - unsubmitted);
+            
+            for (auto& request : requests) {
+                while (request.result >= 0 && (size_t)request.result < request.length) {
+                    ssize_t read = pread(request.fd, (char*)request.buffer + request.result, request.length - request.result, request.offset + request.result);
+                    if (read <= 0) break;
+                    request.result += read;
+                }
+            }
+            break;
+        }
+        
+        inFlight -= reapCompletions(requests, &queue);
+    }
+    
+    if (!slotFds.empty() && filesRegistered) {
+        std::fill(slotFds.begin(), slotFds.end(), -1);
+        registerFiles(slotFds);
+    }
+}
+
+#endif
+
+std::unique_ptr<IOEngine> IOEngine::create(IOEngineType type, unsigned queueDepth) {
+    queueDepth = std::max(1u, queueDepth);
+    
+    switch (type) {
+        case IOEngineStdio:
+            return nullptr;
+        
+        case IOEngineUring: {
+#ifdef IO_ENGINE_URING
+            std::unique_ptr<IOEngine> engine = UringEngine::create(queueDepth);
+            if (engine) return engine;
+#endif
+            // kernels without io_uring or where it's disabled, and other platforms
+            return std::unique_ptr<IOEngine>(new PreadEngine(queueDepth));
+        }
+        
+        case IOEnginePread:
+            return std::unique_ptr<IOEngine>(new PreadEngine(queueDepth));
+    }
+    
+    return nullptr;
+}
@@ -0,0 +1,52 @@
+//
+//  IOEngine.h
+//  TestFileManager
+//
+//  Created by Stanislav on 03.02.14.
+//  Copyright (c) 2014 Redsteep. All rights reserved.
+//
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+enum IOEngineType {
+    IOEngineStdio,      // one blocking FILE* read per resource, as without an engine
+    IOEnginePread,      // positional reads spread over a thread pool
+    IOEngineUring       // io_uring, Linux built with HAVE_IO_URING; falls back to IOEnginePread
+};
+
+struct IORequest {
+    int fd;
+    uint64_t offset;
+    void* buffer;
+    size_t length;
+    
+    ssize_t result;     // bytes read, short only at end of file, or -errno
+};
+
+//
+// Batched positional reads. submit() keeps up to queueDepth requests in
+// flight and returns when all of them completed; files and staging memory
+// are registered with the kernel where the engine supports it.
+//
+
+class IOEngine {
+public:
+    static std::unique_ptr<IOEngine> create(IOEngineType type, unsigned queueDepth);
+    
+    virtual ~IOEngine() {}
+    
+    virtual IOEngineType type() const = 0;
+    virtual const char* name() const = 0;
+    
+    virtual void submit(std::vector<IORequest>& requests) = 0;
+    
+    // scratch memory for reads whose data is consumed right after the batch,
+    // e.g. compressed payloads; valid until the next call
+    virtual char* stagingBuffer(size_t size) = 0;
+};
@@ -0,0 +1,162 @@
+//
+//  PathNormalizer.cpp
+//  TestFileManager
+//
+//  Created by Stanislav on 31.01.14.
+//  Copyright (c) 2014 Redsteep. All rights reserved.
+//
+
+#include "PathNormalizer.h"
+
+#include <stdint.h>
+#include <vector>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define PATH_NORMALIZER_NEON
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define PATH_NORMALIZER_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define PATH_NORMALIZER_SSE2
+#endif
+
+static inline size_t normalizeScalar(const char* path, size_t length, char* out, size_t outLength, bool afterSlash) {
+    for (size_t i = 0; i < length; i++) {
+        char c = path[i];
+        
+        if (c == '\\') c = '/';
+        else if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        
+        bool slash = (c == '/');
+        if (!(slash && afterSlash))
+            out[outLength++] = c;
+        
+        afterSlash = slash;
+    }
+    
+    return outLength;
+}
+
+size_t normalizePath(const char* path, size_t length, char* out) {
+    size_t i = 0;
+    size_t outLength = 0;
+    bool afterSlash = false;
+    
+#if defined(PATH_NORMALIZER_NEON)
+    const uint8x16_t upperA = vdupq_n_u8('A');
+    const uint8x16_t upperRange = vdupq_n_u8('Z' - 'A');
+    const uint8x16_t caseBit = vdupq_n_u8('a' - 'A');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t slash = vdupq_n_u8('/');
+    
+    for (; i + 16 <= length; i += 16) {
+        uint8x16_t block = vld1q_u8((const uint8_t*)path + i);
+        
+        uint8x16_t upper = vcleq_u8(vsubq_u8(block, upperA), upperRange);
+        block = vorrq_u8(block, vandq_u8(upper, caseBit));
+        block = vbslq_u8(vceqq_u8(block, backslash), slash, block);
+        
+        // a separator following another one, the previous byte of the first
+        // lane being the last one written
+        uint8x16_t slashes = vceqq_u8(block, slash);
+        uint8x16_t previous = vextq_u8(vdupq_n_u8(afterSlash ? 0xff : 0), slashes, 15);
+        uint64x2_t repeated = vreinterpretq_u64_u8(vandq_u8(slashes, previous));
+        
+        if (vgetq_lane_u64(repeated, 0) | vgetq_lane_u64(repeated, 1)) {
+            outLength = normalizeScalar(path + i, 16, out, outLength, afterSlash);
+        }
+        else {
+            vst1q_u8((uint8_t*)out + outLength, block);
+            outLength += 16;
+        }
+        
+        afterSlash = (out[outLength - 1] == '/');
+    }
+#elif defined(PATH_NORMALIZER_AVX2)
+    const __m256i beforeA = _mm256_set1_epi8('A' - 1);
+    const __m256i afterZ = _mm256_set1_epi8('Z' + 1);
+    const __m256i caseBit = _mm256_set1_epi8('a' - 'A');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i slash = _mm256_set1_epi8('/');
+    
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(path + i));
+        
+        // signed compares, bytes above 0x7f are negative and never in range
+        __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(block, beforeA), _mm256_cmpgt_epi8(afterZ, block));
+        block = _mm256_or_si256(block, _mm256_and_si256(upper, caseBit));
+        block = _mm256_blendv_epi8(block, slash, _mm256_cmpeq_epi8(block, backslash));
+        
+        uint32_t slashes = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, slash));
+        
+        if (slashes & ((slashes << 1) | (afterSlash ? 1 : 0))) {
+            outLength = normalizeScalar(path + i, 32, out, outLength, afterSlash);
+        }
+        else {
+            _mm256_storeu_si256((__m256i*)(out + outLength), block);
+            outLength += 32;
+        }
+        
+        afterSlash = (out[outLength - 1] == '/');
+    }
+#elif defined(PATH_NORMALIZER_SSE2)
+    const __m128i beforeA = _mm_set1_epi8('A' - 1);
+    const __m128i afterZ = _mm_set1_epi8('Z' + 1);
+    const __m128i caseBit = _mm_set1_epi8('a' - 'A');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i slash = _mm_set1_epi8('/');
+    
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(path + i));
+        
+        // signed compares, bytes above 0x7f are negative and never in range
+        __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(block, beforeA), _mm_cmplt_epi8(block, afterZ));
+        block = _mm_or_si128(block, _mm_and_si128(upper, caseBit));
+        
+        __m128i backslashes = _mm_cmpeq_epi8(block, backslash);
+        block = _mm_or_si128(_mm_andnot_si128(backslashes, block), _mm_and_si128(backslashes, slash));
+        
+        uint32_t slashes = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, slash));
+        
+        if (slashes & ((slashes << 1) | (afterSlash ? 1 : 0))) {
+            outLength = normalizeScalar(path + i, 16, out, outLength, afterSlash);
+        }
+        else {
+            _mm_storeu_si128((__m128i*)(out + outLength), block);
+            outLength += 16;
+        }
+        
+        afterSlash = (out[outLength - 1] == '/');
+    }
+#endif
+    
+    return normalizeScalar(path + i, length - i, out, outLength, afterSlash);
+}
+
+std::string normalizePath(const std::string& path) {
+    if (path.size() <= kNormalizePathStackSize) {
+        char buffer[kNormalizePathStackSize];
+        size_t length = normalizePath(path.data(), path.size(), buffer);
+        
+        return std::string(buffer, length);
+    }
+    
+    std::vector<char> buffer(path.size());
+    size_t length = normalizePath(path.data(), path.size(), buffer.data());
+    
+    return std::string(buffer.data(), length);
+}
+
+const char* normalizePathImplementation() {
+#if defined(PATH_NORMALIZER_NEON)
+    return "neon";
+#elif defined(PATH_NORMALIZER_AVX2)
+    return "avx2";
+#elif defined(PATH_NORMALIZER_SSE2)
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
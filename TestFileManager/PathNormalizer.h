@@ -0,0 +1,31 @@
+//
+//  PathNormalizer.h
+//  TestFileManager
+//
+//  Created by Stanislav on 31.01.14.
+//  Copyright (c) 2014 Redsteep. All rights reserved.
+//
+
+#pragma once
+
+#include <string>
+#include <stddef.h>
+
+//
+// Index keys in one pass: ASCII letters are lowercased, '\' becomes '/' and
+// runs of separators collapse into one. Blocks are handled with NEON, AVX2 or
+// SSE2 depending on what the target is built for, blocks with a repeated
+// separator and the tail go through the scalar loop.
+//
+
+// out needs room for length bytes and may be the same buffer as path,
+// returns the normalized length
+size_t normalizePath(const char* path, size_t length, char* out);
+
+// paths up to kNormalizePathStackSize bytes are normalized on the stack
+const size_t kNormalizePathStackSize = 256;
+
+std::string normalizePath(const std::string& path);
+
+// name of the code path normalizePath was built with
+const char* normalizePathImplementation();
@@ -0,0 +1,197 @@
+//
+//  RadixTree.h
+//  TestFileManager
+//
+//  Created by Stanislav on 30.01.14.
+//  Copyright (c) 2014 Redsteep. All rights reserved.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+//
+// Compressed trie over normalized relative paths. Every path is stored once,
+// split into edges shared with its neighbours; lookups cost the key length,
+// and walking a prefix first lets a lookup start below a search root without
+// the tree holding a second copy of the paths under it.
+//
+
+template <typename Value>
+class RadixTree {
+public:
+    struct Node {
+        std::string edge;                               // label from the parent
+        Value value = Value();
+        bool hasValue = false;
+        std::vector<std::unique_ptr<Node>> children;    // sorted by first edge char
+    };
+    
+    RadixTree() : root(new Node()), count(0) {}
+    
+    void clear() {
+        root.reset(new Node());
+        count = 0;
+    }
+    
+    size_t size() const {
+        return count;
+    }
+    
+    const Node* rootNode() const {
+        return root.get();
+    }
+    
+    // slot for key, created empty when missing
+    Value& operator[](const std::string& key) {
+        Node* node = root.get();
+        size_t pos = 0;
+        
+        while (pos < key.size()) {
+            auto it = findChild(node, key[pos]);
+            if (it == node->children.end() || (*it)->edge[0] != key[pos]) {
+                std::unique_ptr<Node> leaf(new Node());
+                leaf->edge = key.substr(pos);
+                Node* leafNode = leaf.get();
+                node->children.insert(it, std::move(leaf));
+                node = leafNode;
+                break;
+            }
+            
+            Node* child = it->get();
+            size_t common = commonLength(child->edge, key, pos);
+            
+            if (common < child->edge.size()) {
+                // split the edge, the existing child keeps its identity below the new node
+                std::unique_ptr<Node> middle(new Node());
+                middle->edge = child->edge.substr(0, common);
+                child->edge.erase(0, common);
+                
+                middle->children.push_back(std::move(*it));
+                it->reset(middle.release());
+                child = it->get();
+            }
+            
+            node = child;
+            pos += common;
+        }
+        
+        if (!node->hasValue) {
+            node->hasValue = true;
+            count++;
+        }
+        
+        return node->value;
+    }
+    
+    // node the key ends on exactly, nullptr when it ends mid-edge or is missing
+    const Node* find(const Node* node, const std::string& key, size_t pos = 0) const {
+        while (node && pos < key.size()) {
+            auto it = findChild(node, key[pos]);
+            if (it == node->children.end() || (*it)->edge[0] != key[pos]) return nullptr;
+            
+            const Node* child = it->get();
+            if (key.compare(pos, child->edge.size(), child->edge) != 0) return nullptr;
+            
+            node = child;
+            pos += child->edge.size();
+        }
+        
+        return node;
+    }
+    
+    // same as find(node, head + tail) without building the concatenated key
+    const Node* find(const Node* node, const std::string& head, const std::string& tail) const {
+        size_t length = head.size() + tail.size();
+        size_t pos = 0;
+        
+        auto keyChar = [&head, &tail](size_t i) {
+            return i < head.size() ? head[i] : tail[i - head.size()];
+        };
+        
+        while (node && pos < length) {
+            auto it = findChild(node, keyChar(pos));
+            if (it == node->children.end() || (*it)->edge[0] != keyChar(pos)) return nullptr;
+            
+            const Node* child = it->get();
+            if (child->edge.size() > length - pos) return nullptr;
+            
+            for (size_t i = 1; i < child->edge.size(); i++) {
+                if (child->edge[i] != keyChar(pos + i)) return nullptr;
+            }
+            
+            node = child;
+            pos += child->edge.size();
+        }
+        
+        return node;
+    }
+    
+    // highest node whose path starts with prefix, its full path goes to *path
+    const Node* findPrefix(const Node* node, const std::string& prefix, std::string* path) const {
+        size_t pos = 0;
+        
+        while (node && pos < prefix.size()) {
+            auto it = findChild(node, prefix[pos]);
+            if (it == node->children.end() || (*it)->edge[0] != prefix[pos]) return nullptr;
+            
+            const Node* child = it->get();
+            size_t length = std::min(child->edge.size(), prefix.size() - pos);
+            if (prefix.compare(pos, length, child->edge, 0, length) != 0) return nullptr;
+            
+            path->append(child->edge);
+            node = child;
+            pos += child->edge.size();
+        }
+        
+        return node;
+    }
+    
+    // calls visitor(path, value) for values below node in path order;
+    // descend(path, parentLength) returning false skips the subtree of a child
+    template <typename Visitor, typename Descend>
+    void visit(const Node* node, std::string& path, Visitor visitor, Descend descend) const {
+        if (node->hasValue)
+            visitor(path, node->value);
+        
+        for (auto& child : node->children) {
+            size_t length = path.size();
+            path.append(child->edge);
+            
+            if (descend(path, length))
+                visit(child.get(), path, visitor, descend);
+            
+            path.resize(length);
+        }
+    }
+
+private:
+    std::unique_ptr<Node> root;
+    size_t count;
+    
+    typedef typename std::vector<std::unique_ptr<Node>>::const_iterator ChildIterator;
+    
+    static ChildIterator findChild(const Node* node, char first) {
+        return std::lower_bound(node->children.begin(), node->children.end(), first,
+                                [](const std::unique_ptr<Node>& child, char c) {
+                                    return (unsigned char)child->edge[0] < (unsigned char)c;
+                                });
+    }
+    
+    static typename std::vector<std::unique_ptr<Node>>::iterator findChild(Node* node, char first) {
+        return std::lower_bound(node->children.begin(), node->children.end(), first,
+                                [](const std::unique_ptr<Node>& child, char c) {
+                                    return (unsigned char)child->edge[0] < (unsigned char)c;
+                                });
+    }
+    
+    static size_t commonLength(const std::string& edge, const std::string& key, size_t pos) {
+        size_t length = 0;
+        while (length < edge.size() && pos + length < key.size() && edge[length] == key[pos + length])
+            length++;
+        return length;
+    }
+};
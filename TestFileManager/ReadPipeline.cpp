@@ -0,0 +1,103 @@
+//
+//  ReadPipeline.cpp
+//  TestFileManager
+//
+//  Created by Stanislav on 06.02.14.
+//  Copyright (c) 2014 Redsteep. All rights reserved.
+//
+
+#include "ReadPipeline.h"
+
+#include <unistd.h>
+#include <errno.h>
+
+#include <algorithm>
+#include <exception>
+
+ReadPipeline::ReadPipeline(int fd, uint64_t offset, uint64_t length, size_t chunkSize, unsigned ringSize) :
+    fd(fd),
+    offset(offset),
+    length(length),
+    chunkSize(std::max<size_t>(chunkSize, 1)),
+    filledChunks(0),
+    consumedChunks(0),
+    failed(false),
+    stopping(false)
+{
+    chunkCount = (length + this->chunkSize - 1) / this->chunkSize;
+    
+    // one chunk is with the consumer, the rest can be read ahead
+    ringSize = (unsigned)std::min<uint64_t>(std::max(ringSize, 2u), std::max<uint64_t>(chunkCount, 1));
+    for (unsigned i = 0; i < ringSize; i++) {
+        ring.push_back(std::unique_ptr<unsigned char[]>(new unsigned char[this->chunkSize]));
+    }
+    chunkSizes.resize(ringSize);
+    
+    reader = std::thread(&ReadPipeline::read, this);
+}
+
+ReadPipeline::~ReadPipeline() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    chunkReleased.notify_one();
+    
+    reader.join();
+}
+
+const unsigned char* ReadPipeline::next(size_t* size) {
+    std::unique_lock<std::mutex> lock(mutex);
+    
+    // the chunk returned last time goes back to the reader
+    if (consumedChunks > 0) {
+        chunkReleased.notify_one();
+    }
+    
+    *size = 0;
+    if (consumedChunks == chunkCount) return nullptr;
+    
+    chunkFilled.wait(lock, [this] { return filledChunks > consumedChunks || failed; });
+    if (filledChunks == consumedChunks) throw std::exception();
+    
+    size_t slot = consumedChunks % ring.size();
+    consumedChunks++;
+    
+    *size = chunkSizes[slot];
+    return ring[slot].get();
+}
+
+void ReadPipeline::read() {
+    for (uint64_t chunk = 0; chunk < chunkCount; chunk++) {
+        size_t slot = chunk % ring.size();
+        
+        {
+            // a slot is reused once the consumer asked for the chunk after the one it held
+            std::unique_lock<std::mutex> lock(mutex);
+            chunkReleased.wait(lock, [this, chunk] { return stopping || chunk < ring.size() || chunk + 1 < consumedChunks + ring.size(); });
+            if (stopping) return;
+        }
+        
+        uint64_t chunkOffset = chunk * chunkSize;
+        size_t size = (size_t)std::min<uint64_t>(chunkSize, length - chunkOffset);
+        
+        size_t bytesRead = 0;
+        while (bytesRead < size) {
+            ssize_t ret = pread(fd, ring[slot].get() + bytesRead, size - bytesRead, offset + chunkOffset + bytesRead);
+            if (ret < 0 && errno == EINTR) continue;
+            if (ret <= 0) break;
+            bytesRead += ret;
+        }
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        if (bytesRead < size) {
+            failed = true;
+            chunkFilled.notify_one();
+            return;
+        }
+        
+        chunkSizes[slot] = size;
+        filledChunks++;
+        chunkFilled.notify_one();
+    }
+}
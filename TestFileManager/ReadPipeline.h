@@ -0,0 +1,66 @@
+//
+//  ReadPipeline.h
+//  TestFileManager
+//
+//  Created by Stanislav on 06.02.14.
+//  Copyright (c) 2014 Redsteep. All rights reserved.
+//
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Reads a byte range of a file ahead of its consumer on a thread of its own.
+// Chunks land in a ring of buffers in order; next() hands the consumer the
+// oldest filled chunk and gives the previous one back to the reader, so disk
+// reads of the following chunks overlap whatever the consumer does with the
+// current one, e.g. inflate.
+//
+
+class ReadPipeline {
+public:
+    static const size_t kDefaultChunkSize = 256 * 1024;
+    static const unsigned kDefaultRingSize = 4;
+    
+    ReadPipeline(int fd, uint64_t offset, uint64_t length,
+                 size_t chunkSize = kDefaultChunkSize, unsigned ringSize = kDefaultRingSize);
+    // stops the reader, chunks not consumed yet are dropped
+    ~ReadPipeline();
+    
+    // next chunk in file order, valid until the following call; nullptr after
+    // the last one. Throws std::exception when a read failed or ended early
+    const unsigned char* next(size_t* size);
+    
+private:
+    int fd;
+    uint64_t offset;
+    uint64_t length;
+    size_t chunkSize;
+    
+    std::vector<std::unique_ptr<unsigned char[]>> ring;
+    std::vector<size_t> chunkSizes;
+    
+    std::mutex mutex;
+    std::condition_variable chunkFilled;
+    std::condition_variable chunkReleased;
+    
+    uint64_t filledChunks;      // written by the reader
+    uint64_t consumedChunks;    // handed to the consumer, the last one still in use
+    uint64_t chunkCount;
+    bool failed;
+    bool stopping;
+    
+    std::thread reader;
+    
+    void read();
+    
+    ReadPipeline(const ReadPipeline&);
+    ReadPipeline &operator=(const ReadPipeline&);
+};
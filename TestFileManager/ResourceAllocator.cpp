@@ -0,0 +1,162 @@
+//
+//  ResourceAllocator.cpp
+//  TestFileManager
+//
+//  Created by Stanislav on 04.02.14.
+//  Copyright (c) 2014 Redsteep. All rights reserved.
+//
+
+#include "ResourceAllocator.h"
+
+#include <stdint.h>
+#include <exception>
+#include <new>
+#include <algorithm>
+
+// offset of the first address at or after data + offset aligned to alignment, a power of two
+static size_t alignedOffset(const char* data, size_t offset, size_t alignment) {
+    uintptr_t address = (uintptr_t)data + offset;
+    return offset + ((alignment - (address & (alignment - 1))) & (alignment - 1));
+}
+
+// in-class constants bound to references, e.g. by std::max
+const size_t ResourceAllocator::kDefaultAlignment;
+const size_t ResourcePool::kMinSize;
+const size_t ResourcePool::kMaxSize;
+const size_t ResourcePool::kSlabSize;
+const size_t ResourcePool::kClassCount;
+
+//
+// ResourceArena
+//
+
+ResourceArena::ResourceArena(size_t blockSize) :
+    blockSize(blockSize),
+    currentBlock(0),
+    currentOffset(0),
+    allocatedBytes(0),
+    lastAllocation(nullptr)
+{
+}
+
+void* ResourceArena::allocate(size_t size, size_t alignment /* = kDefaultAlignment */) {
+    while (currentBlock < blocks.size()) {
+        Block& block = blocks[currentBlock];
+        size_t offset = alignedOffset(block.data.get(), currentOffset, alignment);
+        
+        if (offset + size <= block.size) {
+            currentOffset = offset + size;
+            allocatedBytes += size;
+            lastAllocation = block.data.get() + offset;
+            return lastAllocation;
+        }
+        
+        currentBlock++;
+        currentOffset = 0;
+    }
+    
+    // oversized requests get a block of their own
+    Block block;
+    block.size = std::max(blockSize, size + alignment);
+    block.data.reset(new char[block.size]);
+    blocks.push_back(std::move(block));
+    
+    size_t offset = alignedOffset(blocks.back().data.get(), 0, alignment);
+    
+    currentBlock = blocks.size() - 1;
+    currentOffset = offset + size;
+    allocatedBytes += size;
+    lastAllocation = blocks.back().data.get() + offset;
+    
+    return lastAllocation;
+}
+
+void ResourceArena::deallocate(void* data, size_t size) {
+    if (data != lastAllocation || currentBlock >= blocks.size()) return;
+    
+    currentOffset = (char*)data - blocks[currentBlock].data.get();
+    allocatedBytes -= size;
+    lastAllocation = nullptr;
+}
+
+void ResourceArena::reset() {
+    currentBlock = 0;
+    currentOffset = 0;
+    allocatedBytes = 0;
+    lastAllocation = nullptr;
+}
+
+void ResourceArena::release() {
+    blocks.clear();
+    reset();
+}
+
+size_t ResourceArena::bytesReserved() const {
+    size_t reservedBytes = 0;
+    for (auto& block : blocks) {
+        reservedBytes += block.size;
+    }
+    return reservedBytes;
+}
+
+//
+// ResourcePool
+//
+
+ResourcePool::ResourcePool() :
+    reservedBytes(0)
+{
+}
+
+ResourcePool::~ResourcePool() {
+}
+
+size_t ResourcePool::sizeClass(size_t size) {
+    size_t sizeClass = 0;
+    for (size_t classSize = kMinSize; classSize < size; classSize <<= 1) {
+        sizeClass++;
+    }
+    return sizeClass;
+}
+
+void* ResourcePool::allocate(size_t size, size_t alignment /* = kDefaultAlignment */) {
+    // slabs and operator new give no more than the default alignment
+    if (alignment > kDefaultAlignment) throw std::exception();
+    
+    if (size > kMaxSize) {
+        return operator new(size);
+    }
+    
+    size_t index = sizeClass(size);
+    std::vector<void*>& freeList = freeBlocks[index];
+    
+    if (freeList.empty()) {
+        // class sizes are multiples of the default alignment, so are offsets in the slab
+        size_t classSize = kMinSize << index;
+        size_t slabSize = std::max(kSlabSize, classSize);
+        
+        slabs.push_back(std::unique_ptr<char[]>(new char[slabSize]));
+        reservedBytes += slabSize;
+        
+        char* slab = slabs.back().get();
+        for (size_t offset = slabSize; offset >= classSize; offset -= classSize) {
+            freeList.push_back(slab + offset - classSize);
+        }
+    }
+    
+    void* data = freeList.back();
+    freeList.pop_back();
+    
+    return data;
+}
+
+void ResourcePool::deallocate(void* data, size_t size) {
+    if (!data) return;
+    
+    if (size > kMaxSize) {
+        operator delete(data);
+        return;
+    }
+    
+    freeBlocks[sizeClass(size)].push_back(data);
+}
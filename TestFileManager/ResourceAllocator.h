@@ -0,0 +1,99 @@
+//
+//  ResourceAllocator.h
+//  TestFileManager
+//
+//  Created by Stanislav on 04.02.14.
+//  Copyright (c) 2014 Redsteep. All rights reserved.
+//
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <stddef.h>
+
+//
+// Memory whole-resource reads are placed in. readData asks for the exact
+// resource size once and gives the block back only if the read fails;
+// otherwise the caller owns it under the allocator's rules.
+//
+
+class ResourceAllocator {
+public:
+    static const size_t kDefaultAlignment = 16;
+    
+    virtual ~ResourceAllocator() {}
+    
+    virtual void* allocate(size_t size, size_t alignment = kDefaultAlignment) = 0;
+    virtual void deallocate(void* data, size_t size) = 0;
+};
+
+//
+// Bump allocator over large blocks for data that dies together, e.g. a level.
+// deallocate only takes back the latest allocation; reset() rewinds all
+// blocks for reuse and release() frees them. Not thread safe.
+//
+
+class ResourceArena : public ResourceAllocator {
+public:
+    explicit ResourceArena(size_t blockSize = 1024 * 1024);
+    
+    void* allocate(size_t size, size_t alignment = kDefaultAlignment);
+    void deallocate(void* data, size_t size);
+    
+    void reset();
+    void release();
+    
+    size_t bytesAllocated() const { return allocatedBytes; }
+    size_t bytesReserved() const;
+    
+private:
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+    
+    size_t blockSize;
+    std::vector<Block> blocks;
+    size_t currentBlock;
+    size_t currentOffset;
+    size_t allocatedBytes;
+    char* lastAllocation;
+    
+    ResourceArena(const ResourceArena&);
+    ResourceArena &operator=(const ResourceArena&);
+};
+
+//
+// Power of two size classes from kMinSize to kMaxSize carved from 64 KiB slabs,
+// freed blocks are kept on per class free lists and never return to the
+// system before the pool is destroyed; larger requests go to operator new.
+// Not thread safe.
+//
+
+class ResourcePool : public ResourceAllocator {
+public:
+    static const size_t kMinSize = 64;
+    static const size_t kMaxSize = 1024 * 1024;
+    
+    ResourcePool();
+    ~ResourcePool();
+    
+    void* allocate(size_t size, size_t alignment = kDefaultAlignment);
+    void deallocate(void* data, size_t size);
+    
+    size_t bytesReserved() const { return reservedBytes; }
+    
+private:
+    static const size_t kSlabSize = 64 * 1024;
+    static const size_t kClassCount = 15;   // 64 .. 1 MiB
+    
+    std::vector<void*> freeBlocks[kClassCount];
+    std::vector<std::unique_ptr<char[]>> slabs;
+    size_t reservedBytes;
+    
+    static size_t sizeClass(size_t size);
+    
+    ResourcePool(const ResourcePool&);
+    ResourcePool &operator=(const ResourcePool&);
+};
@@ -10,28 +10,135 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/uio.h>
 
 #include <vector>
 #include <set>
+#include <functional>
 #include <map>
 #include <sstream>
-#include <iostream>
+#include <list>
+#include <deque>
+#include <fstream>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <future>
+#include <unordered_map>
 
 #include "unzip.h"
+#include "AccessTrace.h"
+#include "StatsRecorder.h"
+#include "EventTrace.h"
+#include "RadixTree.h"
+#include "PathNormalizer.h"
+#include "ResourceAllocator.h"
+#include "ReadPipeline.h"
+#include "Crc32.h"
 
 enum FileType {
-    RegularFile, CompressedFile, StoredFile
+    RegularFile, CompressedFile, StoredFile, Tombstone
+};
+
+// name of the file listing deleted paths, at the root of a patch folder or archive
+static const char* kTombstonesFilename = ".tombstones";
+// zstd dictionary small entries of an archive are compressed with, always at the archive root
+static const char* kZstdDictionaryFilename = ".zstd_dictionary";
+
+// local header is 30 bytes plus name and extra field, which are not known from the central directory
+static const uint64_t kLocalHeaderSlack = 1024;
+
+// a stream is read ahead after this many back to back reads, two windows
+// are kept hinted in front of the reader and the next one is requested when
+// less than one is left
+static const unsigned kSequentialReadsThreshold = 2;
+static const uint64_t kReadAheadWindow = 512 * 1024;
+
+// deflate history a ranged read resumes with, and the uncompressed distance
+// between the checkpoints kept for an entry (window size apart in memory)
+static const unsigned kInflateWindowSize = 32768;
+static const uint64_t kInflateCheckpointSpacing = 1024 * 1024;
+
+// compressed size from which inflate takes its input from a ReadPipeline
+static const uint64_t kPipelinedInflateThreshold = 1024 * 1024;
+
+// relaxed counters kept with every record, copying takes a snapshot
+struct AccessCounters {
+    std::atomic<uint32_t> readCount;
+    std::atomic<uint64_t> bytesServed;
+    std::atomic<uint64_t> decompressionNanoseconds;
+    
+    AccessCounters() :
+        readCount(0),
+        bytesServed(0),
+        decompressionNanoseconds(0)
+    {
+    }
+    
+    AccessCounters(const AccessCounters& other) :
+        readCount(other.readCount.load(std::memory_order_relaxed)),
+        bytesServed(other.bytesServed.load(std::memory_order_relaxed)),
+        decompressionNanoseconds(other.decompressionNanoseconds.load(std::memory_order_relaxed))
+    {
+    }
+    
+    AccessCounters &operator=(const AccessCounters& other) {
+        readCount.store(other.readCount.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        bytesServed.store(other.bytesServed.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        decompressionNanoseconds.store(other.decompressionNanoseconds.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        return *this;
+    }
+    
+    void recordRead(uint64_t bytes) {
+        readCount.fetch_add(1, std::memory_order_relaxed);
+        bytesServed.fetch_add(bytes, std::memory_order_relaxed);
+    }
+};
+
+// fact about a record resolved by whichever read needs it first, concurrent
+// ranged reads store the same value; copying takes a snapshot
+template <typename T>
+struct RelaxedAtomic {
+    std::atomic<T> value;
+    
+    RelaxedAtomic() : value(T()) {}
+    RelaxedAtomic(const RelaxedAtomic& other) : value((T)other) {}
+    
+    RelaxedAtomic &operator=(const RelaxedAtomic& other) {
+        return *this = (T)other;
+    }
+    
+    RelaxedAtomic &operator=(T newValue) {
+        value.store(newValue, std::memory_order_relaxed);
+        return *this;
+    }
+    
+    operator T() const {
+        return value.load(std::memory_order_relaxed);
+    }
+};
+
+enum CrcState {
+    CrcUnchecked, CrcMatched, CrcMismatched
 };
 
 struct FileRecord {
     std::string filename;     // Demo.png (case as on disk)
     FileType fileType;
     size_t size;
-    std::string languageId;
-    std::string category;
+    int priority;             // mount priority, higher overrides lower
+    unsigned layer;           // mount order, the later layer wins on equal priority
+    uint64_t contentHash;     // crc32 and size of the payload, 0 - not known
     
     // regular file
     std::string filePath;     // /Users/user/../<AppId>/res/Textures/Demo.png
@@ -40,10 +147,31 @@ struct FileRecord {
     // zip
     std::string zipFilePath;
     unz_file_pos zipFilePos;
+    uint64_t zipLocalHeaderOffset;
+    uint64_t compressedSize;
+    int compressionMethod;
+    uint32_t crc;
+    mutable RelaxedAtomic<uint64_t> zipDataOffset;  // past the local header, 0 - not read yet
+    mutable RelaxedAtomic<CrcState> crcState;       // remembered for CrcVerifyOnce
+    
+    mutable AccessCounters accessCounters;
+};
+
+// archive added with addLazyArchive, its central directory is read on the
+// first lookup it could answer
+struct LazyArchive {
+    std::string archivePath;
+    std::string rootFolder;
+    int priority;
+    unsigned layer;           // reserved when added, so mounting late keeps the order
+    std::string summaryPath;
+    bool hasSummary;
+    std::vector<uint32_t> basenameHashes;   // sorted, from the summary
 };
 
 struct StreamRecord {
     FileRecord* fileRecord;
+    std::string filename;
     int randomValue;
     
     // regular file
@@ -52,54 +180,254 @@ struct StreamRecord {
     // zip
     unzFile zipFile;
     
+    // sequential access detection and read-ahead
+    uint64_t nextOffset;      // offset a sequential read would start at
+    unsigned sequentialReads;
+    int readAheadFd;          // archive opened for hints, -1 until needed
+    uint64_t readAheadEnd;    // file offset hinted up to, 0 - not started
+    
     bool operator < (const StreamRecord& other) const {
         return randomValue < other.randomValue;
     }
 };
 
+// archive path and entry position, or empty path and content hash for records with known content
+typedef std::pair<std::string, uint64_t> DecompressedCacheKey;
+
+struct DecompressedCacheEntry {
+    std::unique_ptr<char[]> data;
+    size_t size;
+    const FileRecord* fileRecord;   // record the entry was read for
+    uint64_t compressedSize;        // of that record, checked on hits from other records
+    int compressionMethod;
+    std::list<DecompressedCacheKey>::iterator lruIterator;
+};
+
+// archive path and entry position of a deflated entry
+typedef std::pair<std::string, uint64_t> InflateCheckpointKey;
+
+// inflate state at a deflate block boundary inside an entry
+struct InflateCheckpoint {
+    uint64_t outputOffset;    // uncompressed bytes before the boundary
+    uint64_t inputOffset;     // compressed bytes consumed, from the entry data start
+    int bits;                 // bits of the byte before inputOffset not consumed yet
+    std::unique_ptr<unsigned char[]> window;    // last kInflateWindowSize bytes of output
+};
+
+// languages and categories get a bit each when configured, up to 64 of each
+const size_t kMaxVariantBits = 64;
+
+// language and category bits of a folder registered for them
+struct VariantFolder {
+    uint64_t languageMask = 0;
+    uint64_t categoryMask = 0;
+};
+
+// record under language or category folders, with the bits of the ones it's under
+struct VariantRecord {
+    FileRecord* fileRecord = nullptr;
+    uint64_t languageMask = 0;      // more than one bit never matches a language
+    uint64_t categoryMask = 0;
+};
+
+// key at least one variant record maps to: the record it resolves to
+// without variants and every variant, enough to resolve it again after
+// a language or category switch without looking at other records
+struct VariantKey {
+    FileRecord* plainRecord = nullptr;
+    std::vector<VariantRecord> variants;
+    uint64_t languageMask = 0;      // of all the variants
+    uint64_t categoryMask = 0;
+};
+
+struct VariantIndex {
+    // hashed, context lookups find a key's variants in constant time;
+    // elements stay in place when it grows
+    typedef std::unordered_map<std::string, VariantKey> KeyMap;
+    
+    KeyMap keys;
+    // keys with a variant under each language and category bit, a switch
+    // resolves only the ones listed for the bits it flipped
+    std::vector<KeyMap::value_type*> keysByLanguage[kMaxVariantBits];
+    std::vector<KeyMap::value_type*> keysByCategory[kMaxVariantBits];
+};
+
+// the index lookups go through and the configuration it was built with;
+// rebuilds fill a new one and swap it in whole, so a background rebuild
+// never touches the one lookups use
+struct IndexSnapshot {
+    bool enableTrace = false;
+    bool searchByRelativePaths = false;
+    uint64_t languageMask = 0;          // of the current language, 0 when it has no folder
+    uint64_t enabledCategories = 0;
+    std::map<std::string, uint64_t> languageMasks;
+    
+    // lowercase copies of the configuration; folders by normalized path
+    // without the trailing slash, matched against whole path components
+    std::unordered_map<std::string, VariantFolder> variantFolders;
+    size_t variantFolderDepth = 0;      // components of the longest folder
+    std::vector<std::string> lowercaseSearchRootsList;
+    
+    // by basename, used when not searching by relative paths
+    std::map<std::string, FileRecord*> fileRecordIndex;
+    // by full normalized relative path, each path stored once; search roots
+    // are resolved by walking the root first
+    RadixTree<FileRecord*> pathTree;
+    
+    // by path and by basename key, for switching variants in place
+    VariantIndex variantPaths;
+    VariantIndex variantNames;
+};
+
+// rebuild running on a background thread
+struct IndexBuild {
+    std::unique_ptr<IndexSnapshot> index;
+    std::vector<FileRecord*> fileRecords;   // taken at the start, later ones are indexed on publish
+    std::thread thread;
+    std::promise<void> built;
+    std::shared_future<void> ready;
+};
+
 class ResourcesManagerImpl {
 private:
     friend class ResourcesManager;
     
-    typedef std::vector<FileRecord> FileRecordList;
+    // deque keeps records in place when layers are added to a built index
+    typedef std::deque<FileRecord> FileRecordList;
     
     bool enableTrace;
+    bool hashRegularFiles;
+    CrcPolicy crcPolicy;
     
     std::vector<std::string> rootFoldersList;
     
     FileRecordList fileRecordList;
-    std::map<std::string, FileRecord*> fileRecordIndex;
+    std::shared_ptr<IndexSnapshot> index;    // shared with enumerations walking it
+    std::unique_ptr<IndexBuild> indexBuild;
     
     bool shouldRebuildIndex;
+    bool variantsChanged;       // language or enabled categories, updated in place by updateVariants
+    unsigned configurationDepth;    // open beginConfiguration() calls
+    bool indexBuilt;            // false until the first index after reset(), nothing to serve meanwhile
+    bool backgroundIndexing;
+    unsigned layerCount;
+    std::vector<LazyArchive> lazyArchives;
     std::string languageId;
     std::map<std::string, std::string> relativeFolderToLanguageIdMap;
     std::map<std::string, std::string> relativeFolderToCategoryMap;
-    std::set<std::string> enabledCategories;
+    // a bit per language with a folder and per category with a folder or
+    // enabled, in the order they were first seen
+    std::map<std::string, uint64_t> languageMasks;
+    std::map<std::string, uint64_t> categoryMasks;
+    uint64_t enabledCategories;
     
     std::map<int, StreamRecord> openStreams;
     bool searchByRelativePaths;
     std::vector<std::string> searchRootsList;
     
     std::map<std::string, unzFile> sharedZipFiles;
+#ifdef HAVE_ZSTD
+    // digested once per archive and shared by all its unzFiles
+    std::map<std::string, ZSTD_DDict*> zstdDictionaries;
+#endif
+    
+    AccessTrace accessTrace;
+    StatsRecorder stats;
+    EventTrace eventTrace;
+    
+    // batched reads, null for plain FILE* reads
+    std::unique_ptr<IOEngine> ioEngine;
+    
+    size_t decompressedCacheLimit;
+    size_t decompressedCacheSize;
+    std::map<DecompressedCacheKey, DecompressedCacheEntry> decompressedCache;
+    std::list<DecompressedCacheKey> decompressedCacheLru;
+    
+    // ranged and context reads run on many threads next to the other reads:
+    // lookups (with index rebuilds and lazy mounts), the decompressed cache,
+    // archive descriptors and checkpoints are shared under this mutex, reads
+    // are not
+    std::mutex rangedReadMutex;
+    std::map<std::string, int> archiveFds;
+    std::map<InflateCheckpointKey, std::vector<std::shared_ptr<const InflateCheckpoint>>> inflateCheckpoints;
     
     // methods    
-    void addFolderRecursive(const std::string& folder, const std::string& relativeFolder);
+    void addFolderRecursive(const std::string& folder, const std::string& relativeFolder, int priority);
+    void addTombstones(const std::string& tombstonesList, int priority);
+    void addArchiveRecords(const std::string& archivePath, const std::string& rootFolder, int priority);
+    
+    void loadArchiveSummary(LazyArchive& lazyArchive);
+    void saveArchiveSummary(const LazyArchive& lazyArchive, size_t firstRecord);
+    void mountLazyArchive(size_t lazyArchiveIndex);
+    bool mountLazyArchives(const std::string& key, const FileRecord* indexedRecord);
+    void mountAllLazyArchives();
     
     size_t readData(const FileRecord& fileRecord, void* buffer, int size);
+    void* readData(const FileRecord& fileRecord, ResourceAllocator& allocator, size_t* bytesRead);
     size_t readDataFromRegularFile(const std::string& filePath, void* buffer, int size);
     unzFile openSharedZip(const std::string& archivePath);
     void closeSharedZip(const std::string& archivePath);
     
     void checkZipFileOpened(StreamRecord* streamRecord);
+    void readAhead(StreamRecord* streamRecord, uint64_t offset, int size);
+    void attachZstdDictionary(const std::string& archivePath, unzFile zipFile);
     size_t readDataFromCompressedFile(const FileRecord& fileRecord, void* buffer, int size);
     
+    void verifyCrc(const FileRecord& fileRecord, const std::vector<ReadSegment>& segments, uint64_t size);
+    void verifyCrc(const FileRecord& fileRecord, const void* data, uint64_t size);
+    
+    bool readFromDecompressedCache(const FileRecord& fileRecord, void* buffer, int size, size_t* bytesRead);
+    void storeInDecompressedCache(const FileRecord& fileRecord, const void* data, size_t size);
+    void trimDecompressedCache(size_t limit);
+    
+    void readBatchWithEngine(std::vector<BatchRead>& reads, std::vector<FileRecord*>& fileRecords);
+    
+    uint64_t readSegments(const FileRecord& fileRecord, uint64_t offset, const std::vector<ReadSegment>& segments);
+    uint64_t inflateSegments(const FileRecord& fileRecord, int fd, uint64_t offset, const std::vector<ReadSegment>& segments, uint64_t length);
+    uint64_t unzipSegments(const FileRecord& fileRecord, unzFile zipFile, uint64_t offset, const std::vector<ReadSegment>& segments, uint64_t length);
+    
+    int openArchiveFd(const std::string& archivePath);
+    void closeArchiveFds();
+    size_t readDataPipelined(const FileRecord& fileRecord, void* buffer, int size);
+    size_t readRange(const std::string& filename, const ResolutionContext* context, uint64_t offset, void* buffer, size_t length);
+    size_t readRange(const FileRecord& fileRecord, uint64_t offset, void* buffer, size_t length);
+    uint64_t inflateRange(const FileRecord& fileRecord, int fd, uint64_t offset, void* buffer, size_t length);
+    
+    void traceAccess(const std::string& filename, const FileRecord& fileRecord, uint64_t offset, uint64_t size);
+    void prefetchFileRecords(const std::vector<FileRecord*>& fileRecords);
+    
     std::string makeKey(const std::string& filename);
     
     void rebuildIndex();
-    FileRecord* findFileRecord(const std::string& filename);
+    std::unique_ptr<IndexSnapshot> prepareIndexSnapshot();
+    void buildIndex(IndexSnapshot& snapshot, const std::vector<FileRecord*>& fileRecords);
+    std::shared_future<void> startIndexBuild();
+    void finishIndexBuild(bool publish);
+    void updateIndex();
+    bool stripVariantFolders(const IndexSnapshot& snapshot, FileRecord& fileRecord, std::string* relativePathInMap, VariantRecord* variant);
+    static uint64_t internVariantBit(std::map<std::string, uint64_t>& masks, const std::string& name);
+    void indexPlainRecord(IndexSnapshot& snapshot, VariantIndex& variantIndex,
+                          FileRecord*& indexedRecord, const std::string& key, FileRecord* fileRecord);
+    void indexVariantRecord(IndexSnapshot& snapshot, VariantIndex& variantIndex,
+                            FileRecord*& indexedRecord, const std::string& key, const VariantRecord& variant);
+    void indexFileRecords(IndexSnapshot& snapshot, const std::vector<FileRecord*>& fileRecords);
+    void indexAddedRecords(size_t firstRecord, unsigned layer);
+    void updateVariants(IndexSnapshot& snapshot);
+    void resolveVariantKeys(IndexSnapshot& snapshot, VariantIndex& variantIndex,
+                            uint64_t languageMask, uint64_t categoryMask,
+                            const std::function<FileRecord*& (const std::string& key)>& indexedRecord);
+    void prepareSearchRoots(IndexSnapshot& snapshot);
+    void insertIntoIndex(const IndexSnapshot& snapshot, FileRecord*& indexedRecord, const std::string& key, FileRecord* fileRecord);
+    FileRecord* findIndexedRecord(const std::string& key, const ResolutionContext* context);
+    FileRecord* findInPathTree(const std::string& key, const ResolutionContext* context);
+    void collectResources(const std::string& prefix,
+                          const std::function<bool (const std::string& path, size_t pathStart)>& accept,
+                          const std::function<bool (const std::string& path, size_t pathStart)>& descend,
+                          std::vector<ResourceHandle>& resources);
+    FileRecord* findFileRecord(const std::string& filename, const ResolutionContext* context = nullptr);
+    FileRecord* lookupFileRecord(const std::string& filename, const ResolutionContext* context = nullptr);
     StreamRecord* getStreamRecord(int handle);
     
-    void traceFileRecord(const std::string& key, const FileRecord& fileRecord);
 };
 
 //
@@ -132,10 +460,6 @@ static std::string combine(const std::initializer_list<std::string>& pathCompone
     return outString.substr(0, outString.size() - 1);
 }
 
-static void lowercase(std::string& string) {
-    std::transform(string.begin(), string.end(), string.begin(), ::tolower);
-}
-
 static void replaceAll( std::string &s, const std::string &search, const std::string &replace ) {
     for( size_t pos = 0; ; pos += replace.length() ) {
         // Locate the substring to replace
@@ -162,6 +486,10 @@ static std::string getRootFolder(const std::string& filePath) {
     return filePath.substr(0, firstSlash);
 }
 
+static uint64_t nanosecondsSince(std::chrono::steady_clock::time_point startTime) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
 static long getFileSize(const std::string& filePath)
 {
     struct stat stat_buf;
@@ -169,16 +497,60 @@ static long getFileSize(const std::string& filePath)
     return rc == 0 ? stat_buf.st_size : -1;
 }
 
+// same crc32 zip stores, so a file in a folder and its copy in an archive match
+static uint64_t makeContentHash(uLong crc, uint64_t size) {
+    if (size == 0) return 0;
+    
+    return ((uint64_t)crc << 32) ^ size;
+}
+
+static uint64_t hashFileContent(const std::string& filePath, size_t size) {
+    FILE* file = fopen(filePath.c_str(), "rb");
+    if (!file) return 0;
+    
+    uint32_t crc = 0;
+    unsigned char buffer[16 * 1024];
+    size_t bytesRead = 0;
+    while ((bytesRead = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        crc = crc32Update(crc, buffer, bytesRead);
+    }
+    fclose(file);
+    
+    return makeContentHash(crc, size);
+}
+
+static void adviseWillNeed(int fd, uint64_t offset, uint64_t length) {
+#if defined(__APPLE__)
+    // F_RDADVISE takes an int count, issue large ranges in chunks
+    while (length > 0) {
+        struct radvisory advisory;
+        advisory.ra_offset = offset;
+        advisory.ra_count  = (int)std::min<uint64_t>(length, INT_MAX);
+        if (fcntl(fd, F_RDADVISE, &advisory) == -1) break;
+        
+        offset += advisory.ra_count;
+        length -= advisory.ra_count;
+    }
+#elif defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+#endif
+}
+
+static void adviseSequential(int fd) {
+#if defined(__APPLE__)
+    fcntl(fd, F_RDAHEAD, 1);
+#elif defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
 //
 // ResourcesManager
 //
 
 ResourcesManager* ResourcesManager::sharedManager() {
-    static ResourcesManager* manager = nullptr;
-    
-    if (!manager) {
-        manager = new ResourcesManager();
-    }
+    // function local static initialization is thread safe
+    static ResourcesManager* manager = new ResourcesManager();
     
     return manager;
 }
@@ -186,37 +558,128 @@ ResourcesManager* ResourcesManager::sharedManager() {
 ResourcesManager::ResourcesManager() :
     pImpl(new ResourcesManagerImpl())
 {
+    pImpl->decompressedCacheLimit = 0;
+    pImpl->crcPolicy = CrcVerifyAlways;
+    pImpl->backgroundIndexing = false;
+    pImpl->decompressedCacheSize = 0;
+
     reset();
 }
 
+ResourcesManager::~ResourcesManager() {
+    pImpl->finishIndexBuild(false);
+    
+    for (auto& handleStreamPair : pImpl->openStreams) {
+        StreamRecord& streamRecord = handleStreamPair.second;
+        if (streamRecord.file) fclose(streamRecord.file);
+        if (streamRecord.zipFile) unzClose(streamRecord.zipFile);
+        if (streamRecord.readAheadFd >= 0) close(streamRecord.readAheadFd);
+    }
+    
+    for (auto& pathZipPair : pImpl->sharedZipFiles) {
+        unzClose(pathZipPair.second);
+    }
+    
+    pImpl->closeArchiveFds();
+    
+#ifdef HAVE_ZSTD
+    for (auto& pathDictionaryPair : pImpl->zstdDictionaries) {
+        ZSTD_freeDDict(pathDictionaryPair.second);
+    }
+#endif
+}
+
 //
 // configuration methods
 //
 
 void ResourcesManager::reset() {
+    // the build reads records about to be dropped
+    pImpl->finishIndexBuild(false);
+    
     pImpl->enableTrace = false;
-    pImpl->shouldRebuildIndex = false;
+    pImpl->hashRegularFiles = false;
+    pImpl->shouldRebuildIndex = true;
+    pImpl->variantsChanged = false;
+    pImpl->configurationDepth = 0;
+    pImpl->indexBuilt = false;
+    pImpl->layerCount = 0;
+    pImpl->lazyArchives.clear();
     pImpl->rootFoldersList.clear();
     pImpl->fileRecordList.clear();
-    pImpl->fileRecordIndex.clear();
+    pImpl->index.reset(new IndexSnapshot());
     pImpl->languageId.clear();
     pImpl->relativeFolderToLanguageIdMap.clear();
     pImpl->relativeFolderToCategoryMap.clear();
-    pImpl->enabledCategories.clear();
+    pImpl->languageMasks.clear();
+    pImpl->categoryMasks.clear();
+    pImpl->enabledCategories = 0;
     pImpl->searchByRelativePaths = false;
     pImpl->searchRootsList = {""};
+    pImpl->trimDecompressedCache(0);
+    pImpl->closeArchiveFds();
 }
 
 void ResourcesManager::enableTrace(bool enableTrace) {
     pImpl->enableTrace = enableTrace;
 }
 
-void ResourcesManager::addRootFolder(const std::string& rootFolder) {
+void ResourcesManager::addRootFolder(const std::string& rootFolder, int priority /* = 0 */) {
+    TraceEventScope traceScope(pImpl->eventTrace, "addRootFolder", "config", rootFolder);
+    
+    size_t firstRecord = pImpl->fileRecordList.size();
+    
     pImpl->rootFoldersList.push_back(rootFolder);
-    pImpl->addFolderRecursive(rootFolder, "");
+    pImpl->addFolderRecursive(rootFolder, "", priority);
+    
+    std::ifstream tombstonesFile(combine({rootFolder, kTombstonesFilename}).c_str());
+    if (tombstonesFile) {
+        std::stringstream tombstonesList;
+        tombstonesList << tombstonesFile.rdbuf();
+        pImpl->addTombstones(tombstonesList.str(), priority);
+    }
+    
+    pImpl->indexAddedRecords(firstRecord, pImpl->layerCount++);
+}
+
+void ResourcesManager::addTombstone(const std::string& relativePath, int priority) {
+    size_t firstRecord = pImpl->fileRecordList.size();
+    
+    pImpl->addTombstones(relativePath, priority);
+    
+    pImpl->indexAddedRecords(firstRecord, pImpl->layerCount++);
+}
+
+void ResourcesManagerImpl::addTombstones(const std::string& tombstonesList, int priority) {
+    std::stringstream listStream(tombstonesList);
+    std::string relativePath;
+    
+    while (std::getline(listStream, relativePath)) {
+        if (!relativePath.empty() && relativePath[relativePath.size() - 1] == '\r')
+            relativePath.erase(relativePath.size() - 1);
+        if (relativePath.empty() || relativePath[0] == '#') continue;
+        
+        FileRecord fileRecord;
+        fileRecord.filename    = basename(relativePath);
+        fileRecord.fileType    = Tombstone;
+        fileRecord.size        = 0;
+        fileRecord.priority    = priority;
+        fileRecord.layer       = 0;
+        fileRecord.contentHash = 0;
+        fileRecord.relativePath= relativePath;
+        fileRecord.zipLocalHeaderOffset = 0;
+        fileRecord.compressedSize = 0;
+        fileRecord.compressionMethod = 0;
+        fileRecord.crc         = 0;
+        fileRecord.zipDataOffset = 0;
+        
+        fileRecordList.push_back(fileRecord);
+    }
 }
 
 void ResourcesManager::addLanguageFolder(const std::string& languageId, const std::string& languageFolder) {
+    ResourcesManagerImpl::internVariantBit(pImpl->languageMasks, languageId);
+    
     pImpl->relativeFolderToLanguageIdMap[languageFolder] = languageId;
     
     pImpl->shouldRebuildIndex = true;
@@ -225,23 +688,27 @@ void ResourcesManager::addLanguageFolder(const std::string& languageId, const st
 void ResourcesManager::setCurrentLanguage(const std::string& languageId) {
     pImpl->languageId = languageId;
     
-    pImpl->shouldRebuildIndex = true;
+    pImpl->variantsChanged = true;
 }
 
 void ResourcesManager::addCategoryFolder(const std::string& category, const std::string& categoryFolder) {
+    ResourcesManagerImpl::internVariantBit(pImpl->categoryMasks, category);
+    
     pImpl->relativeFolderToCategoryMap[categoryFolder] = category;
     
     pImpl->shouldRebuildIndex = true;
 }
 void ResourcesManager::enableCategory(const std::string& category){
-    pImpl->enabledCategories.insert(category);
+    pImpl->enabledCategories |= ResourcesManagerImpl::internVariantBit(pImpl->categoryMasks, category);
 
-    pImpl->shouldRebuildIndex = true;
+    pImpl->variantsChanged = true;
 }
 void ResourcesManager::disableCategory(const std::string& category) {
-    pImpl->enabledCategories.erase(category);
+    auto it = pImpl->categoryMasks.find(category);
+    if (it != pImpl->categoryMasks.end())
+        pImpl->enabledCategories &= ~it->second;
 
-    pImpl->shouldRebuildIndex = true;
+    pImpl->variantsChanged = true;
 }
 
 void ResourcesManager::setSearchByRelativePaths(bool searchByRelativePaths) {
@@ -257,7 +724,9 @@ void ResourcesManager::addSearchRoot(const std::string& searchRoot) {
     replaceAll(canonicalSearchRoot, "\\\\", "/");
     pImpl->searchRootsList.push_back(canonicalSearchRoot);
 
-    pImpl->shouldRebuildIndex = true;
+    // roots are walked at lookup time, the index itself doesn't change;
+    // a build in flight takes them when it's published
+    pImpl->prepareSearchRoots(*pImpl->index);
 }
 
 
@@ -265,7 +734,7 @@ void ResourcesManager::addSearchRoot(const std::string& searchRoot) {
 // filesystem methods
 //
 
-void ResourcesManagerImpl::addFolderRecursive(const std::string& rootFolder, const std::string& relativeFolder) {
+void ResourcesManagerImpl::addFolderRecursive(const std::string& rootFolder, const std::string& relativeFolder, int priority) {
     
     DIR *dp = opendir(combine({rootFolder, relativeFolder}).c_str());
     if (!dp) return;
@@ -276,7 +745,7 @@ void ResourcesManagerImpl::addFolderRecursive(const std::string& rootFolder, con
         
         if (ep->d_type == DT_DIR) {
             std::string newRelativeFolder = combine({relativeFolder, ep->d_name});
-            addFolderRecursive(rootFolder, newRelativeFolder);
+            addFolderRecursive(rootFolder, newRelativeFolder, priority);
         } else {
             FileRecord fileRecord;
             fileRecord.filename    = ep->d_name;
@@ -284,10 +753,16 @@ void ResourcesManagerImpl::addFolderRecursive(const std::string& rootFolder, con
             fileRecord.relativePath= combine({relativeFolder, ep->d_name});
             fileRecord.filePath    = combine({rootFolder, fileRecord.relativePath});
             fileRecord.size        = getFileSize(fileRecord.filePath);
+            fileRecord.priority    = priority;
+            fileRecord.layer       = 0;
+            fileRecord.contentHash = hashRegularFiles ? hashFileContent(fileRecord.filePath, fileRecord.size) : 0;
+            fileRecord.zipLocalHeaderOffset = 0;
+            fileRecord.compressedSize = 0;
+            fileRecord.compressionMethod = 0;
+            fileRecord.crc         = 0;
+            fileRecord.zipDataOffset = 0;
             
             fileRecordList.push_back(fileRecord);
-
-            shouldRebuildIndex = true;
         }
     }
     
@@ -295,6 +770,8 @@ void ResourcesManagerImpl::addFolderRecursive(const std::string& rootFolder, con
 }
 
 size_t ResourcesManagerImpl::readDataFromRegularFile(const std::string& filePath, void* buffer, int size) {
+    StatsTimerScope timerScope(stats, TimerReadRegular);
+    
     FILE* file = fopen(filePath.c_str(), "rb");
     if (!file) return 0;
     
@@ -302,6 +779,8 @@ size_t ResourcesManagerImpl::readDataFromRegularFile(const std::string& filePath
     
     fclose(file);
     
+    stats.increment(CounterBytesRead, bytesRead);
+    
     return bytesRead;
 }
 
@@ -315,6 +794,9 @@ unzFile ResourcesManagerImpl::openSharedZip(const std::string& archivePath) {
         unzFile zipFile = unzOpen(archivePath.c_str());
         if (!zipFile) throw std::exception();
         
+        attachZstdDictionary(archivePath, zipFile);
+        // whole reads are verified by verifyCrc as the policy asks
+        unzSetCrcCheck(zipFile, 0);
         sharedZipFiles[archivePath] = zipFile;
         return zipFile;
     }
@@ -330,8 +812,32 @@ void ResourcesManagerImpl::closeSharedZip(const std::string& archivePath) {
     sharedZipFiles.erase(it);
 }
 
-void ResourcesManager::addArchive(const std::string& archivePath, const std::string& rootFolder /* = "" */) {
-    unzFile zipFile = pImpl->openSharedZip(archivePath);
+static std::string readCurrentZipEntry(unzFile zipFile, const unz_file_info64& fileInfo) {
+    int ret = unzOpenCurrentFile(zipFile);
+    if (ret != UNZ_OK) throw std::exception();
+    
+    std::string data(fileInfo.uncompressed_size, '\0');
+    ret = data.empty() ? 0 : unzReadCurrentFile(zipFile, &data[0], (unsigned)data.size());
+    if (ret < 0) throw std::exception();
+    
+    ret = unzCloseCurrentFile(zipFile);
+    if (ret != UNZ_OK) throw std::exception();
+    
+    return data;
+}
+
+void ResourcesManager::addArchive(const std::string& archivePath, const std::string& rootFolder /* = "" */, int priority /* = 0 */) {
+    TraceEventScope traceScope(pImpl->eventTrace, "addArchive", "config", archivePath);
+    
+    size_t firstRecord = pImpl->fileRecordList.size();
+    
+    pImpl->addArchiveRecords(archivePath, rootFolder, priority);
+    
+    pImpl->indexAddedRecords(firstRecord, pImpl->layerCount++);
+}
+
+void ResourcesManagerImpl::addArchiveRecords(const std::string& archivePath, const std::string& rootFolder, int priority) {
+    unzFile zipFile = openSharedZip(archivePath);
     if (!zipFile) throw std::exception();
 
     char filePath[1024] = {0};
@@ -347,6 +853,21 @@ void ResourcesManager::addArchive(const std::string& archivePath, const std::str
         // skip folders and files outside specified folder
         bool shouldAddRecord = true;
         std::string filePathString = filePath;
+        
+        if (filePathString == kZstdDictionaryFilename) {
+#ifdef HAVE_ZSTD
+            if (zstdDictionaries.count(archivePath) == 0) {
+                std::string dictionary = readCurrentZipEntry(zipFile, fileInfo);
+                ZSTD_DDict* ddict = ZSTD_createDDict(dictionary.data(), dictionary.size());
+                if (!ddict) throw std::exception();
+                
+                zstdDictionaries[archivePath] = ddict;
+                unzSetZstdDictionary(zipFile, ddict);
+            }
+#endif
+            shouldAddRecord = false;
+        }
+        
         std::string slashEndedRootFolder = rootFolder + '/';
         if (filePathString[filePathString.size()-1] == '/' ||
             (!rootFolder.empty() &&
@@ -361,17 +882,28 @@ void ResourcesManager::addArchive(const std::string& archivePath, const std::str
                 rootFolderRelativePath = rootFolderRelativePath.substr(slashEndedRootFolder.size(), rootFolderRelativePath.size() - slashEndedRootFolder.size());
             }
             
+            if (rootFolderRelativePath == kTombstonesFilename) {
+                addTombstones(readCurrentZipEntry(zipFile, fileInfo), priority);
+            } else {
+            
             FileRecord fileRecord;
             fileRecord.filename    = filePathString;
             fileRecord.relativePath= rootFolderRelativePath;
             fileRecord.fileType    = (fileInfo.compression_method == 0) ? StoredFile : CompressedFile;
             fileRecord.size        = fileInfo.uncompressed_size;
+            fileRecord.priority    = priority;
+            fileRecord.layer       = 0;
+            fileRecord.contentHash = makeContentHash(fileInfo.crc, fileInfo.uncompressed_size);
             fileRecord.zipFilePath = archivePath;
             fileRecord.zipFilePos  = zipFilePos;
-            pImpl->fileRecordList.push_back(fileRecord);
+            fileRecord.zipLocalHeaderOffset = unzGetCurrentFileLocalHeaderOffset64(zipFile);
+            fileRecord.compressedSize = fileInfo.compressed_size;
+            fileRecord.compressionMethod = (int)fileInfo.compression_method;
+            fileRecord.crc         = (uint32_t)fileInfo.crc;
+            fileRecord.zipDataOffset = 0;
+            fileRecordList.push_back(fileRecord);
 
-            pImpl->shouldRebuildIndex = true;
-            
+            }
         }
         
         ret = unzGoToNextFile2(zipFile, &fileInfo, filePath, sizeof(filePath), NULL, 0, NULL, 0);
@@ -381,374 +913,2501 @@ void ResourcesManager::addArchive(const std::string& archivePath, const std::str
     } while (ret != UNZ_END_OF_LIST_OF_FILE);
 }
 
-size_t ResourcesManagerImpl::readDataFromCompressedFile(const FileRecord& fileRecord, void* buffer, int size) {
+//
+// lazy archives
+//
+
+// summary file: magic, archive size and modification time it was made for,
+// then sorted hashes of the normalized basenames of the archive entries
+static const char kArchiveSummaryMagic[4] = { 'R', 'M', 'S', '1' };
+
+static uint32_t hashBasename(const std::string& key) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = key.find_last_of('/') + 1; i < key.size(); i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool getArchiveVersion(const std::string& archivePath, uint64_t* size, int64_t* modified) {
+    struct stat stat_buf;
+    if (stat(archivePath.c_str(), &stat_buf) != 0) return false;
     
-    unzFile zipFile = openSharedZip(fileRecord.zipFilePath); 
-    if (!zipFile) throw std::exception();
+    *size = stat_buf.st_size;
+    *modified = stat_buf.st_mtime;
+    return true;
+}
+
+void ResourcesManager::addLazyArchive(const std::string& archivePath, const std::string& rootFolder /* = "" */, int priority /* = 0 */, const std::string& summaryPath /* = "" */) {
+    TraceEventScope traceScope(pImpl->eventTrace, "addLazyArchive", "config", archivePath);
     
-    unz_file_pos file_pos = fileRecord.zipFilePos;
-    int ret = unzGoToFilePos(zipFile, &file_pos);
-    if (ret != UNZ_OK) throw std::exception();
+    LazyArchive lazyArchive;
+    lazyArchive.archivePath = archivePath;
+    lazyArchive.rootFolder  = rootFolder;
+    lazyArchive.priority    = priority;
+    lazyArchive.layer       = pImpl->layerCount++;
+    lazyArchive.summaryPath = summaryPath;
+    lazyArchive.hasSummary  = false;
     
-    ret = unzOpenCurrentFile(zipFile);
-    if (ret != UNZ_OK) throw std::exception();
+    if (!summaryPath.empty())
+        pImpl->loadArchiveSummary(lazyArchive);
     
-    ret = unzReadCurrentFile(zipFile, buffer, size);
-    if (ret < 0) throw std::exception();
-    return (ret == 0) ? size : ret;
+    pImpl->lazyArchives.push_back(lazyArchive);
 }
 
-void ResourcesManagerImpl::checkZipFileOpened(StreamRecord* streamRecord) {
-    if (!streamRecord->zipFile) {
-        streamRecord->zipFile = unzOpen(streamRecord->fileRecord->zipFilePath.c_str());
-        if (!streamRecord->zipFile) throw std::exception();
-        
-        int ret = unzGoToFilePos(streamRecord->zipFile, &streamRecord->fileRecord->zipFilePos);
-        if (ret != UNZ_OK) throw std::exception();
-        
-        ret = unzOpenCurrentFile(streamRecord->zipFile);
-        if (ret != UNZ_OK) throw std::exception();
+void ResourcesManagerImpl::loadArchiveSummary(LazyArchive& lazyArchive) {
+    uint64_t archiveSize;
+    int64_t archiveModified;
+    if (!getArchiveVersion(lazyArchive.archivePath, &archiveSize, &archiveModified)) return;
+    
+    FILE* file = fopen(lazyArchive.summaryPath.c_str(), "rb");
+    if (!file) return;
+    
+    char magic[4];
+    uint64_t summarySize;
+    int64_t summaryModified;
+    uint32_t count;
+    
+    bool ok = fread(magic, sizeof(magic), 1, file) == 1 &&
+              memcmp(magic, kArchiveSummaryMagic, sizeof(magic)) == 0 &&
+              fread(&summarySize, sizeof(summarySize), 1, file) == 1 &&
+              fread(&summaryModified, sizeof(summaryModified), 1, file) == 1 &&
+              fread(&count, sizeof(count), 1, file) == 1 &&
+              summarySize == archiveSize && summaryModified == archiveModified;
+    
+    if (ok) {
+        lazyArchive.basenameHashes.resize(count);
+        ok = count == 0 || fread(&lazyArchive.basenameHashes[0], sizeof(uint32_t), count, file) == count;
     }
+    
+    fclose(file);
+    
+    // a stale or broken summary is rewritten when the archive gets mounted
+    lazyArchive.hasSummary = ok;
+    if (!ok) lazyArchive.basenameHashes.clear();
 }
 
-//
-// common methods
-//
-
-void ResourcesManagerImpl::traceFileRecord(const std::string& key, const FileRecord& fileRecord) {
+void ResourcesManagerImpl::saveArchiveSummary(const LazyArchive& lazyArchive, size_t firstRecord) {
+    uint64_t archiveSize;
+    int64_t archiveModified;
+    if (!getArchiveVersion(lazyArchive.archivePath, &archiveSize, &archiveModified)) return;
     
-    std::cout << key << ": ";
+    std::vector<uint32_t> basenameHashes;
+    for (size_t i = firstRecord; i < fileRecordList.size(); i++) {
+        basenameHashes.push_back(hashBasename(normalizePath(fileRecordList[i].relativePath)));
+    }
+    std::sort(basenameHashes.begin(), basenameHashes.end());
+    basenameHashes.erase(std::unique(basenameHashes.begin(), basenameHashes.end()), basenameHashes.end());
     
-    if (!fileRecord.zipFilePath.empty())
-        std::cout << "zip: " << basename(fileRecord.zipFilePath) << ", ";
+    FILE* file = fopen(lazyArchive.summaryPath.c_str(), "wb");
+    if (!file) return;
     
-    std::cout << "relative path: " << fileRecord.relativePath << ", ";
-        
-    if (!fileRecord.category.empty())
-        std::cout << "category: " << fileRecord.category << ", ";
+    uint32_t count = (uint32_t)basenameHashes.size();
+    bool ok = fwrite(kArchiveSummaryMagic, sizeof(kArchiveSummaryMagic), 1, file) == 1 &&
+              fwrite(&archiveSize, sizeof(archiveSize), 1, file) == 1 &&
+              fwrite(&archiveModified, sizeof(archiveModified), 1, file) == 1 &&
+              fwrite(&count, sizeof(count), 1, file) == 1 &&
+              (count == 0 || fwrite(&basenameHashes[0], sizeof(uint32_t), count, file) == count);
     
-    std::cout << "size: " << fileRecord.size << std::endl;
+    if (fclose(file) != 0 || !ok)
+        remove(lazyArchive.summaryPath.c_str());
 }
 
-std::string ResourcesManagerImpl::makeKey(const std::string& filename) {
-    std::string key = searchByRelativePaths ? filename :  basename(filename);
-    lowercase(key);
-    replaceAll(key, "\\\\", "/");
-    std::replace(key.begin(), key.end(), '\\', '/');
-//    filenameId = removeExtension(filenameId);
+void ResourcesManagerImpl::mountLazyArchive(size_t lazyArchiveIndex) {
+    LazyArchive lazyArchive = lazyArchives[lazyArchiveIndex];
+    lazyArchives.erase(lazyArchives.begin() + lazyArchiveIndex);
     
-    return key;
-}
-
-void ResourcesManagerImpl::rebuildIndex() {
-    fileRecordIndex.clear();
+    TraceEventScope traceScope(eventTrace, "mountLazyArchive", "index", lazyArchive.archivePath);
+    stats.increment(CounterLazyMounts);
     
-    // prepare lowercase dictionaries
-    decltype(relativeFolderToCategoryMap) lowercaseFolderToCategoryMap;
-    for (auto& folderCategoryPair : relativeFolderToCategoryMap) {
-        std::string relativePath = folderCategoryPair.first;
-        lowercase(relativePath);
-        
-        lowercaseFolderToCategoryMap[relativePath + "/"] = folderCategoryPair.second;
-    }
+    size_t firstRecord = fileRecordList.size();
     
-    decltype(searchRootsList) lowercaseSearchRootsList;
-    for (auto searchRoot : searchRootsList) {
-        if (searchRoot.empty()) continue;
-        
-        lowercase(searchRoot);
-        replaceAll(searchRoot, "\\\\", "/");
-
-        lowercaseSearchRootsList.push_back(searchRoot + "/");
-    }
+    addArchiveRecords(lazyArchive.archivePath, lazyArchive.rootFolder, lazyArchive.priority);
     
+    if (!lazyArchive.summaryPath.empty() && !lazyArchive.hasSummary)
+        saveArchiveSummary(lazyArchive, firstRecord);
     
-    for (auto& fileRecord : fileRecordList) {
-        bool skipRecord = false;
-        std::string relativePathInMap = fileRecord.relativePath;
-        lowercase(relativePathInMap);
-
-        for (auto& folderLanguageIdPair :  relativeFolderToLanguageIdMap) {
-            std::string pathComponentToSearch = folderLanguageIdPair.first + "/";
-            if (relativePathInMap.find(pathComponentToSearch) != std::string::npos)
-            {
-                if (languageId != folderLanguageIdPair.second) {
-                    skipRecord = true;
-                    break;
-                }
-                
-                fileRecord.languageId = folderLanguageIdPair.second;
-                replaceAll(relativePathInMap, pathComponentToSearch, "");
-            }
-        }
-
-        if (skipRecord) continue;
-
+    indexAddedRecords(firstRecord, lazyArchive.layer);
+}
 
-        for (auto& folderCategoryPair :  lowercaseFolderToCategoryMap) {
-            if (relativePathInMap.find(folderCategoryPair.first) != std::string::npos)
-            {
-                if (enabledCategories.count(folderCategoryPair.second) == 0) {
-                    skipRecord = true;
-                    break;
-                }
-                
-                fileRecord.category = folderCategoryPair.second;
-                replaceAll(relativePathInMap, folderCategoryPair.first, "");
-            }
-        }
+bool ResourcesManagerImpl::mountLazyArchives(const std::string& key, const FileRecord* indexedRecord) {
+    uint32_t basenameHash = hashBasename(key);
+    bool mounted = false;
+    
+    for (size_t i = 0; i < lazyArchives.size(); ) {
+        const LazyArchive& lazyArchive = lazyArchives[i];
         
-        if (skipRecord) continue;
-
-
-        std::string key = makeKey(relativePathInMap);
-        fileRecordIndex[key] = &fileRecord;
-
-        if (enableTrace)
-            traceFileRecord(key, fileRecord);
-
+        // an archive can't override what a higher layer already answers,
+        // and one with a summary is skipped unless the basename is in it
+        bool outranked = indexedRecord &&
+            (indexedRecord->priority > lazyArchive.priority ||
+             (indexedRecord->priority == lazyArchive.priority && indexedRecord->layer > lazyArchive.layer));
+        bool missing = lazyArchive.hasSummary &&
+            !std::binary_search(lazyArchive.basenameHashes.begin(), lazyArchive.basenameHashes.end(), basenameHash);
         
-        for (auto& searchRoot : lowercaseSearchRootsList) {
-            if (searchRoot.empty()) continue;
-            
-            if (relativePathInMap.compare(0, searchRoot.size(), searchRoot) == 0) {
-                
-                std::string searchRootRelativePath = relativePathInMap.substr(searchRoot.size());
-                
-                std::string key = makeKey(searchRootRelativePath);
-                fileRecordIndex[key] = &fileRecord;
-                
-                if (enableTrace)
-                    traceFileRecord(key, fileRecord);
-            }
+        if (outranked || missing) {
+            i++;
+            continue;
         }
+        
+        mountLazyArchive(i);
+        mounted = true;
     }
     
-    shouldRebuildIndex = false;
+    return mounted;
 }
 
-void ResourcesManager::rebuildIndex() {
-    pImpl->rebuildIndex();
+void ResourcesManagerImpl::mountAllLazyArchives() {
+    while (!lazyArchives.empty()) {
+        mountLazyArchive(0);
+    }
 }
 
-FileRecord* ResourcesManagerImpl::findFileRecord(const std::string& filename) {
+size_t ResourcesManagerImpl::readDataFromCompressedFile(const FileRecord& fileRecord, void* buffer, int size) {
     
-    if (shouldRebuildIndex) {
-        rebuildIndex();
+    size_t cachedBytesRead = 0;
+    if (readFromDecompressedCache(fileRecord, buffer, size, &cachedBytesRead)) {
+        stats.increment(CounterDecompressedCacheHits);
+        stats.increment(CounterBytesRead, cachedBytesRead);
+        return cachedBytesRead;
     }
     
-    std::string key = makeKey(filename);
+    StatsTimerScope timerScope(stats, fileRecord.fileType == StoredFile ? TimerReadStored : TimerReadCompressed);
     
-    auto it = fileRecordIndex.find(key);
-    if (it == fileRecordIndex.end()) {
-        return nullptr;
+    if (fileRecord.fileType == CompressedFile && fileRecord.compressionMethod == Z_DEFLATED &&
+        fileRecord.compressedSize >= kPipelinedInflateThreshold)
+        return readDataPipelined(fileRecord, buffer, size);
+    
+    unzFile zipFile = openSharedZip(fileRecord.zipFilePath); 
+    if (!zipFile) throw std::exception();
+    
+    unz_file_pos file_pos = fileRecord.zipFilePos;
+    int ret = unzGoToFilePos(zipFile, &file_pos);
+    if (ret != UNZ_OK) throw std::exception();
+    
+    ret = unzOpenCurrentFile(zipFile);
+    if (ret != UNZ_OK) throw std::exception();
+    
+    {
+        TraceEventScope traceScope(eventTrace, fileRecord.fileType == StoredFile ? "unzip" : "inflate", "cpu", fileRecord.filename);
+        auto startTime = std::chrono::steady_clock::now();
+        
+        ret = unzReadCurrentFile(zipFile, buffer, size);
+        
+        if (fileRecord.fileType == CompressedFile)
+            fileRecord.accessCounters.decompressionNanoseconds.fetch_add(nanosecondsSince(startTime), std::memory_order_relaxed);
     }
+    if (ret < 0) throw std::exception();
     
-    return it->second;
+    size_t bytesRead = (ret == 0) ? size : ret;
+    
+    stats.increment(CounterBytesRead, bytesRead);
+    if (fileRecord.fileType == CompressedFile)
+        stats.increment(CounterBytesInflated, bytesRead);
+    
+    verifyCrc(fileRecord, buffer, bytesRead);
+    if (bytesRead == fileRecord.size) {
+        storeInDecompressedCache(fileRecord, buffer, bytesRead);
+    }
+    
+    return bytesRead;
 }
 
-bool ResourcesManager::exists(const std::string& filename) {
-    return (pImpl->findFileRecord(filename) != nullptr);
+//
+// crc verification
+//
+
+void ResourcesManager::setCrcPolicy(CrcPolicy policy) {
+    pImpl->crcPolicy = policy;
 }
 
-size_t ResourcesManagerImpl::readData(const FileRecord& fileRecord, void* buffer, int size) {
-    if (fileRecord.fileType == RegularFile) {
-        return readDataFromRegularFile(fileRecord.filePath, buffer, size);
+// archive entries read whole are checked against their central directory crc
+void ResourcesManagerImpl::verifyCrc(const FileRecord& fileRecord, const std::vector<ReadSegment>& segments, uint64_t size) {
+    if (fileRecord.fileType == RegularFile || size != fileRecord.size) return;
+    
+    CrcState crcState = fileRecord.crcState;
+    if (crcPolicy == CrcVerifyNever || (crcPolicy == CrcVerifyOnce && crcState == CrcMatched)) {
+        stats.increment(CounterCrcSkippedBytes, size);
+        return;
     }
-    else if (fileRecord.fileType == CompressedFile) {
-        return readDataFromCompressedFile(fileRecord, buffer, size);
+    if (crcPolicy == CrcVerifyOnce && crcState == CrcMismatched) throw std::exception();
+    
+    uint32_t crc = 0;
+    {
+        StatsTimerScope timerScope(stats, TimerVerifyCrc);
+        
+        uint64_t length = size;
+        for (auto& segment : segments) {
+            if (length == 0) break;
+            
+            uint64_t segmentSize = std::min(segment.size, length);
+            crc = crc32Update(crc, segment.buffer, (size_t)segmentSize);
+            length -= segmentSize;
+        }
     }
+    stats.increment(CounterCrcVerifiedBytes, size);
+    
+    fileRecord.crcState = (crc == fileRecord.crc) ? CrcMatched : CrcMismatched;
+    if (crc != fileRecord.crc) throw std::exception();
+}
 
-    return 0;
+void ResourcesManagerImpl::verifyCrc(const FileRecord& fileRecord, const void* data, uint64_t size) {
+    verifyCrc(fileRecord, std::vector<ReadSegment>(1, ReadSegment { (void*)data, size }), size);
 }
 
-size_t ResourcesManager::readData(const std::string& filename, void* buffer, int size) {
+//
+// decompressed cache
+//
+
+static DecompressedCacheKey makeDecompressedCacheKey(const FileRecord& fileRecord) {
+    // identical payloads share one entry whatever archive or folder they come from
+    if (fileRecord.contentHash != 0)
+        return std::make_pair(std::string(), fileRecord.contentHash);
     
-    FileRecord* fileRecord = pImpl->findFileRecord(filename);
-    if (!fileRecord) return 0;
+    return std::make_pair(fileRecord.zipFilePath, (uint64_t)fileRecord.zipFilePos.pos_in_zip_directory);
+}
+
+// a content hash hit from another record also needs the same compressed
+// form, a crc32 collision of equal sized payloads rarely has that too
+static bool matchesCacheEntry(const DecompressedCacheEntry& cacheEntry, const FileRecord& fileRecord) {
+    return cacheEntry.fileRecord == &fileRecord ||
+        (cacheEntry.compressedSize == fileRecord.compressedSize && cacheEntry.compressionMethod == fileRecord.compressionMethod);
+}
+
+bool ResourcesManagerImpl::readFromDecompressedCache(const FileRecord& fileRecord, void* buffer, int size, size_t* bytesRead) {
+    std::lock_guard<std::mutex> lock(rangedReadMutex);
+    
+    if (decompressedCache.empty()) return false;
+    
+    auto it = decompressedCache.find(makeDecompressedCacheKey(fileRecord));
+    if (it == decompressedCache.end() || !matchesCacheEntry(it->second, fileRecord)) return false;
+    
+    DecompressedCacheEntry& cacheEntry = it->second;
+    *bytesRead = std::min<size_t>(size, cacheEntry.size);
+    memcpy(buffer, cacheEntry.data.get(), *bytesRead);
     
-    return pImpl->readData(*fileRecord, buffer, size);
+    if (cacheEntry.fileRecord != &fileRecord)
+        stats.increment(CounterDeduplicatedBytes, *bytesRead);
+    
+    decompressedCacheLru.splice(decompressedCacheLru.begin(), decompressedCacheLru, cacheEntry.lruIterator);
+    
+    return true;
 }
 
-std::unique_ptr<char[]> ResourcesManager::readData(const std::string& filename, size_t* pBytesRead) {
+void ResourcesManagerImpl::storeInDecompressedCache(const FileRecord& fileRecord, const void* data, size_t size) {
+    std::lock_guard<std::mutex> lock(rangedReadMutex);
     
-    FileRecord* fileRecord = pImpl->findFileRecord(filename);
-    if (!fileRecord) {
-        if (pBytesRead)
-            *pBytesRead = 0;
-        return nullptr;
-    }
+    if (size > decompressedCacheLimit) return;
     
-    std::unique_ptr<char[]> buffer(new char[fileRecord->size]);
-    size_t bytesRead = pImpl->readData(*fileRecord, buffer.get(), fileRecord->size);
-    if (bytesRead != fileRecord->size) throw std::exception();
+    DecompressedCacheKey key = makeDecompressedCacheKey(fileRecord);
+    if (decompressedCache.count(key)) return;
+    
+    trimDecompressedCache(decompressedCacheLimit - size);
+    
+    DecompressedCacheEntry& cacheEntry = decompressedCache[key];
+    cacheEntry.data.reset(new char[size]);
+    cacheEntry.size = size;
+    cacheEntry.fileRecord = &fileRecord;
+    cacheEntry.compressedSize = fileRecord.compressedSize;
+    cacheEntry.compressionMethod = fileRecord.compressionMethod;
+    memcpy(cacheEntry.data.get(), data, size);
+    
+    decompressedCacheLru.push_front(key);
+    cacheEntry.lruIterator = decompressedCacheLru.begin();
+    decompressedCacheSize += size;
+}
 
-    if (pBytesRead)
-        *pBytesRead = bytesRead;
+void ResourcesManagerImpl::trimDecompressedCache(size_t limit) {
+    while (decompressedCacheSize > limit && !decompressedCacheLru.empty()) {
+        auto it = decompressedCache.find(decompressedCacheLru.back());
+        decompressedCacheSize -= it->second.size;
+        decompressedCache.erase(it);
+        decompressedCacheLru.pop_back();
+    }
+}
+
+void ResourcesManager::setContentHashing(bool hashRegularFiles) {
+    pImpl->hashRegularFiles = hashRegularFiles;
+}
+
+void ResourcesManager::setDecompressedCacheSize(size_t cacheSize) {
+    std::lock_guard<std::mutex> lock(pImpl->rangedReadMutex);
     
-    return buffer;
+    pImpl->decompressedCacheLimit = cacheSize;
+    pImpl->trimDecompressedCache(cacheSize);
 }
 
-size_t ResourcesManager::getSize(const std::string& filename) {
-    FileRecord* fileRecord = pImpl->findFileRecord(filename);
-    if (!fileRecord) return 0;
+void ResourcesManagerImpl::attachZstdDictionary(const std::string& archivePath, unzFile zipFile) {
+#ifdef HAVE_ZSTD
+    auto it = zstdDictionaries.find(archivePath);
+    if (it != zstdDictionaries.end())
+        unzSetZstdDictionary(zipFile, it->second);
+#else
+    (void)archivePath;
+    (void)zipFile;
+#endif
+}
 
-    return fileRecord->size;
+void ResourcesManagerImpl::checkZipFileOpened(StreamRecord* streamRecord) {
+    if (!streamRecord->zipFile) {
+        streamRecord->zipFile = unzOpen(streamRecord->fileRecord->zipFilePath.c_str());
+        if (!streamRecord->zipFile) throw std::exception();
+        
+        attachZstdDictionary(streamRecord->fileRecord->zipFilePath, streamRecord->zipFile);
+        unzSetCrcCheck(streamRecord->zipFile, 0);
+        
+        int ret = unzGoToFilePos(streamRecord->zipFile, &streamRecord->fileRecord->zipFilePos);
+        if (ret != UNZ_OK) throw std::exception();
+        
+        ret = unzOpenCurrentFile(streamRecord->zipFile);
+        if (ret != UNZ_OK) throw std::exception();
+    }
 }
 
-std::unique_ptr<Stream> ResourcesManager::getStream(const std::string& filename) {
+void ResourcesManagerImpl::readAhead(StreamRecord* streamRecord, uint64_t offset, int size) {
+    bool sequential = (offset == streamRecord->nextOffset);
+    streamRecord->nextOffset = offset + size;
+    streamRecord->sequentialReads = sequential ? streamRecord->sequentialReads + 1 : 0;
     
-    FileRecord* fileRecord = pImpl->findFileRecord(filename);
-    if (!fileRecord) return nullptr;
+    if (streamRecord->sequentialReads < kSequentialReadsThreshold) return;
     
-    StreamRecord streamRecord;
-    streamRecord.fileRecord = fileRecord;
-    streamRecord.randomValue = arc4random();
-    streamRecord.file = NULL;
-    streamRecord.zipFile = NULL;
+    const FileRecord& fileRecord = *streamRecord->fileRecord;
     
-    switch (fileRecord->fileType) {
-        case RegularFile:
-            streamRecord.file = fopen(fileRecord->filePath.c_str(), "rb");
-            if (!streamRecord.file) return nullptr;
-            break;
-            
-        case CompressedFile:
-        case StoredFile:
-        {
-            // lazy open
-            break;
-        }
+    // byte range of the resource in the file actually read
+    int fd = -1;
+    uint64_t filePosition = 0;
+    uint64_t fileEnd = 0;
+    
+    if (fileRecord.fileType == RegularFile) {
+        fd = fileno(streamRecord->file);
+        filePosition = offset;
+        fileEnd = fileRecord.size;
+    }
+    else {
+        // unzip reads through stdio, hints go through a descriptor of our own
+        if (streamRecord->readAheadFd < 0)
+            streamRecord->readAheadFd = open(fileRecord.zipFilePath.c_str(), O_RDONLY);
+        
+        fd = streamRecord->readAheadFd;
+        filePosition = unzGetCurrentFileZStreamPos64(streamRecord->zipFile);
+        fileEnd = fileRecord.zipLocalHeaderOffset + kLocalHeaderSlack + fileRecord.compressedSize;
     }
     
-    auto insertResult = pImpl->openStreams.insert(std::make_pair(streamRecord.randomValue, streamRecord));
+    if (fd < 0) return;
     
-    if (!insertResult.second) {
-        throw std::exception();
+    if (streamRecord->readAheadEnd == 0) {
+        TraceEventScope traceScope(eventTrace, "sequentialStream", "stream", streamRecord->filename);
+        adviseSequential(fd);
     }
     
-    return std::unique_ptr<Stream>(new Stream(reinterpret_cast<int>(streamRecord.randomValue)));
+    // after a seek forward start again from the reader
+    if (streamRecord->readAheadEnd < filePosition)
+        streamRecord->readAheadEnd = filePosition;
+    
+    if (streamRecord->readAheadEnd >= fileEnd || streamRecord->readAheadEnd - filePosition >= kReadAheadWindow) return;
+    
+    while (streamRecord->readAheadEnd < fileEnd && streamRecord->readAheadEnd < filePosition + 2 * kReadAheadWindow) {
+        uint64_t length = std::min(kReadAheadWindow, fileEnd - streamRecord->readAheadEnd);
+        
+        adviseWillNeed(fd, streamRecord->readAheadEnd, length);
+        stats.increment(CounterReadAheadBytes, length);
+        
+        streamRecord->readAheadEnd += length;
+    }
 }
 
-StreamRecord* ResourcesManagerImpl::getStreamRecord(int handle) {
-    auto it = openStreams.find(handle);
-    if (it == openStreams.end()) return nullptr;
+//
+// common methods
+//
+
+void ResourcesManagerImpl::traceAccess(const std::string& filename, const FileRecord& fileRecord, uint64_t offset, uint64_t size) {
+    if (!accessTrace.isRecording()) return;
     
-    return &it->second;
+    if (fileRecord.fileType == RegularFile)
+        accessTrace.record(filename, "", fileRecord.filePath, offset, size);
+    else
+        accessTrace.record(filename, fileRecord.zipFilePath, fileRecord.filename, offset, size);
 }
 
-size_t ResourcesManager::readData(int handle, void* buffer, int size) {
-    StreamRecord* streamRecord = pImpl->getStreamRecord(handle);
-    if (!streamRecord) return 0;
+static std::string makePathKey(const std::string& relativePath) {
+    return normalizePath(relativePath);
+}
+
+std::string ResourcesManagerImpl::makeKey(const std::string& filename) {
+//    filenameId = removeExtension(filenameId);
+    return normalizePath(index->searchByRelativePaths ? filename : basename(filename));
+}
+
+std::unique_ptr<IndexSnapshot> ResourcesManagerImpl::prepareIndexSnapshot() {
+    std::unique_ptr<IndexSnapshot> snapshot(new IndexSnapshot());
     
-    int ret = 0;
-    switch (streamRecord->fileRecord->fileType) {
-        case RegularFile:
-            ret = fread(buffer, 1, size, streamRecord->file);
-            break;
-            
-        case CompressedFile:
-        case StoredFile:
-        {
-            if (size == streamRecord->fileRecord->size) {
-                return pImpl->readDataFromCompressedFile(*streamRecord->fileRecord, buffer, size);
-            }
-            
-            // lazy open
-            pImpl->checkZipFileOpened(streamRecord);
-            
-            int unzRet = unzReadCurrentFile(streamRecord->zipFile, buffer, size);
-            if (unzRet < 0) throw std::exception();
-            return (unzRet == 0) ? size : unzRet;
-        }
+    snapshot->enableTrace = enableTrace;
+    snapshot->searchByRelativePaths = searchByRelativePaths;
+    snapshot->languageMasks = languageMasks;
+    snapshot->enabledCategories = enabledCategories;
+    
+    auto languageIt = languageMasks.find(languageId);
+    snapshot->languageMask = (languageIt != languageMasks.end()) ? languageIt->second : 0;
+    
+    auto addVariantFolder = [&snapshot](const std::string& folder) -> VariantFolder& {
+        std::string normalizedFolder = normalizePath(folder);
+        if (!normalizedFolder.empty() && normalizedFolder[normalizedFolder.size() - 1] == '/')
+            normalizedFolder.erase(normalizedFolder.size() - 1);
+        
+        size_t depth = std::count(normalizedFolder.begin(), normalizedFolder.end(), '/') + 1;
+        snapshot->variantFolderDepth = std::max(snapshot->variantFolderDepth, depth);
+        
+        return snapshot->variantFolders[normalizedFolder];
+    };
+    
+    for (auto& folderLanguageIdPair : relativeFolderToLanguageIdMap) {
+        addVariantFolder(folderLanguageIdPair.first).languageMask |= languageMasks.at(folderLanguageIdPair.second);
     }
     
-    return ret;
+    for (auto& folderCategoryPair : relativeFolderToCategoryMap) {
+        addVariantFolder(folderCategoryPair.first).categoryMask |= categoryMasks.at(folderCategoryPair.second);
+    }
+    
+    prepareSearchRoots(*snapshot);
+    
+    return snapshot;
 }
 
-int ResourcesManager::closeFile(int handle) {
-    StreamRecord* streamRecord = pImpl->getStreamRecord(handle);
-    if (!streamRecord) return 0;
+void ResourcesManagerImpl::prepareSearchRoots(IndexSnapshot& snapshot) {
+    snapshot.lowercaseSearchRootsList.clear();
+    for (auto searchRoot : searchRootsList) {
+        if (searchRoot.empty()) continue;
+        
+        snapshot.lowercaseSearchRootsList.push_back(normalizePath(searchRoot + "/"));
+    }
+}
+
+// higher priority layers override lower ones, equal priority - the latest added wins
+static bool overrides(const FileRecord* fileRecord, const FileRecord* indexedRecord) {
+    return !indexedRecord ||
+        indexedRecord->priority < fileRecord->priority ||
+        (indexedRecord->priority == fileRecord->priority && indexedRecord->layer <= fileRecord->layer);
+}
+
+void ResourcesManagerImpl::insertIntoIndex(const IndexSnapshot& snapshot, FileRecord*& indexedRecord, const std::string& key, FileRecord* fileRecord) {
+    if (!overrides(fileRecord, indexedRecord)) return;
     
-    int ret = 0;
+    indexedRecord = fileRecord;
     
-    switch (streamRecord->fileRecord->fileType) {
-        case RegularFile:
-            if (!streamRecord->file) {
-                break;
-            }
+    // into the ring of the building thread, background builds don't mix
+    // with anything else the process prints
+    if (snapshot.enableTrace && eventTrace.isRecording())
+        eventTrace.record("indexKey", "index", eventTrace.now(), 0, &key);
+}
 
-            ret = fclose(streamRecord->file);
-            streamRecord->file = NULL;
-            break;
+uint64_t ResourcesManagerImpl::internVariantBit(std::map<std::string, uint64_t>& masks, const std::string& name) {
+    auto it = masks.find(name);
+    if (it != masks.end()) return it->second;
+
+    if (masks.size() == kMaxVariantBits) throw std::exception();
+    
+    uint64_t mask = (uint64_t)1 << masks.size();
+    masks[name] = mask;
+    
+    return mask;
+}
+
+bool ResourcesManagerImpl::stripVariantFolders(const IndexSnapshot& snapshot, FileRecord& fileRecord, std::string* relativePathInMap, VariantRecord* variant) {
+    *relativePathInMap = normalizePath(fileRecord.relativePath);
+    variant->fileRecord = &fileRecord;
+    
+    if (snapshot.variantFolders.empty()) return false;
+    
+    // one hash lookup per directory component and folder depth, the longest
+    // folder starting at a component wins and is cut out of the key
+    const std::string& path = *relativePathInMap;
+    std::string folder;
+    std::string strippedPath;
+    size_t copiedLength = 0;
+    size_t componentStart = 0;
+    
+    while (true) {
+        size_t folderEnd = componentStart;
+        size_t matchedEnd = 0;
+        
+        for (size_t depth = 0; depth < snapshot.variantFolderDepth; depth++) {
+            folderEnd = path.find('/', folderEnd);
+            if (folderEnd == std::string::npos) break;
             
-        case CompressedFile:
-        case StoredFile: {
-            if (!streamRecord->zipFile) {
-                break;
+            folder.assign(path, componentStart, folderEnd - componentStart);
+            auto it = snapshot.variantFolders.find(folder);
+            if (it != snapshot.variantFolders.end()) {
+                variant->languageMask |= it->second.languageMask;
+                variant->categoryMask |= it->second.categoryMask;
+                matchedEnd = folderEnd + 1;
             }
-            unzClose(streamRecord->zipFile);
-            streamRecord->zipFile = NULL;
-            break;
+            
+            folderEnd++;
+        }
+        
+        if (matchedEnd) {
+            strippedPath.append(path, copiedLength, componentStart - copiedLength);
+            copiedLength = componentStart = matchedEnd;
+            continue;
         }
+        
+        size_t componentEnd = path.find('/', componentStart);
+        if (componentEnd == std::string::npos) break;
+        
+        componentStart = componentEnd + 1;
     }
     
-    pImpl->openStreams.erase(streamRecord->randomValue);
+    if (copiedLength == 0) return false;
     
-    return ret;
+    strippedPath.append(path, copiedLength, std::string::npos);
+    relativePathInMap->swap(strippedPath);
+    
+    return true;
 }
 
-int ResourcesManager::seek (int handle, long int offset, int whence) {
-    StreamRecord* streamRecord = pImpl->getStreamRecord(handle);
-    if (!streamRecord) return 0;
+static bool isVariantEnabled(uint64_t languageMask, uint64_t categoryMask, const VariantRecord& variant) {
+    return (variant.languageMask == 0 || variant.languageMask == languageMask) &&
+        (variant.categoryMask & ~categoryMask) == 0;
+}
 
-    int ret = 0;
+static bool isVariantEnabled(const IndexSnapshot& snapshot, const VariantRecord& variant) {
+    return isVariantEnabled(snapshot.languageMask, snapshot.enabledCategories, variant);
+}
+
+void ResourcesManagerImpl::indexPlainRecord(IndexSnapshot& snapshot, VariantIndex& variantIndex,
+                                            FileRecord*& indexedRecord, const std::string& key, FileRecord* fileRecord) {
+    insertIntoIndex(snapshot, indexedRecord, key, fileRecord);
     
-    switch (streamRecord->fileRecord->fileType) {
-        case RegularFile:
-            ret = fseek(streamRecord->file, offset, whence);
-            break;
-            
-        case CompressedFile:
-            throw std::exception();
-        case StoredFile: {
-            pImpl->checkZipFileOpened(streamRecord);
-            
-            switch (whence) {
-                case SEEK_SET:
-                    break;
-                case SEEK_CUR:
-                    break;
-                case SEEK_END:
-                    break;
-            }
+    // keys variants compete for keep the plain record apart as well
+    auto it = variantIndex.keys.find(key);
+    if (it != variantIndex.keys.end() && overrides(fileRecord, it->second.plainRecord))
+        it->second.plainRecord = fileRecord;
+}
+
+void ResourcesManagerImpl::indexVariantRecord(IndexSnapshot& snapshot, VariantIndex& variantIndex,
+                                              FileRecord*& indexedRecord, const std::string& key, const VariantRecord& variant) {
+    auto it = variantIndex.keys.find(key);
+    if (it == variantIndex.keys.end()) {
+        // no variant competed for the key so far, the indexed record is the plain one
+        it = variantIndex.keys.insert(std::make_pair(key, VariantKey())).first;
+        it->second.plainRecord = indexedRecord;
+    }
+    
+    VariantKey& variantKey = it->second;
+    
+    // each key listed once per language and category
+    for (uint64_t bits = variant.languageMask & ~variantKey.languageMask; bits; bits &= bits - 1) {
+        variantIndex.keysByLanguage[__builtin_ctzll(bits)].push_back(&*it);
+    }
+    
+    for (uint64_t bits = variant.categoryMask & ~variantKey.categoryMask; bits; bits &= bits - 1) {
+        variantIndex.keysByCategory[__builtin_ctzll(bits)].push_back(&*it);
+    }
+    
+    variantKey.languageMask |= variant.languageMask;
+    variantKey.categoryMask |= variant.categoryMask;
+    variantKey.variants.push_back(variant);
+    
+    if (isVariantEnabled(snapshot, variant))
+        insertIntoIndex(snapshot, indexedRecord, key, variant.fileRecord);
+}
+
+void ResourcesManagerImpl::indexFileRecords(IndexSnapshot& snapshot, const std::vector<FileRecord*>& fileRecords) {
+    // plain records first, records in language and category folders override
+    // them on equal priority and layer whatever order they were scanned in,
+    // so updateVariants gets the same result as a rebuild
+    std::vector<std::pair<std::string, VariantRecord>> variants;
+    
+    for (auto fileRecord : fileRecords) {
+        std::string relativePathInMap;
+        VariantRecord variant;
+        
+        if (stripVariantFolders(snapshot, *fileRecord, &relativePathInMap, &variant)) {
+            variants.push_back(std::make_pair(relativePathInMap, variant));
+            continue;
         }
-            
+        
+        // already normalized, stripping whole folders keeps it that way
+        indexPlainRecord(snapshot, snapshot.variantPaths, snapshot.pathTree[relativePathInMap], relativePathInMap, fileRecord);
+        
+        if (!snapshot.searchByRelativePaths) {
+            std::string key = normalizePath(basename(relativePathInMap));
+            indexPlainRecord(snapshot, snapshot.variantNames, snapshot.fileRecordIndex[key], key, fileRecord);
+        }
+    }
+
+    for (auto& pathVariantPair : variants) {
+        const std::string& relativePathInMap = pathVariantPair.first;
+        indexVariantRecord(snapshot, snapshot.variantPaths, snapshot.pathTree[relativePathInMap], relativePathInMap, pathVariantPair.second);
+
+        if (!snapshot.searchByRelativePaths) {
+            std::string key = normalizePath(basename(relativePathInMap));
+            indexVariantRecord(snapshot, snapshot.variantNames, snapshot.fileRecordIndex[key], key, pathVariantPair.second);
+        }
+    }
+}
+
+void ResourcesManagerImpl::indexAddedRecords(size_t firstRecord, unsigned layer) {
+    for (size_t i = firstRecord; i < fileRecordList.size(); i++) {
+        fileRecordList[i].layer = layer;
     }
     
-    return ret;
+    // a pending rebuild will pick the new records up anyway
+    if (shouldRebuildIndex || firstRecord == fileRecordList.size()) return;
+    
+    TraceEventScope traceScope(eventTrace, "indexAddedRecords", "index");
+    stats.increment(CounterIndexUpdates);
+    
+    std::vector<FileRecord*> fileRecords;
+    for (size_t i = firstRecord; i < fileRecordList.size(); i++) {
+        fileRecords.push_back(&fileRecordList[i]);
+    }
+    
+    indexFileRecords(*index, fileRecords);
 }
 
-long int ResourcesManager::tell(int handle) {
-    StreamRecord* streamRecord = pImpl->getStreamRecord(handle);
-    if (!streamRecord) return 0;
+void ResourcesManagerImpl::buildIndex(IndexSnapshot& snapshot, const std::vector<FileRecord*>& fileRecords) {
+    TraceEventScope traceScope(eventTrace, "rebuildIndex", "index");
+    StatsTimerScope timerScope(stats, TimerRebuildIndex);
+    stats.increment(CounterIndexRebuilds);
     
-    int ret = 0;
+    indexFileRecords(snapshot, fileRecords);
+}
+
+void ResourcesManagerImpl::resolveVariantKeys(IndexSnapshot& snapshot, VariantIndex& variantIndex,
+                                              uint64_t languageMask, uint64_t categoryMask,
+                                              const std::function<FileRecord*& (const std::string& key)>& indexedRecord) {
+    std::vector<VariantIndex::KeyMap::value_type*> keys;
     
-    switch (streamRecord->fileRecord->fileType) {
-        case RegularFile:
-            ret = ftell(streamRecord->file);
-            break;
-            
-        case CompressedFile:
-        case StoredFile: {
-            throw std::exception();
-        }
+    for (uint64_t bits = languageMask; bits; bits &= bits - 1) {
+        auto& languageKeys = variantIndex.keysByLanguage[__builtin_ctzll(bits)];
+        keys.insert(keys.end(), languageKeys.begin(), languageKeys.end());
     }
     
-    return ret;
+    for (uint64_t bits = categoryMask; bits; bits &= bits - 1) {
+        auto& categoryKeys = variantIndex.keysByCategory[__builtin_ctzll(bits)];
+        keys.insert(keys.end(), categoryKeys.begin(), categoryKeys.end());
+    }
+    
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    
+    stats.increment(CounterIndexDeltaKeys, keys.size());
+    
+    for (auto keyVariantsPair : keys) {
+        const std::string& key = keyVariantsPair->first;
+        const VariantKey& variantKey = keyVariantsPair->second;
+        
+        // same order as indexFileRecords, the plain record then the variants
+        FileRecord*& record = indexedRecord(key);
+        record = variantKey.plainRecord;
+        
+        for (auto& variant : variantKey.variants) {
+            if (isVariantEnabled(snapshot, variant))
+                insertIntoIndex(snapshot, record, key, variant.fileRecord);
+        }
+    }
 }
 
+void ResourcesManagerImpl::updateVariants(IndexSnapshot& snapshot) {
+    variantsChanged = false;
+    
+    auto languageIt = snapshot.languageMasks.find(languageId);
+    uint64_t languageMask = (languageIt != snapshot.languageMasks.end()) ? languageIt->second : 0;
+    
+    // only keys with a record in a folder of the old or the new language,
+    // or of a category switched on or off, can resolve differently
+    uint64_t switchedLanguages = snapshot.languageMask ^ languageMask;
+    uint64_t toggledCategories = snapshot.enabledCategories ^ enabledCategories;
+    
+    if (!switchedLanguages && !toggledCategories) return;
+    
+    TraceEventScope traceScope(eventTrace, "updateVariants", "index");
+    StatsTimerScope timerScope(stats, TimerUpdateVariants);
+    stats.increment(CounterIndexDeltaUpdates);
+    
+    snapshot.languageMask = languageMask;
+    snapshot.enabledCategories = enabledCategories;
+    
+    resolveVariantKeys(snapshot, snapshot.variantPaths, switchedLanguages, toggledCategories, [&snapshot](const std::string& key) -> FileRecord*& {
+        return snapshot.pathTree[key];
+    });
+    resolveVariantKeys(snapshot, snapshot.variantNames, switchedLanguages, toggledCategories, [&snapshot](const std::string& key) -> FileRecord*& {
+        return snapshot.fileRecordIndex[key];
+    });
+}
+
+void ResourcesManagerImpl::rebuildIndex() {
+    // a background build in flight is not newer than this one
+    finishIndexBuild(false);
+    
+    std::unique_ptr<IndexSnapshot> snapshot = prepareIndexSnapshot();
+    
+    std::vector<FileRecord*> fileRecords;
+    for (auto& fileRecord : fileRecordList) {
+        fileRecords.push_back(&fileRecord);
+    }
+    
+    buildIndex(*snapshot, fileRecords);
+    
+    index = std::move(snapshot);
+    shouldRebuildIndex = false;
+    variantsChanged = false;
+    indexBuilt = true;
+}
+
+std::shared_future<void> ResourcesManagerImpl::startIndexBuild() {
+    // one build at a time, a configuration changed since the running one
+    // started needs another
+    if (indexBuild) {
+        if (!shouldRebuildIndex) return indexBuild->ready;
+        
+        finishIndexBuild(true);
+    }
+    
+    stats.increment(CounterIndexBackgroundBuilds);
+    
+    // the configuration is copied here; records stay in place in the deque
+    // while layers are appended, the thread only reads the ones taken now
+    std::unique_ptr<IndexBuild> build(new IndexBuild());
+    build->index = prepareIndexSnapshot();
+    build->ready = build->built.get_future().share();
+    
+    for (auto& fileRecord : fileRecordList) {
+        build->fileRecords.push_back(&fileRecord);
+    }
+
+    IndexBuild* runningBuild = build.get();
+    build->thread = std::thread([this, runningBuild]() {
+        try {
+            buildIndex(*runningBuild->index, runningBuild->fileRecords);
+        }
+        catch (...) {
+            runningBuild->built.set_exception(std::current_exception());
+            return;
+        }
+
+        runningBuild->built.set_value();
+    });
+
+    indexBuild = std::move(build);
+    shouldRebuildIndex = false;
+
+    return indexBuild->ready;
+}
+
+void ResourcesManagerImpl::finishIndexBuild(bool publish) {
+    if (!indexBuild) return;
+    
+    std::unique_ptr<IndexBuild> build = std::move(indexBuild);
+    build->thread.join();
+
+    if (!publish) return;
+
+    // rethrows what the build threw
+    build->ready.get();
+
+    // layers and search roots added while it ran
+    std::vector<FileRecord*> addedRecords;
+    for (size_t i = build->fileRecords.size(); i < fileRecordList.size(); i++) {
+        addedRecords.push_back(&fileRecordList[i]);
+    }
+    
+    indexFileRecords(*build->index, addedRecords);
+    prepareSearchRoots(*build->index);
+    
+    index = std::move(build->index);
+    indexBuilt = true;
+    
+    // language or categories switched while it ran
+    variantsChanged = true;
+}
+
+void ResourcesManagerImpl::updateIndex() {
+    // lookups inside a configuration transaction see the index from before it
+    if (configurationDepth > 0 && indexBuilt) return;
+    
+    if (indexBuild) {
+        bool built = indexBuild->ready.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        
+        // before the first index there is nothing older to answer with
+        if (built || !indexBuilt)
+            finishIndexBuild(true);
+    }
+    
+    if (shouldRebuildIndex) {
+        // a change during a background build waits for it to be published
+        if (!backgroundIndexing || !indexBuilt)
+            rebuildIndex();
+        else if (!indexBuild)
+            startIndexBuild();
+    }
+    
+    // the previous index keeps answering a background build with the new variants
+    if (variantsChanged)
+        updateVariants(*index);
+}
+
+void ResourcesManager::rebuildIndex() {
+    pImpl->rebuildIndex();
+}
+
+std::shared_future<void> ResourcesManager::rebuildIndexAsync() {
+    return pImpl->startIndexBuild();
+}
+
+void ResourcesManager::setBackgroundIndexing(bool backgroundIndexing) {
+    pImpl->backgroundIndexing = backgroundIndexing;
+}
+
+void ResourcesManager::beginConfiguration() {
+    pImpl->configurationDepth++;
+}
+
+void ResourcesManager::commitConfiguration() {
+    if (pImpl->configurationDepth == 0) throw std::exception();
+    
+    if (--pImpl->configurationDepth == 0)
+        pImpl->updateIndex();
+}
+
+FileRecord* ResourcesManagerImpl::findFileRecord(const std::string& filename, const ResolutionContext* context) {
+    
+    updateIndex();
+    
+    StatsTimerScope timerScope(stats, TimerFindFileRecord);
+    stats.increment(CounterLookups);
+    
+    if (indexBuild)
+        stats.increment(CounterStaleIndexLookups);
+    
+    std::string key = makeKey(filename);
+    
+    FileRecord* fileRecord = findIndexedRecord(key, context);
+    
+    if (!lazyArchives.empty() && mountLazyArchives(key, fileRecord))
+        fileRecord = findIndexedRecord(key, context);
+    
+    if (!fileRecord || fileRecord->fileType == Tombstone) {
+        stats.increment(CounterLookupMisses);
+        return nullptr;
+    }
+    
+    return fileRecord;
+}
+
+static uint64_t contextLanguageMask(const IndexSnapshot& snapshot, const ResolutionContext& context) {
+    auto it = snapshot.languageMasks.find(context.languageId);
+    return (it != snapshot.languageMasks.end()) ? it->second : 0;
+}
+
+// findFileRecord for the public calls, a lookup may still rebuild the index
+// or mount a lazy archive while other threads read
+FileRecord* ResourcesManagerImpl::lookupFileRecord(const std::string& filename, const ResolutionContext* context /* = nullptr */) {
+    std::lock_guard<std::mutex> lock(rangedReadMutex);
+    
+    return findFileRecord(filename, context);
+}
+
+// record the key resolves to for the context, indexedRecord being what it
+// resolves to for the current language and categories
+static FileRecord* resolveVariant(const VariantIndex& variantIndex, const std::string& key, FileRecord* indexedRecord,
+                                  uint64_t languageMask, const ResolutionContext& context) {
+    auto it = variantIndex.keys.find(key);
+    if (it == variantIndex.keys.end()) return indexedRecord;
+    
+    // same order as indexFileRecords, the plain record then the variants
+    FileRecord* fileRecord = it->second.plainRecord;
+    for (auto& variant : it->second.variants) {
+        if (isVariantEnabled(languageMask, context.categories, variant) && overrides(variant.fileRecord, fileRecord))
+            fileRecord = variant.fileRecord;
+    }
+    
+    return fileRecord;
+}
+
+FileRecord* ResourcesManagerImpl::findIndexedRecord(const std::string& key, const ResolutionContext* context) {
+    if (index->searchByRelativePaths)
+        return findInPathTree(key, context);
+    
+    auto it = index->fileRecordIndex.find(key);
+    FileRecord* fileRecord = (it != index->fileRecordIndex.end()) ? it->second : nullptr;
+    
+    return context ? resolveVariant(index->variantNames, key, fileRecord, contextLanguageMask(*index, *context), *context) : fileRecord;
+}
+
+FileRecord* ResourcesManagerImpl::findInPathTree(const std::string& key, const ResolutionContext* context) {
+    const RadixTree<FileRecord*>& pathTree = index->pathTree;
+    
+    auto node = pathTree.find(pathTree.rootNode(), key);
+    FileRecord* fileRecord = (node && node->hasValue) ? node->value : nullptr;
+    
+    uint64_t languageMask = context ? contextLanguageMask(*index, *context) : 0;
+    if (context)
+        fileRecord = resolveVariant(index->variantPaths, key, fileRecord, languageMask, *context);
+    
+    // the key under every search root, by the same rule as overlapping
+    // layers; within one layer the full path and earlier roots win
+    for (auto& searchRoot : index->lowercaseSearchRootsList) {
+        node = pathTree.find(pathTree.rootNode(), searchRoot, key);
+        if (!node || !node->hasValue) continue;
+        
+        FileRecord* rootRecord = node->value;
+        if (context)
+            rootRecord = resolveVariant(index->variantPaths, searchRoot + key, rootRecord, languageMask, *context);
+        
+        if (rootRecord && overrides(rootRecord, fileRecord) && (!fileRecord || rootRecord->layer != fileRecord->layer))
+            fileRecord = rootRecord;
+    }
+    
+    return fileRecord;
+}
+
+bool ResourcesManager::exists(const std::string& filename) {
+    return (pImpl->lookupFileRecord(filename) != nullptr);
+}
+
+size_t ResourcesManagerImpl::readData(const FileRecord& fileRecord, void* buffer, int size) {
+    if (fileRecord.fileType == RegularFile) {
+        return readDataFromRegularFile(fileRecord.filePath, buffer, size);
+    }
+    else if (fileRecord.fileType == CompressedFile || fileRecord.fileType == StoredFile) {
+        return readDataFromCompressedFile(fileRecord, buffer, size);
+    }
+
+    return 0;
+}
+
+size_t ResourcesManager::readData(const std::string& filename, void* buffer, int size) {
+    TraceEventScope traceScope(pImpl->eventTrace, "readData", "io", filename);
+    
+    FileRecord* fileRecord = pImpl->lookupFileRecord(filename);
+    if (!fileRecord) return 0;
+    
+    pImpl->traceAccess(filename, *fileRecord, 0, size);
+    
+    size_t bytesRead = pImpl->readData(*fileRecord, buffer, size);
+    fileRecord->accessCounters.recordRead(bytesRead);
+    
+    return bytesRead;
+}
+
+std::unique_ptr<char[]> ResourcesManager::readData(const std::string& filename, size_t* pBytesRead) {
+    TraceEventScope traceScope(pImpl->eventTrace, "readData", "io", filename);
+    
+    FileRecord* fileRecord = pImpl->lookupFileRecord(filename);
+    if (!fileRecord) {
+        if (pBytesRead)
+            *pBytesRead = 0;
+        return nullptr;
+    }
+    
+    pImpl->traceAccess(filename, *fileRecord, 0, fileRecord->size);
+    
+    std::unique_ptr<char[]> buffer(new char[fileRecord->size]);
+    size_t bytesRead = pImpl->readData(*fileRecord, buffer.get(), fileRecord->size);
+    if (bytesRead != fileRecord->size) throw std::exception();
+    
+    fileRecord->accessCounters.recordRead(bytesRead);
+    
+    if (pBytesRead)
+        *pBytesRead = bytesRead;
+    
+    return buffer;
+}
+
+void* ResourcesManager::readData(const std::string& filename, ResourceAllocator& allocator, size_t* pBytesRead) {
+    TraceEventScope traceScope(pImpl->eventTrace, "readData", "io", filename);
+    
+    if (pBytesRead)
+        *pBytesRead = 0;
+    
+    FileRecord* fileRecord = pImpl->lookupFileRecord(filename);
+    if (!fileRecord) return nullptr;
+    
+    pImpl->traceAccess(filename, *fileRecord, 0, fileRecord->size);
+    
+    return pImpl->readData(*fileRecord, allocator, pBytesRead);
+}
+
+void* ResourcesManagerImpl::readData(const FileRecord& fileRecord, ResourceAllocator& allocator, size_t* pBytesRead) {
+    void* buffer = allocator.allocate(fileRecord.size);
+    if (!buffer) throw std::exception();
+    
+    size_t bytesRead = 0;
+    try {
+        bytesRead = readData(fileRecord, buffer, (int)fileRecord.size);
+    }
+    catch (...) {
+        allocator.deallocate(buffer, fileRecord.size);
+        throw;
+    }
+    
+    if (bytesRead != fileRecord.size) {
+        allocator.deallocate(buffer, fileRecord.size);
+        throw std::exception();
+    }
+    
+    fileRecord.accessCounters.recordRead(bytesRead);
+
+    if (pBytesRead)
+        *pBytesRead = bytesRead;
+    
+    return buffer;
+}
+
+size_t ResourcesManager::getSize(const std::string& filename) {
+    FileRecord* fileRecord = pImpl->lookupFileRecord(filename);
+    if (!fileRecord) return 0;
+
+    return fileRecord->size;
+}
+
+std::unique_ptr<Stream> ResourcesManager::getStream(const std::string& filename) {
+    TraceEventScope traceScope(pImpl->eventTrace, "openStream", "stream", filename);
+    
+    FileRecord* fileRecord = pImpl->lookupFileRecord(filename);
+    if (!fileRecord) return nullptr;
+    
+    pImpl->traceAccess(filename, *fileRecord, 0, 0);
+    fileRecord->accessCounters.recordRead(0);
+    
+    StatsTimerScope timerScope(pImpl->stats, TimerStreamOpen);
+    pImpl->stats.increment(CounterStreamsOpened);
+    
+    StreamRecord streamRecord;
+    streamRecord.fileRecord = fileRecord;
+    streamRecord.filename = filename;
+    streamRecord.randomValue = arc4random();
+    streamRecord.file = NULL;
+    streamRecord.zipFile = NULL;
+    streamRecord.nextOffset = 0;
+    streamRecord.sequentialReads = 0;
+    streamRecord.readAheadFd = -1;
+    streamRecord.readAheadEnd = 0;
+    
+    switch (fileRecord->fileType) {
+        case RegularFile:
+            streamRecord.file = fopen(fileRecord->filePath.c_str(), "rb");
+            if (!streamRecord.file) return nullptr;
+            break;
+            
+        case CompressedFile:
+        case StoredFile:
+        {
+            // lazy open
+            break;
+        }
+            
+        case Tombstone:
+            return nullptr;
+    }
+    
+    auto insertResult = pImpl->openStreams.insert(std::make_pair(streamRecord.randomValue, streamRecord));
+    
+    if (!insertResult.second) {
+        throw std::exception();
+    }
+    
+    return std::unique_ptr<Stream>(new Stream(this, reinterpret_cast<int>(streamRecord.randomValue)));
+}
+
+StreamRecord* ResourcesManagerImpl::getStreamRecord(int handle) {
+    auto it = openStreams.find(handle);
+    if (it == openStreams.end()) return nullptr;
+    
+    return &it->second;
+}
+
+size_t ResourcesManager::readData(int handle, void* buffer, int size) {
+    StreamRecord* streamRecord = pImpl->getStreamRecord(handle);
+    if (!streamRecord) return 0;
+    
+    TraceEventScope traceScope(pImpl->eventTrace, "readStream", "stream", streamRecord->filename);
+    
+    if (pImpl->accessTrace.isRecording()) {
+        uint64_t offset = 0;
+        if (streamRecord->file)
+            offset = ftell(streamRecord->file);
+        else if (streamRecord->zipFile)
+            offset = unztell64(streamRecord->zipFile);
+        
+        pImpl->traceAccess(streamRecord->filename, *streamRecord->fileRecord, offset, size);
+    }
+    
+    int ret = 0;
+    switch (streamRecord->fileRecord->fileType) {
+        case RegularFile: {
+            StatsTimerScope timerScope(pImpl->stats, TimerReadRegular);
+            pImpl->readAhead(streamRecord, ftell(streamRecord->file), size);
+            
+            ret = fread(buffer, 1, size, streamRecord->file);
+            break;
+        }
+            
+        case CompressedFile:
+        case StoredFile:
+        {
+            if (size == streamRecord->fileRecord->size) {
+                return pImpl->readDataFromCompressedFile(*streamRecord->fileRecord, buffer, size);
+            }
+            
+            StatsTimerScope timerScope(pImpl->stats, streamRecord->fileRecord->fileType == StoredFile ? TimerReadStored : TimerReadCompressed);
+            
+            // lazy open
+            pImpl->checkZipFileOpened(streamRecord);
+            pImpl->readAhead(streamRecord, unztell64(streamRecord->zipFile), size);
+            
+            auto startTime = std::chrono::steady_clock::now();
+            
+            int unzRet = unzReadCurrentFile(streamRecord->zipFile, buffer, size);
+            if (unzRet < 0) throw std::exception();
+            
+            if (streamRecord->fileRecord->fileType == CompressedFile)
+                streamRecord->fileRecord->accessCounters.decompressionNanoseconds.fetch_add(nanosecondsSince(startTime), std::memory_order_relaxed);
+            
+            ret = (unzRet == 0) ? size : unzRet;
+            if (streamRecord->fileRecord->fileType == CompressedFile)
+                pImpl->stats.increment(CounterBytesInflated, ret);
+            break;
+        }
+            
+        case Tombstone:
+            break;
+    }
+    
+    pImpl->stats.increment(CounterBytesRead, ret);
+    streamRecord->fileRecord->accessCounters.bytesServed.fetch_add(ret, std::memory_order_relaxed);
+    
+    return ret;
+}
+
+int ResourcesManager::closeFile(int handle) {
+    StreamRecord* streamRecord = pImpl->getStreamRecord(handle);
+    if (!streamRecord) return 0;
+    
+    TraceEventScope traceScope(pImpl->eventTrace, "closeStream", "stream");
+    
+    StatsTimerScope timerScope(pImpl->stats, TimerStreamClose);
+    pImpl->stats.increment(CounterStreamsClosed);
+    
+    int ret = 0;
+    
+    switch (streamRecord->fileRecord->fileType) {
+        case RegularFile:
+            if (!streamRecord->file) {
+                break;
+            }
+
+            ret = fclose(streamRecord->file);
+            streamRecord->file = NULL;
+            break;
+            
+        case CompressedFile:
+        case StoredFile: {
+            if (!streamRecord->zipFile) {
+                break;
+            }
+            unzClose(streamRecord->zipFile);
+            streamRecord->zipFile = NULL;
+            break;
+        }
+            
+        case Tombstone:
+            break;
+    }
+    
+    if (streamRecord->readAheadFd >= 0) {
+        close(streamRecord->readAheadFd);
+        streamRecord->readAheadFd = -1;
+    }
+    
+    pImpl->openStreams.erase(streamRecord->randomValue);
+    
+    return ret;
+}
+
+int ResourcesManager::seek (int handle, long int offset, int whence) {
+    StreamRecord* streamRecord = pImpl->getStreamRecord(handle);
+    if (!streamRecord) return 0;
+    
+    TraceEventScope traceScope(pImpl->eventTrace, "seekStream", "stream", streamRecord->filename);
+
+    int ret = 0;
+    
+    switch (streamRecord->fileRecord->fileType) {
+        case RegularFile:
+            ret = fseek(streamRecord->file, offset, whence);
+            break;
+            
+        case CompressedFile:
+            throw std::exception();
+        case StoredFile: {
+            pImpl->checkZipFileOpened(streamRecord);
+            
+            switch (whence) {
+                case SEEK_SET:
+                    break;
+                case SEEK_CUR:
+                    break;
+                case SEEK_END:
+                    break;
+            }
+            break;
+        }
+            
+        case Tombstone:
+            break;
+    }
+    
+    return ret;
+}
+
+long int ResourcesManager::tell(int handle) {
+    StreamRecord* streamRecord = pImpl->getStreamRecord(handle);
+    if (!streamRecord) return 0;
+    
+    int ret = 0;
+    
+    switch (streamRecord->fileRecord->fileType) {
+        case RegularFile:
+            ret = ftell(streamRecord->file);
+            break;
+            
+        case CompressedFile:
+        case StoredFile: {
+            throw std::exception();
+        }
+            
+        case Tombstone:
+            break;
+    }
+    
+    return ret;
+}
+
+//
+// batched reads
+//
+
+// local file header: signature, then name and extra field lengths at 26 and 28
+static const size_t kLocalHeaderSize = 30;
+
+static bool parseLocalHeader(const unsigned char* header, uint64_t localHeaderOffset, uint64_t* dataOffset) {
+    if (header[0] != 'P' || header[1] != 'K' || header[2] != 3 || header[3] != 4) return false;
+    
+    unsigned nameLength  = header[26] | (header[27] << 8);
+    unsigned extraLength = header[28] | (header[29] << 8);
+    *dataOffset = localHeaderOffset + kLocalHeaderSize + nameLength + extraLength;
+    
+    return true;
+}
+
+void ResourcesManager::setIOEngine(IOEngineType type, unsigned queueDepth /* = 64 */) {
+    pImpl->ioEngine = IOEngine::create(type, queueDepth);
+}
+
+size_t ResourcesManager::readBatch(std::vector<BatchRead>& reads) {
+    TraceEventScope traceScope(pImpl->eventTrace, "readBatch", "io");
+    
+    std::vector<FileRecord*> fileRecords;
+    size_t found = 0;
+    
+    for (auto& read : reads) {
+        read.bytesRead = 0;
+        
+        FileRecord* fileRecord = pImpl->lookupFileRecord(read.filename);
+        fileRecords.push_back(fileRecord);
+        if (!fileRecord) continue;
+        
+        pImpl->traceAccess(read.filename, *fileRecord, 0, read.size);
+        found++;
+    }
+    
+    if (pImpl->ioEngine) {
+        pImpl->readBatchWithEngine(reads, fileRecords);
+    }
+    else {
+        for (size_t i = 0; i < reads.size(); i++) {
+            if (!fileRecords[i]) continue;
+            
+            size_t size = std::min(reads[i].size, fileRecords[i]->size);
+            reads[i].bytesRead = pImpl->readData(*fileRecords[i], reads[i].buffer, (int)size);
+        }
+    }
+    
+    for (size_t i = 0; i < reads.size(); i++) {
+        if (fileRecords[i])
+            fileRecords[i]->accessCounters.recordRead(reads[i].bytesRead);
+    }
+    
+    return found;
+}
+
+void ResourcesManagerImpl::readBatchWithEngine(std::vector<BatchRead>& reads, std::vector<FileRecord*>& fileRecords) {
+    // descriptors are opened once per file for the batch and closed when it
+    // ends, also when an inflate or crc check throws
+    struct BatchFiles {
+        std::map<std::string, int> fds;
+        
+        ~BatchFiles() {
+            for (auto& pathFdPair : fds) {
+                if (pathFdPair.second >= 0) close(pathFdPair.second);
+            }
+        }
+    } batchFiles;
+    
+    auto openFile = [&batchFiles](const std::string& path) {
+        auto it = batchFiles.fds.find(path);
+        if (it != batchFiles.fds.end()) return it->second;
+        
+        int fd = open(path.c_str(), O_RDONLY);
+        batchFiles.fds[path] = fd;
+        return fd;
+    };
+    
+    // the first pass reads local headers of archive entries not read before
+    std::vector<IORequest> requests;
+    std::vector<size_t> requestReads;
+    std::vector<unsigned char> headers;
+    
+    for (size_t i = 0; i < reads.size(); i++) {
+        const FileRecord* fileRecord = fileRecords[i];
+        if (!fileRecord || fileRecord->fileType == RegularFile || fileRecord->zipDataOffset != 0) continue;
+        
+        IORequest request;
+        request.fd = openFile(fileRecord->zipFilePath);
+        request.offset = fileRecord->zipLocalHeaderOffset;
+        request.buffer = nullptr;
+        request.length = kLocalHeaderSize;
+        request.result = 0;
+        
+        if (request.fd < 0) continue;
+        
+        requests.push_back(request);
+        requestReads.push_back(i);
+    }
+    
+    if (!requests.empty()) {
+        headers.resize(requests.size() * kLocalHeaderSize);
+        for (size_t r = 0; r < requests.size(); r++) {
+            requests[r].buffer = &headers[r * kLocalHeaderSize];
+        }
+        
+        ioEngine->submit(requests);
+        
+        for (size_t r = 0; r < requests.size(); r++) {
+            const FileRecord* fileRecord = fileRecords[requestReads[r]];
+            uint64_t dataOffset = 0;
+            if (requests[r].result == (ssize_t)kLocalHeaderSize &&
+                parseLocalHeader(&headers[r * kLocalHeaderSize], fileRecord->zipLocalHeaderOffset, &dataOffset)) {
+                fileRecord->zipDataOffset = dataOffset;
+            }
+        }
+    }
+    
+    // the second pass reads payloads: straight into the caller's buffer for
+    // regular files and stored entries, into staging memory for deflated ones
+    requests.clear();
+    requestReads.clear();
+    
+    const size_t kNotStaged = (size_t)-1;
+    std::vector<size_t> stagingOffsets;
+    size_t stagingSize = 0;
+    std::vector<size_t> fallbackReads;
+    
+    for (size_t i = 0; i < reads.size(); i++) {
+        const FileRecord* fileRecord = fileRecords[i];
+        if (!fileRecord) continue;
+        
+        size_t size = std::min(reads[i].size, fileRecord->size);
+        
+        IORequest request;
+        request.result = 0;
+        bool staged = false;
+        
+        if (fileRecord->fileType == RegularFile) {
+            request.fd = openFile(fileRecord->filePath);
+            request.offset = 0;
+            request.buffer = reads[i].buffer;
+            request.length = size;
+        }
+        else if (fileRecord->fileType == StoredFile && fileRecord->zipDataOffset != 0) {
+            request.fd = openFile(fileRecord->zipFilePath);
+            request.offset = fileRecord->zipDataOffset;
+            request.buffer = reads[i].buffer;
+            request.length = size;
+        }
+        else if (fileRecord->fileType == CompressedFile && fileRecord->compressionMethod == Z_DEFLATED &&
+                 fileRecord->zipDataOffset != 0) {
+            size_t cachedBytesRead = 0;
+            if (readFromDecompressedCache(*fileRecord, reads[i].buffer, (int)size, &cachedBytesRead)) {
+                stats.increment(CounterDecompressedCacheHits);
+                stats.increment(CounterBytesRead, cachedBytesRead);
+                reads[i].bytesRead = cachedBytesRead;
+                continue;
+            }
+            
+            request.fd = openFile(fileRecord->zipFilePath);
+            request.offset = fileRecord->zipDataOffset;
+            request.buffer = nullptr;
+            request.length = fileRecord->compressedSize;
+            staged = true;
+        }
+        else {
+            // other codecs and entries with unreadable headers go through unzip
+            fallbackReads.push_back(i);
+            continue;
+        }
+        
+        if (request.fd < 0) continue;
+        
+        // one entry per submitted request, kNotStaged for the caller's buffers
+        stagingOffsets.push_back(staged ? stagingSize : kNotStaged);
+        if (staged) stagingSize += request.length;
+        
+        requests.push_back(request);
+        requestReads.push_back(i);
+    }
+    
+    char* staging = stagingSize > 0 ? ioEngine->stagingBuffer(stagingSize) : nullptr;
+    if (stagingSize > 0 && !staging) throw std::exception();
+    
+    for (size_t r = 0; r < requests.size(); r++) {
+        if (stagingOffsets[r] != kNotStaged)
+            requests[r].buffer = staging + stagingOffsets[r];
+    }
+    
+    {
+        TraceEventScope traceScope(eventTrace, "submitBatch", "io");
+        ioEngine->submit(requests);
+    }
+    
+    for (size_t r = 0; r < requests.size(); r++) {
+        BatchRead& read = reads[requestReads[r]];
+        const FileRecord& fileRecord = *fileRecords[requestReads[r]];
+        if (requests[r].result < 0) continue;
+        
+        if (fileRecord.fileType != CompressedFile) {
+            read.bytesRead = requests[r].result;
+            stats.increment(CounterBytesRead, read.bytesRead);
+            
+            verifyCrc(fileRecord, read.buffer, read.bytesRead);
+            continue;
+        }
+        
+        if ((uint64_t)requests[r].result != fileRecord.compressedSize) continue;
+        
+        TraceEventScope traceScope(eventTrace, "inflate", "cpu", fileRecord.filename);
+        auto startTime = std::chrono::steady_clock::now();
+        
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) throw std::exception();
+        
+        stream.next_in   = (Bytef*)requests[r].buffer;
+        stream.avail_in  = (uInt)fileRecord.compressedSize;
+        stream.next_out  = (Bytef*)read.buffer;
+        stream.avail_out = (uInt)std::min(read.size, fileRecord.size);
+        
+        int ret = inflate(&stream, Z_FINISH);
+        size_t bytesInflated = stream.total_out;
+        inflateEnd(&stream);
+        
+        fileRecord.accessCounters.decompressionNanoseconds.fetch_add(nanosecondsSince(startTime), std::memory_order_relaxed);
+        
+        if (ret != Z_STREAM_END && ret != Z_BUF_ERROR && ret != Z_OK) throw std::exception();
+        
+        verifyCrc(fileRecord, read.buffer, bytesInflated);
+        if (bytesInflated == fileRecord.size) {
+            storeInDecompressedCache(fileRecord, read.buffer, bytesInflated);
+        }
+        
+        read.bytesRead = bytesInflated;
+        stats.increment(CounterBytesRead, bytesInflated);
+        stats.increment(CounterBytesInflated, bytesInflated);
+    }
+    
+    for (size_t i : fallbackReads) {
+        size_t size = std::min(reads[i].size, fileRecords[i]->size);
+        reads[i].bytesRead = readData(*fileRecords[i], reads[i].buffer, (int)size);
+    }
+}
+
+//
+// vectored reads
+//
+
+// IOV_MAX on Linux and macOS, longer lists are read in several calls
+static const size_t kMaxSegmentsPerCall = 1024;
+// compressed input is read and offsets are inflated into scratch memory in chunks of this size
+static const size_t kInflateChunkSize = 64 * 1024;
+
+static ssize_t preadSegments(int fd, const struct iovec* iov, size_t count, uint64_t offset) {
+#if defined(__APPLE__)
+    // preadv is missing before macOS 11 and iOS 14, the caller's loop goes on with the next segment
+    (void)count;
+    return pread(fd, iov[0].iov_base, iov[0].iov_len, offset);
+#else
+    return preadv(fd, iov, (int)count, offset);
+#endif
+}
+
+// positional scatter read of length bytes over segments, repeated after short
+// reads; returns less than length only at end of file
+static uint64_t preadSegments(int fd, uint64_t offset, const std::vector<ReadSegment>& segments, uint64_t length) {
+    std::vector<struct iovec> iov;
+    for (auto& segment : segments) {
+        if (length == 0) break;
+        if (segment.size == 0) continue;
+        
+        struct iovec vec;
+        vec.iov_base = segment.buffer;
+        vec.iov_len  = (size_t)std::min(segment.size, length);
+        iov.push_back(vec);
+        length -= vec.iov_len;
+    }
+    
+    uint64_t bytesRead = 0;
+    size_t first = 0;
+    
+    while (first < iov.size()) {
+        ssize_t ret = preadSegments(fd, &iov[first], std::min(iov.size() - first, kMaxSegmentsPerCall), offset + bytesRead);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0) throw std::exception();
+        if (ret == 0) break;
+        
+        bytesRead += ret;
+        
+        // skip filled segments and trim a partially filled one
+        size_t done = ret;
+        while (first < iov.size() && done >= iov[first].iov_len) {
+            done -= iov[first].iov_len;
+            first++;
+        }
+        if (done > 0) {
+            iov[first].iov_base = (char*)iov[first].iov_base + done;
+            iov[first].iov_len -= done;
+        }
+    }
+    
+    return bytesRead;
+}
+
+static void copyToSegments(const char* data, uint64_t length, const std::vector<ReadSegment>& segments) {
+    for (auto& segment : segments) {
+        if (length == 0) break;
+        
+        uint64_t size = std::min(segment.size, length);
+        memcpy(segment.buffer, data, (size_t)size);
+        data += size;
+        length -= size;
+    }
+}
+
+// data offset of an archive entry from its local header, read once per record
+static bool resolveDataOffset(const FileRecord& fileRecord, int fd) {
+    if (fileRecord.zipDataOffset != 0) return true;
+    
+    unsigned char header[kLocalHeaderSize];
+    if (pread(fd, header, kLocalHeaderSize, fileRecord.zipLocalHeaderOffset) != (ssize_t)kLocalHeaderSize) return false;
+    
+    uint64_t dataOffset = 0;
+    if (!parseLocalHeader(header, fileRecord.zipLocalHeaderOffset, &dataOffset)) return false;
+    
+    fileRecord.zipDataOffset = dataOffset;
+    return true;
+}
+
+uint64_t ResourcesManager::readData(const std::string& filename, uint64_t offset, const std::vector<ReadSegment>& segments) {
+    TraceEventScope traceScope(pImpl->eventTrace, "readSegments", "io", filename);
+    
+    FileRecord* fileRecord = pImpl->lookupFileRecord(filename);
+    if (!fileRecord) return 0;
+    
+    uint64_t length = 0;
+    for (auto& segment : segments) {
+        length += segment.size;
+    }
+    
+    pImpl->traceAccess(filename, *fileRecord, offset, length);
+    
+    uint64_t bytesRead = pImpl->readSegments(*fileRecord, offset, segments);
+    fileRecord->accessCounters.recordRead(bytesRead);
+    
+    return bytesRead;
+}
+
+uint64_t ResourcesManagerImpl::readSegments(const FileRecord& fileRecord, uint64_t offset, const std::vector<ReadSegment>& segments) {
+    uint64_t length = 0;
+    for (auto& segment : segments) {
+        length += segment.size;
+    }
+    
+    if (fileRecord.fileType == Tombstone || offset >= fileRecord.size) return 0;
+    length = std::min<uint64_t>(length, fileRecord.size - offset);
+    if (length == 0) return 0;
+    
+    // whole entries kept decompressed are copied from the cache
+    if (fileRecord.fileType == CompressedFile) {
+        std::lock_guard<std::mutex> lock(rangedReadMutex);
+        
+        auto it = decompressedCache.find(makeDecompressedCacheKey(fileRecord));
+        if (it != decompressedCache.end() && offset + length <= it->second.size && matchesCacheEntry(it->second, fileRecord)) {
+            DecompressedCacheEntry& cacheEntry = it->second;
+            copyToSegments(cacheEntry.data.get() + offset, length, segments);
+            decompressedCacheLru.splice(decompressedCacheLru.begin(), decompressedCacheLru, cacheEntry.lruIterator);
+            
+            stats.increment(CounterDecompressedCacheHits);
+            stats.increment(CounterBytesRead, length);
+            return length;
+        }
+    }
+    
+    StatsTimerScope timerScope(stats, fileRecord.fileType == RegularFile ? TimerReadRegular :
+                                      fileRecord.fileType == StoredFile ? TimerReadStored : TimerReadCompressed);
+    
+    const std::string& path = (fileRecord.fileType == RegularFile) ? fileRecord.filePath : fileRecord.zipFilePath;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        if (fileRecord.fileType == RegularFile) return 0;
+        throw std::exception();
+    }
+    
+    uint64_t bytesRead = 0;
+    try {
+        if (fileRecord.fileType == RegularFile) {
+            bytesRead = preadSegments(fd, offset, segments, length);
+        }
+        else if (!resolveDataOffset(fileRecord, fd)) {
+            throw std::exception();
+        }
+        else if (fileRecord.fileType == StoredFile) {
+            bytesRead = preadSegments(fd, fileRecord.zipDataOffset + offset, segments, length);
+        }
+        else if (fileRecord.compressionMethod == Z_DEFLATED) {
+            bytesRead = inflateSegments(fileRecord, fd, offset, segments, length);
+        }
+        else {
+            close(fd);
+            fd = -1;
+            bytesRead = unzipSegments(fileRecord, openSharedZip(fileRecord.zipFilePath), offset, segments, length);
+        }
+    }
+    catch (...) {
+        if (fd >= 0) close(fd);
+        throw;
+    }
+    
+    if (fd >= 0) close(fd);
+    
+    if (offset == 0)
+        verifyCrc(fileRecord, segments, bytesRead);
+    
+    stats.increment(CounterBytesRead, bytesRead);
+    
+    return bytesRead;
+}
+
+// raw deflate from the archive in chunks: the first offset bytes go to
+// scratch memory, the rest straight into the segments across their boundaries
+uint64_t ResourcesManagerImpl::inflateSegments(const FileRecord& fileRecord, int fd, uint64_t offset,
+                                               const std::vector<ReadSegment>& segments, uint64_t length) {
+    TraceEventScope traceScope(eventTrace, "inflate", "cpu", fileRecord.filename);
+    auto startTime = std::chrono::steady_clock::now();
+    
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) throw std::exception();
+    
+    std::unique_ptr<unsigned char[]> input;
+    std::unique_ptr<unsigned char[]> scratch(offset > 0 ? new unsigned char[kInflateChunkSize] : nullptr);
+    
+    // large entries are read ahead by a pipeline while this thread inflates
+    std::unique_ptr<ReadPipeline> pipeline;
+    if (fileRecord.compressedSize >= kPipelinedInflateThreshold)
+        pipeline.reset(new ReadPipeline(fd, fileRecord.zipDataOffset, fileRecord.compressedSize));
+    else
+        input.reset(new unsigned char[kInflateChunkSize]);
+    
+    uint64_t inputOffset = 0;
+    uint64_t skipped = 0;
+    uint64_t bytesInflated = 0;
+    size_t segment = 0;
+    uint64_t segmentOffset = 0;
+    int ret = Z_OK;
+    
+    while (bytesInflated < length && ret != Z_STREAM_END) {
+        if (stream.avail_in == 0) {
+            if (inputOffset >= fileRecord.compressedSize) break;
+            
+            const unsigned char* chunk = input.get();
+            ssize_t inputRead = 0;
+            if (pipeline) {
+                size_t chunkSize = 0;
+                try {
+                    chunk = pipeline->next(&chunkSize);
+                }
+                catch (...) {
+                    inflateEnd(&stream);
+                    throw;
+                }
+                inputRead = chunkSize;
+            }
+            else {
+                size_t chunkSize = (size_t)std::min<uint64_t>(kInflateChunkSize, fileRecord.compressedSize - inputOffset);
+                inputRead = pread(fd, input.get(), chunkSize, fileRecord.zipDataOffset + inputOffset);
+            }
+            
+            if (inputRead <= 0) {
+                inflateEnd(&stream);
+                throw std::exception();
+            }
+            
+            inputOffset += inputRead;
+            stream.next_in  = (Bytef*)chunk;
+            stream.avail_in = (uInt)inputRead;
+        }
+        
+        bool skipping = skipped < offset;
+        if (skipping) {
+            stream.next_out  = scratch.get();
+            stream.avail_out = (uInt)std::min<uint64_t>(kInflateChunkSize, offset - skipped);
+        }
+        else {
+            while (segmentOffset == segments[segment].size) {
+                segment++;
+                segmentOffset = 0;
+            }
+            
+            uint64_t available = std::min(segments[segment].size - segmentOffset, length - bytesInflated);
+            stream.next_out  = (Bytef*)segments[segment].buffer + segmentOffset;
+            stream.avail_out = (uInt)std::min<uint64_t>(available, UINT_MAX);
+        }
+        
+        uInt availableOut = stream.avail_out;
+        ret = inflate(&stream, Z_NO_FLUSH);
+        uInt produced = availableOut - stream.avail_out;
+        
+        if ((ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
+            (ret == Z_BUF_ERROR && stream.avail_in != 0)) {
+            inflateEnd(&stream);
+            throw std::exception();
+        }
+        
+        if (skipping) {
+            skipped += produced;
+        }
+        else {
+            bytesInflated += produced;
+            segmentOffset += produced;
+        }
+    }
+    
+    inflateEnd(&stream);
+    
+    fileRecord.accessCounters.decompressionNanoseconds.fetch_add(nanosecondsSince(startTime), std::memory_order_relaxed);
+    stats.increment(CounterBytesInflated, skipped + bytesInflated);
+    
+    return bytesInflated;
+}
+
+// other codecs decode through unzip, which keeps its stream across segments
+uint64_t ResourcesManagerImpl::unzipSegments(const FileRecord& fileRecord, unzFile zipFile, uint64_t offset,
+                                             const std::vector<ReadSegment>& segments, uint64_t length) {
+    TraceEventScope traceScope(eventTrace, "inflate", "cpu", fileRecord.filename);
+    auto startTime = std::chrono::steady_clock::now();
+    
+    unz_file_pos file_pos = fileRecord.zipFilePos;
+    if (unzGoToFilePos(zipFile, &file_pos) != UNZ_OK) throw std::exception();
+    if (unzOpenCurrentFile(zipFile) != UNZ_OK) throw std::exception();
+    
+    std::unique_ptr<char[]> scratch(offset > 0 ? new char[kInflateChunkSize] : nullptr);
+    for (uint64_t skipped = 0; skipped < offset; ) {
+        int ret = unzReadCurrentFile(zipFile, scratch.get(), (unsigned)std::min<uint64_t>(kInflateChunkSize, offset - skipped));
+        if (ret < 0) throw std::exception();
+        if (ret == 0) return 0;
+        skipped += ret;
+    }
+    
+    uint64_t bytesInflated = 0;
+    for (auto& segment : segments) {
+        uint64_t size = std::min(segment.size, length - bytesInflated);
+        
+        for (uint64_t done = 0; done < size; ) {
+            int ret = unzReadCurrentFile(zipFile, (char*)segment.buffer + done, (unsigned)std::min<uint64_t>(size - done, INT_MAX));
+            if (ret < 0) throw std::exception();
+            if (ret == 0) {
+                size = done;
+                length = bytesInflated + done;
+                break;
+            }
+            done += ret;
+        }
+        
+        bytesInflated += size;
+        if (bytesInflated == length) break;
+    }
+    
+    fileRecord.accessCounters.decompressionNanoseconds.fetch_add(nanosecondsSince(startTime), std::memory_order_relaxed);
+    stats.increment(CounterBytesInflated, offset + bytesInflated);
+    
+    return bytesInflated;
+}
+
+//
+// ranged reads
+//
+
+// positional read repeated after short reads, less than length only at end of file
+static ssize_t preadFully(int fd, void* buffer, size_t length, uint64_t offset) {
+    size_t bytesRead = 0;
+    while (bytesRead < length) {
+        ssize_t ret = pread(fd, (char*)buffer + bytesRead, length - bytesRead, offset + bytesRead);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0) return -1;
+        if (ret == 0) break;
+        bytesRead += ret;
+    }
+    return bytesRead;
+}
+
+size_t ResourcesManager::readData(const std::string& filename, uint64_t offset, void* buffer, size_t length) {
+    return pImpl->readRange(filename, nullptr, offset, buffer, length);
+}
+
+size_t ResourcesManager::readData(const std::string& filename, const ResolutionContext& context, uint64_t offset, void* buffer, size_t length) {
+    return pImpl->readRange(filename, &context, offset, buffer, length);
+}
+
+bool ResourcesManager::exists(const std::string& filename, const ResolutionContext& context) {
+    return (pImpl->lookupFileRecord(filename, &context) != nullptr);
+}
+
+size_t ResourcesManager::getSize(const std::string& filename, const ResolutionContext& context) {
+    FileRecord* fileRecord = pImpl->lookupFileRecord(filename, &context);
+    if (!fileRecord) return 0;
+    
+    return fileRecord->size;
+}
+
+uint64_t ResourcesManager::categoryMask(const std::string& category) {
+    auto it = pImpl->categoryMasks.find(category);
+    return (it != pImpl->categoryMasks.end()) ? it->second : 0;
+}
+
+size_t ResourcesManagerImpl::readRange(const std::string& filename, const ResolutionContext* context, uint64_t offset, void* buffer, size_t length) {
+    TraceEventScope traceScope(eventTrace, "readRange", "io", filename);
+    
+    FileRecord* fileRecord = lookupFileRecord(filename, context);
+    if (!fileRecord) return 0;
+    
+    traceAccess(filename, *fileRecord, offset, length);
+    
+    size_t bytesRead = readRange(*fileRecord, offset, buffer, length);
+    fileRecord->accessCounters.recordRead(bytesRead);
+    
+    return bytesRead;
+}
+
+int ResourcesManagerImpl::openArchiveFd(const std::string& archivePath) {
+    std::lock_guard<std::mutex> lock(rangedReadMutex);
+    
+    auto it = archiveFds.find(archivePath);
+    if (it != archiveFds.end()) return it->second;
+    
+    int fd = open(archivePath.c_str(), O_RDONLY);
+    if (fd < 0) throw std::exception();
+    
+    archiveFds[archivePath] = fd;
+    return fd;
+}
+
+void ResourcesManagerImpl::closeArchiveFds() {
+    std::lock_guard<std::mutex> lock(rangedReadMutex);
+    
+    for (auto& pathFdPair : archiveFds) {
+        close(pathFdPair.second);
+    }
+    archiveFds.clear();
+    inflateCheckpoints.clear();
+}
+
+// whole-file read of a large deflated entry, the archive is read ahead of
+// inflate instead of alternating with it as unzReadCurrentFile does
+size_t ResourcesManagerImpl::readDataPipelined(const FileRecord& fileRecord, void* buffer, int size) {
+    int fd = openArchiveFd(fileRecord.zipFilePath);
+    if (!resolveDataOffset(fileRecord, fd)) throw std::exception();
+    
+    uint64_t length = std::min<uint64_t>(size, fileRecord.size);
+    std::vector<ReadSegment> segments(1, ReadSegment { buffer, length });
+    
+    size_t bytesRead = (size_t)inflateSegments(fileRecord, fd, 0, segments, length);
+    verifyCrc(fileRecord, buffer, bytesRead);
+    
+    stats.increment(CounterBytesRead, bytesRead);
+    
+    if (bytesRead == fileRecord.size) {
+        storeInDecompressedCache(fileRecord, buffer, bytesRead);
+    }
+    
+    return bytesRead;
+}
+
+size_t ResourcesManagerImpl::readRange(const FileRecord& fileRecord, uint64_t offset, void* buffer, size_t length) {
+    if (fileRecord.fileType == Tombstone || offset >= fileRecord.size) return 0;
+    length = (size_t)std::min<uint64_t>(length, fileRecord.size - offset);
+    if (length == 0) return 0;
+    
+    if (fileRecord.fileType == RegularFile) {
+        StatsTimerScope timerScope(stats, TimerReadRegular);
+        
+        int fd = open(fileRecord.filePath.c_str(), O_RDONLY);
+        if (fd < 0) return 0;
+        
+        ssize_t bytesRead = preadFully(fd, buffer, length, offset);
+        close(fd);
+        if (bytesRead < 0) throw std::exception();
+        
+        stats.increment(CounterBytesRead, bytesRead);
+        return bytesRead;
+    }
+    
+    if (fileRecord.fileType == CompressedFile) {
+        std::lock_guard<std::mutex> lock(rangedReadMutex);
+        
+        auto it = decompressedCache.find(makeDecompressedCacheKey(fileRecord));
+        if (it != decompressedCache.end() && offset + length <= it->second.size && matchesCacheEntry(it->second, fileRecord)) {
+            DecompressedCacheEntry& cacheEntry = it->second;
+            memcpy(buffer, cacheEntry.data.get() + offset, length);
+            decompressedCacheLru.splice(decompressedCacheLru.begin(), decompressedCacheLru, cacheEntry.lruIterator);
+            
+            stats.increment(CounterDecompressedCacheHits);
+            stats.increment(CounterBytesRead, length);
+            return length;
+        }
+    }
+    
+    StatsTimerScope timerScope(stats, fileRecord.fileType == StoredFile ? TimerReadStored : TimerReadCompressed);
+    
+    int fd = openArchiveFd(fileRecord.zipFilePath);
+    if (!resolveDataOffset(fileRecord, fd)) throw std::exception();
+    
+    size_t bytesRead = 0;
+    
+    if (fileRecord.fileType == StoredFile) {
+        ssize_t ret = preadFully(fd, buffer, length, fileRecord.zipDataOffset + offset);
+        if (ret < 0) throw std::exception();
+        bytesRead = ret;
+    }
+    else if (fileRecord.compressionMethod == Z_DEFLATED) {
+        bytesRead = inflateRange(fileRecord, fd, offset, buffer, length);
+    }
+    else {
+        // other codecs decode through an unzFile of this call's own
+        unzFile zipFile = unzOpen(fileRecord.zipFilePath.c_str());
+        if (!zipFile) throw std::exception();
+        attachZstdDictionary(fileRecord.zipFilePath, zipFile);
+        unzSetCrcCheck(zipFile, 0);
+        
+        std::vector<ReadSegment> segments(1, ReadSegment { buffer, length });
+        try {
+            bytesRead = (size_t)unzipSegments(fileRecord, zipFile, offset, segments, length);
+        }
+        catch (...) {
+            unzClose(zipFile);
+            throw;
+        }
+        unzClose(zipFile);
+    }
+    
+    if (offset == 0)
+        verifyCrc(fileRecord, buffer, bytesRead);
+    
+    stats.increment(CounterBytesRead, bytesRead);
+    
+    return bytesRead;
+}
+
+// Raw deflate through a 32 KiB circular window, the way zlib's zran example
+// builds its access points: at block boundaries at least kInflateCheckpointSpacing
+// apart the window and bit position are saved, and later reads resume from
+// the nearest checkpoint below their offset with inflatePrime and
+// inflateSetDictionary instead of inflating the entry from its start.
+uint64_t ResourcesManagerImpl::inflateRange(const FileRecord& fileRecord, int fd, uint64_t offset, void* buffer, size_t length) {
+    TraceEventScope traceScope(eventTrace, "inflate", "cpu", fileRecord.filename);
+    auto startTime = std::chrono::steady_clock::now();
+    
+    InflateCheckpointKey checkpointKey(fileRecord.zipFilePath, fileRecord.zipFilePos.pos_in_zip_directory);
+    std::shared_ptr<const InflateCheckpoint> checkpoint;
+    uint64_t lastCheckpointOffset = 0;
+    {
+        std::lock_guard<std::mutex> lock(rangedReadMutex);
+        
+        auto it = inflateCheckpoints.find(checkpointKey);
+        if (it != inflateCheckpoints.end()) {
+            auto& checkpoints = it->second;
+            auto below = std::upper_bound(checkpoints.begin(), checkpoints.end(), offset,
+                                          [](uint64_t value, const std::shared_ptr<const InflateCheckpoint>& point) {
+                                              return value < point->outputOffset;
+                                          });
+            if (below != checkpoints.begin())
+                checkpoint = *(below - 1);
+            if (!checkpoints.empty())
+                lastCheckpointOffset = checkpoints.back()->outputOffset;
+        }
+    }
+    
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) throw std::exception();
+    
+    std::unique_ptr<unsigned char[]> window(new unsigned char[kInflateWindowSize]);
+    std::unique_ptr<unsigned char[]> input(new unsigned char[kInflateChunkSize]);
+    
+    uint64_t outputOffset = 0;
+    uint64_t inputOffset = 0;
+    
+    if (checkpoint) {
+        outputOffset = checkpoint->outputOffset;
+        inputOffset  = checkpoint->inputOffset;
+        
+        if (checkpoint->bits > 0) {
+            unsigned char byte = 0;
+            if (pread(fd, &byte, 1, fileRecord.zipDataOffset + inputOffset - 1) != 1) {
+                inflateEnd(&stream);
+                throw std::exception();
+            }
+            inflatePrime(&stream, checkpoint->bits, byte >> (8 - checkpoint->bits));
+        }
+        
+        inflateSetDictionary(&stream, checkpoint->window.get(), kInflateWindowSize);
+        // the window buffer continues the checkpoint's, oldest bytes are overwritten first
+        memcpy(window.get(), checkpoint->window.get(), kInflateWindowSize);
+    }
+    
+    bool recordCheckpoints = fileRecord.size > kInflateCheckpointSpacing;
+    std::vector<std::shared_ptr<const InflateCheckpoint>> newCheckpoints;
+    
+    uint64_t end = offset + length;
+    uint64_t inputStart = inputOffset;
+    uint64_t bytesCopied = 0;
+    int ret = Z_OK;
+    
+    while (outputOffset < end && ret != Z_STREAM_END) {
+        if (stream.avail_in == 0) {
+            if (inputOffset >= fileRecord.compressedSize) break;
+            
+            size_t chunk = (size_t)std::min<uint64_t>(kInflateChunkSize, fileRecord.compressedSize - inputOffset);
+            ssize_t inputRead = preadFully(fd, input.get(), chunk, fileRecord.zipDataOffset + inputOffset);
+            if (inputRead <= 0) {
+                inflateEnd(&stream);
+                throw std::exception();
+            }
+            
+            inputOffset += inputRead;
+            stream.next_in  = input.get();
+            stream.avail_in = (uInt)inputRead;
+        }
+        
+        if (stream.avail_out == 0) {
+            stream.next_out  = window.get();
+            stream.avail_out = kInflateWindowSize;
+        }
+        
+        unsigned char* produced = stream.next_out;
+        ret = inflate(&stream, Z_BLOCK);
+        size_t producedSize = stream.next_out - produced;
+        
+        if ((ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
+            (ret == Z_BUF_ERROR && stream.avail_in != 0 && stream.avail_out != 0)) {
+            inflateEnd(&stream);
+            throw std::exception();
+        }
+        
+        // the part of the output inside the requested range
+        uint64_t copyStart = std::max(outputOffset, offset);
+        uint64_t copyEnd   = std::min(outputOffset + producedSize, end);
+        if (copyStart < copyEnd) {
+            memcpy((char*)buffer + (copyStart - offset), produced + (copyStart - outputOffset), (size_t)(copyEnd - copyStart));
+            bytesCopied += copyEnd - copyStart;
+        }
+        outputOffset += producedSize;
+        
+        bool blockBoundary = (stream.data_type & 128) && !(stream.data_type & 64);
+        if (recordCheckpoints && blockBoundary && ret != Z_STREAM_END &&
+            outputOffset >= lastCheckpointOffset + kInflateCheckpointSpacing) {
+            std::shared_ptr<InflateCheckpoint> point(new InflateCheckpoint());
+            point->outputOffset = outputOffset;
+            point->inputOffset  = inputStart + stream.total_in;
+            point->bits         = stream.data_type & 7;
+            point->window.reset(new unsigned char[kInflateWindowSize]);
+            
+            size_t left = stream.avail_out;
+            if (left > 0)
+                memcpy(point->window.get(), window.get() + kInflateWindowSize - left, left);
+            if (left < kInflateWindowSize)
+                memcpy(point->window.get() + left, window.get(), kInflateWindowSize - left);
+            
+            newCheckpoints.push_back(point);
+            lastCheckpointOffset = outputOffset;
+        }
+    }
+    
+    inflateEnd(&stream);
+    
+    fileRecord.accessCounters.decompressionNanoseconds.fetch_add(nanosecondsSince(startTime), std::memory_order_relaxed);
+    stats.increment(CounterBytesInflated, outputOffset - (checkpoint ? checkpoint->outputOffset : 0));
+    
+    if (!newCheckpoints.empty()) {
+        std::lock_guard<std::mutex> lock(rangedReadMutex);
+        
+        // concurrent reads may have recorded the same stretch, keep offsets ascending
+        auto& checkpoints = inflateCheckpoints[checkpointKey];
+        for (auto& point : newCheckpoints) {
+            if (checkpoints.empty() || point->outputOffset >= checkpoints.back()->outputOffset + kInflateCheckpointSpacing)
+                checkpoints.push_back(point);
+        }
+    }
+    
+    return bytesCopied;
+}
+
+//
+// stats
+//
+
+ResourcesStats ResourcesManager::getStats() {
+    return pImpl->stats.snapshot();
+}
+
+void ResourcesManager::resetStats() {
+    pImpl->stats.reset();
+}
+
+std::vector<ResourceHeat> ResourcesManager::getResourceHeat(ResourceHeatOrder order, size_t count) {
+    std::vector<ResourceHeat> heatList;
+    heatList.reserve(pImpl->fileRecordList.size());
+    
+    for (auto& fileRecord : pImpl->fileRecordList) {
+        if (fileRecord.fileType == Tombstone) continue;
+        
+        const AccessCounters& counters = fileRecord.accessCounters;
+        
+        ResourceHeat heat;
+        heat.relativePath = fileRecord.relativePath;
+        heat.archivePath  = fileRecord.zipFilePath;
+        heat.compressed   = (fileRecord.fileType == CompressedFile);
+        heat.size         = fileRecord.size;
+        heat.readCount    = counters.readCount.load(std::memory_order_relaxed);
+        heat.bytesServed  = counters.bytesServed.load(std::memory_order_relaxed);
+        heat.decompressionNanoseconds = counters.decompressionNanoseconds.load(std::memory_order_relaxed);
+        heat.temperature  = (heat.readCount == 0) ? ResourceCold : (heat.readCount == 1) ? ResourceWarm : ResourceHot;
+        
+        heatList.push_back(heat);
+    }
+    
+    auto heatValue = [order](const ResourceHeat& heat) -> uint64_t {
+        switch (order) {
+            case HeatByReadCount:         return heat.readCount;
+            case HeatByBytesServed:       return heat.bytesServed;
+            case HeatByDecompressionTime: return heat.decompressionNanoseconds;
+        }
+        return 0;
+    };
+    
+    count = std::min(count, heatList.size());
+    std::partial_sort(heatList.begin(), heatList.begin() + count, heatList.end(), [&heatValue](const ResourceHeat& a, const ResourceHeat& b) {
+        return heatValue(a) > heatValue(b);
+    });
+    heatList.resize(count);
+    
+    return heatList;
+}
+
+//
+// event trace
+//
+
+void ResourcesManager::startEventTrace() {
+    pImpl->eventTrace.start();
+}
+
+void ResourcesManager::stopEventTrace() {
+    pImpl->eventTrace.stop();
+}
+
+std::string ResourcesManager::getEventTraceJSON() {
+    return pImpl->eventTrace.toJSON();
+}
+
+bool ResourcesManager::saveEventTrace(const std::string& tracePath) {
+    return pImpl->eventTrace.save(tracePath);
+}
+
+//
+// access trace
+//
+
+void ResourcesManager::startAccessTrace() {
+    pImpl->accessTrace.start();
+}
+
+void ResourcesManager::stopAccessTrace() {
+    pImpl->accessTrace.stop();
+}
+
+bool ResourcesManager::saveAccessTrace(const std::string& tracePath) {
+    return pImpl->accessTrace.save(tracePath);
+}
+
+bool ResourcesManager::prefetchFromAccessTrace(const std::string& tracePath) {
+    std::vector<AccessTraceEntry> entries;
+    if (!AccessTrace::load(tracePath, entries)) return false;
+    
+    // first access order, each record once
+    std::vector<FileRecord*> fileRecords;
+    std::set<FileRecord*> visitedRecords;
+    for (auto& entry : entries) {
+        FileRecord* fileRecord = pImpl->lookupFileRecord(entry.filename);
+        if (!fileRecord || !visitedRecords.insert(fileRecord).second) continue;
+        
+        fileRecords.push_back(fileRecord);
+    }
+    
+    pImpl->prefetchFileRecords(fileRecords);
+    
+    return true;
+}
+
+void ResourcesManagerImpl::prefetchFileRecords(const std::vector<FileRecord*>& fileRecords) {
+    // gap below which neighbouring archive entries are hinted as one range
+    const uint64_t kMergeGap = 64 * 1024;
+    
+    typedef std::pair<uint64_t, uint64_t> ByteRange;
+    std::map<std::string, std::vector<ByteRange>> rangesByPath;
+    
+    // copies of an already prefetched payload are served from its cache entry
+    std::vector<FileRecord*> uniqueFileRecords;
+    std::set<uint64_t> contentHashes;
+    
+    for (FileRecord* fileRecord : fileRecords) {
+        if (fileRecord->contentHash != 0 && !contentHashes.insert(fileRecord->contentHash).second) {
+            stats.increment(CounterDeduplicatedBytes, fileRecord->size);
+            continue;
+        }
+        uniqueFileRecords.push_back(fileRecord);
+        
+        if (fileRecord->fileType == RegularFile) {
+            rangesByPath[fileRecord->filePath].push_back(ByteRange(0, fileRecord->size));
+        }
+        else {
+            uint64_t begin = fileRecord->zipLocalHeaderOffset;
+            uint64_t end = begin + kLocalHeaderSlack + fileRecord->compressedSize;
+            rangesByPath[fileRecord->zipFilePath].push_back(ByteRange(begin, end));
+        }
+    }
+    
+    // page cache hints, merged per file so that sequentially laid out entries
+    // cost a single advisory call
+    for (auto& pathRangesPair : rangesByPath) {
+        int fd = open(pathRangesPair.first.c_str(), O_RDONLY);
+        if (fd == -1) continue;
+        
+        std::vector<ByteRange>& ranges = pathRangesPair.second;
+        std::sort(ranges.begin(), ranges.end());
+        
+        ByteRange current = ranges.front();
+        for (size_t i = 1; i < ranges.size(); i++) {
+            if (ranges[i].first <= current.second + kMergeGap) {
+                current.second = std::max(current.second, ranges[i].second);
+                continue;
+            }
+            
+            adviseWillNeed(fd, current.first, current.second - current.first);
+            current = ranges[i];
+        }
+        adviseWillNeed(fd, current.first, current.second - current.first);
+        
+        close(fd);
+    }
+    
+    // warm decompressed cache in access order while it has room
+    if (decompressedCacheLimit == 0) return;
+    
+    for (FileRecord* fileRecord : uniqueFileRecords) {
+        if (fileRecord->fileType != CompressedFile) continue;
+        {
+            std::lock_guard<std::mutex> lock(rangedReadMutex);
+            if (decompressedCacheSize + fileRecord->size > decompressedCacheLimit) break;
+        }
+        
+        std::unique_ptr<char[]> buffer(new char[fileRecord->size]);
+        readDataFromCompressedFile(*fileRecord, buffer.get(), (int)fileRecord->size);
+    }
+}
+
+//
+// enumeration
+//
+
+// '*' and '?' stay within a path component, '**' spans components
+static bool globMatch(const char* pattern, const char* path) {
+    for (; *pattern; pattern++) {
+        if (*pattern == '*') {
+            bool crossSlash = (pattern[1] == '*');
+            if (crossSlash) pattern++;
+            
+            // "**/" also matches no folders at all
+            if (crossSlash && pattern[1] == '/' && globMatch(pattern + 2, path)) return true;
+            
+            for (const char* rest = path; ; rest++) {
+                if (globMatch(pattern + 1, rest)) return true;
+                if (!*rest || (!crossSlash && *rest == '/')) return false;
+            }
+        }
+        
+        if (!*path) return false;
+        
+        if (*pattern == '?') {
+            if (*path == '/') return false;
+        }
+        else if (*pattern != *path) return false;
+        
+        path++;
+    }
+    
+    return *path == 0;
+}
+
+void ResourcesManagerImpl::collectResources(const std::string& prefix,
+                                            const std::function<bool (const std::string& path, size_t pathStart)>& accept,
+                                            const std::function<bool (const std::string& path, size_t pathStart)>& descend,
+                                            std::vector<ResourceHandle>& resources) {
+    // a lookup on another thread may publish a background build while the
+    // walk runs, the walk keeps the index it started with
+    std::shared_ptr<const IndexSnapshot> snapshot;
+    {
+        std::lock_guard<std::mutex> lock(rangedReadMutex);
+        
+        updateIndex();
+        
+        // any of them could hold a match
+        mountAllLazyArchives();
+        
+        snapshot = index;
+    }
+    
+    // full paths first, then paths under every search root
+    std::vector<std::string> searchRoots(1, std::string());
+    if (snapshot->searchByRelativePaths)
+        searchRoots.insert(searchRoots.end(), snapshot->lowercaseSearchRootsList.begin(), snapshot->lowercaseSearchRootsList.end());
+    
+    const RadixTree<FileRecord*>& pathTree = snapshot->pathTree;
+    
+    std::set<ResourceHandle> collected;
+    
+    for (auto& searchRoot : searchRoots) {
+        std::string path;
+        auto node = pathTree.findPrefix(pathTree.rootNode(), searchRoot + prefix, &path);
+        if (!node) continue;
+        
+        size_t pathStart = searchRoot.size();
+        
+        pathTree.visit(node, path, [&](const std::string& path, FileRecord* fileRecord) {
+            // keys only switched off variants resolved to are kept empty
+            if (!fileRecord || fileRecord->fileType == Tombstone || !accept(path, pathStart)) return;
+            
+            if (collected.insert(fileRecord).second)
+                resources.push_back(fileRecord);
+        }, [&](const std::string& path, size_t) {
+            return descend(path, pathStart);
+        });
+    }
+}
+
+std::vector<ResourceHandle> ResourcesManager::findByPrefix(const std::string& prefix) {
+    std::vector<ResourceHandle> resources;
+    
+    auto any = [](const std::string&, size_t) { return true; };
+    pImpl->collectResources(makePathKey(prefix), any, any, resources);
+    
+    return resources;
+}
+
+std::vector<ResourceHandle> ResourcesManager::findInDirectory(const std::string& directory, bool recursive /* = false */) {
+    std::string key = makePathKey(directory);
+    if (!key.empty() && key[key.size() - 1] != '/') key += '/';
+    
+    std::vector<ResourceHandle> resources;
+    
+    // without recursion subtrees are dropped as soon as their path goes into a subfolder
+    auto direct = [&key, recursive](const std::string& path, size_t pathStart) {
+        return recursive || path.find('/', pathStart + key.size()) == std::string::npos;
+    };
+    pImpl->collectResources(key, direct, direct, resources);
+    
+    return resources;
+}
+
+std::vector<ResourceHandle> ResourcesManager::findByGlob(const std::string& pattern) {
+    std::string key = makePathKey(pattern);
+    // only the subtree of the literal head of the pattern is matched
+    std::string prefix = key.substr(0, key.find_first_of("*?"));
+    
+    std::vector<ResourceHandle> resources;
+    
+    auto matches = [&key](const std::string& path, size_t pathStart) {
+        return globMatch(key.c_str(), path.c_str() + pathStart);
+    };
+    auto any = [](const std::string&, size_t) { return true; };
+    pImpl->collectResources(prefix, matches, any, resources);
+    
+    return resources;
+}
+
+void* ResourcesManager::readData(ResourceHandle resource, ResourceAllocator& allocator, size_t* pBytesRead) {
+    if (pBytesRead)
+        *pBytesRead = 0;
+    if (!resource) return nullptr;
+    
+    TraceEventScope traceScope(pImpl->eventTrace, "readData", "io", resource->relativePath);
+    
+    pImpl->traceAccess(resource->relativePath, *resource, 0, resource->size);
+    
+    return pImpl->readData(*resource, allocator, pBytesRead);
+}
+
+std::string ResourcesManager::getRelativePath(ResourceHandle resource) {
+    return resource ? resource->relativePath : std::string();
+}
+
+size_t ResourcesManager::getSize(ResourceHandle resource) {
+    return resource ? resource->size : 0;
+}
+
+std::unique_ptr<char[]> ResourcesManager::readData(ResourceHandle resource, size_t* pBytesRead) {
+    if (pBytesRead)
+        *pBytesRead = 0;
+    if (!resource) return nullptr;
+    
+    TraceEventScope traceScope(pImpl->eventTrace, "readData", "io", resource->relativePath);
+    
+    pImpl->traceAccess(resource->relativePath, *resource, 0, resource->size);
+    
+    std::unique_ptr<char[]> buffer(new char[resource->size]);
+    size_t bytesRead = pImpl->readData(*resource, buffer.get(), (int)resource->size);
+    if (bytesRead != resource->size) throw std::exception();
+    
+    resource->accessCounters.recordRead(bytesRead);
+    
+    if (pBytesRead)
+        *pBytesRead = bytesRead;
+    
+    return buffer;
+}
 
 //
 // Stream
@@ -758,27 +3417,29 @@ class StreamImpl {
 private:
     friend class Stream;
     
+    ResourcesManager* manager = nullptr;
     int handle = -1;
 };
 
-Stream::Stream(int handle) : pImpl(new StreamImpl()) {
+Stream::Stream(ResourcesManager* manager, int handle) : pImpl(new StreamImpl()) {
+    pImpl->manager = manager;
     pImpl->handle = handle;
 }
 
 Stream::~Stream() {
-    ResourcesManager::sharedManager()->closeFile(pImpl->handle);
+    pImpl->manager->closeFile(pImpl->handle);
 }
 
 size_t Stream::readData(void* buffer, int size) {
-    return ResourcesManager::sharedManager()->readData(pImpl->handle, buffer, size);
+    return pImpl->manager->readData(pImpl->handle, buffer, size);
 }
 
 int Stream::seek (long int offset, int whence) {
-    return ResourcesManager::sharedManager()->seek(pImpl->handle, offset, whence);
+    return pImpl->manager->seek(pImpl->handle, offset, whence);
 }
 
 long int Stream::tell() {
-    return ResourcesManager::sharedManager()->tell(pImpl->handle);
+    return pImpl->manager->tell(pImpl->handle);
 }
 
 std::unique_ptr<char[]> Stream::readData(size_t* bytesRead) {
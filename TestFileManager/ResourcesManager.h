@@ -9,9 +9,47 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <future>
+
+#include "ResourcesStats.h"
+#include "IOEngine.h"
 
 class ResourcesManagerImpl;
 class Stream;
+class ResourceAllocator;
+struct FileRecord;
+
+// indexed file returned by enumeration, valid until reset()
+typedef const FileRecord* ResourceHandle;
+
+struct BatchRead {
+    std::string filename;
+    void* buffer;
+    size_t size;            // buffer capacity
+    
+    size_t bytesRead;       // set by readBatch, 0 for missing resources
+};
+
+enum CrcPolicy {
+    CrcVerifyAlways,    // every whole read of an archive entry (default)
+    CrcVerifyOnce,      // the first whole read, the result is kept with the record
+    CrcVerifyNever      // trusted archives, e.g. signed ones
+};
+
+// language and categories a lookup resolves variants for instead of the
+// current ones, e.g. per request of a server rendering for many users;
+// categories is a mask of categoryMask() bits
+struct ResolutionContext {
+    std::string languageId;
+    uint64_t categories;
+};
+
+// one destination region of a vectored read, like struct iovec
+struct ReadSegment {
+    void* buffer;
+    uint64_t size;
+};
 
 class ResourcesManager
 {
@@ -20,12 +58,29 @@ public:
     
     static ResourcesManager* sharedManager();
     
+    // independent manager with its own index, caches and streams;
+    // streams must be destroyed before the manager that created them
+    ResourcesManager();
+    ~ResourcesManager();
+    
     void reset();
     
+    // every key an index build resolves goes to the event trace as an
+    // indexKey event while it records
     void enableTrace(bool enableTrace);
     
-    void addRootFolder(const std::string& rootFolder);
-    void addArchive(const std::string& archivePath, const std::string& rootFolder = "");
+    // layers with higher priority override files of lower ones, equal priority - the last added wins;
+    // a ".tombstones" file at the layer root lists relative paths the layer deletes.
+    // layers added after the index is built are merged into it without a rebuild
+    void addRootFolder(const std::string& rootFolder, int priority = 0);
+    void addArchive(const std::string& archivePath, const std::string& rootFolder = "", int priority = 0);
+    void addTombstone(const std::string& relativePath, int priority);
+    
+    // same as addArchive, but the central directory is read on the first lookup
+    // the archive could answer. with summaryPath the basenames of its entries
+    // are kept in a small file next to it, so lookups of names the archive
+    // doesn't have skip it on later runs too
+    void addLazyArchive(const std::string& archivePath, const std::string& rootFolder = "", int priority = 0, const std::string& summaryPath = "");
     
     void addLanguageFolder(const std::string& languageId, const std::string& languageFolder);
     void addCategoryFolder(const std::string& category, const std::string& categoryFolder);
@@ -35,15 +90,109 @@ public:
     void setSearchByRelativePaths(bool searchByRelativePaths);
     void addSearchRoot(const std::string& searchRoot);
     
+    // configuration changes between begin and commit are applied together on
+    // commit, lookups in between still see the index from before begin;
+    // pairs nest. language and category switches re-resolve only the keys
+    // with records in the folders switched, other changes rebuild the index
+    void beginConfiguration();
+    void commitConfiguration();
+    
+    // bit of a category for ResolutionContext, 0 for categories never given
+    // a folder or enabled; up to 64 categories and 64 languages with folders,
+    // more throw
+    uint64_t categoryMask(const std::string& category);
+    
     void rebuildIndex();
+    // builds the index on a background thread from the configuration as it
+    // is now; lookups keep answering from the previous index until the build
+    // is ready, then the next one swaps it in. before the first index is
+    // built lookups wait for it
+    std::shared_future<void> rebuildIndexAsync();
+    // configuration changes are then picked up by a background rebuild
+    // started on the next lookup instead of one inside it
+    void setBackgroundIndexing(bool backgroundIndexing);
+    
+    // archive entries are identified by crc and size, files in folders added
+    // after this call are hashed at scan time; identical payloads share
+    // cache entries and prefetch. a cached entry serves another one only with
+    // the same compressed size and method, a crc collision that matches
+    // those as well is an accepted risk
+    void setContentHashing(bool hashRegularFiles);
+    
+    // whole-file reads of compressed entries are kept up to cacheSize bytes
+    void setDecompressedCacheSize(size_t cacheSize);
+    
+    // archive entries read whole are checked against the central directory
+    // crc as the policy asks, a mismatch throws; partial reads and streams
+    // are not checked
+    void setCrcPolicy(CrcPolicy policy);
+    
+    // access trace: record on one run, replay as prefetch on the next one
+    void startAccessTrace();
+    void stopAccessTrace();
+    bool saveAccessTrace(const std::string& tracePath);
+    bool prefetchFromAccessTrace(const std::string& tracePath);
+    
+    ResourcesStats getStats();
+    void resetStats();
+    
+    // top count records by the given order, counters are kept per record until reset()
+    std::vector<ResourceHeat> getResourceHeat(ResourceHeatOrder order, size_t count);
+    
+    // Chrome trace JSON of loading operations, for chrome://tracing or Perfetto
+    void startEventTrace();
+    void stopEventTrace();
+    std::string getEventTraceJSON();
+    bool saveEventTrace(const std::string& tracePath);
     
     bool exists(const std::string& filename);
     size_t getSize(const std::string& filename);
     size_t readData(const std::string& filename, void* buffer, int size);
     std::unique_ptr<char[]> readData(const std::string& filename, size_t* bytesRead);
+    // whole resource in memory from allocator, e.g. a ResourceArena per level;
+    // nullptr for missing resources
+    void* readData(const std::string& filename, ResourceAllocator& allocator, size_t* bytesRead);
+    
+    // fills segments in order with the resource from offset on, e.g. headers
+    // and payload into separate staging regions; files in folders and stored
+    // entries are read with preadv, compressed entries inflate across segment
+    // boundaries; returns bytes read, short only at the end of the resource
+    uint64_t readData(const std::string& filename, uint64_t offset, const std::vector<ReadSegment>& segments);
+    // stateless read of up to length bytes from offset without opening a
+    // stream; safe from many threads at once, also next to the other reads
+    // and lookups of one thread, while the configuration does not change;
+    // files in folders and stored entries take a single pread,
+    // deflated entries resume from inflate checkpoints earlier ranged reads
+    // recorded every megabyte
+    size_t readData(const std::string& filename, uint64_t offset, void* buffer, size_t length);
+    
+    // lookups resolved for the context from the one index, which keeps every
+    // variant of a key next to it; thread safety as for the ranged readData
+    bool exists(const std::string& filename, const ResolutionContext& context);
+    size_t getSize(const std::string& filename, const ResolutionContext& context);
+    size_t readData(const std::string& filename, const ResolutionContext& context, uint64_t offset, void* buffer, size_t length);
     
     std::unique_ptr<Stream> getStream(const std::string& filename);
     
+    // reads many resources from their start with the engine set by setIOEngine,
+    // positional reads of all of them are submitted together and compressed
+    // entries inflated afterwards; returns the number of resources found
+    size_t readBatch(std::vector<BatchRead>& reads);
+    // IOEngineStdio (default) reads one resource after another like readData
+    void setIOEngine(IOEngineType type, unsigned queueDepth = 64);
+    
+    // enumeration over relative paths as indexed (after language and category
+    // folders are stripped), sorted; matching is case insensitive
+    std::vector<ResourceHandle> findByPrefix(const std::string& prefix);
+    std::vector<ResourceHandle> findInDirectory(const std::string& directory, bool recursive = false);
+    // '*' and '?' don't match '/', '**' does
+    std::vector<ResourceHandle> findByGlob(const std::string& pattern);
+    
+    std::string getRelativePath(ResourceHandle resource);
+    size_t getSize(ResourceHandle resource);
+    std::unique_ptr<char[]> readData(ResourceHandle resource, size_t* bytesRead);
+    void* readData(ResourceHandle resource, ResourceAllocator& allocator, size_t* bytesRead);
+    
 private:
     std::unique_ptr<ResourcesManagerImpl> pImpl;
     
@@ -53,7 +202,6 @@ private:
     int seek (int handle, long int offset, int whence);
     long int tell(int handle);
     
-    ResourcesManager();
     ResourcesManager(const ResourcesManager &);
     ResourcesManager &operator=(const ResourcesManager &);
 };
@@ -78,6 +226,6 @@ private:
     Stream(const Stream&);
     Stream &operator=(const Stream&);
 
-    Stream(int handle);
+    Stream(ResourcesManager* manager, int handle);
     std::unique_ptr<StreamImpl> pImpl;
 };
\ No newline at end of file
@@ -0,0 +1,113 @@
+//
+//  ResourcesStats.h
+//  TestFileManager
+//
+//  Created by Stanislav on 24.01.14.
+//  Copyright (c) 2014 Redsteep. All rights reserved.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+enum ResourcesCounter {
+    CounterLookups,
+    CounterLookupMisses,
+    CounterBytesRead,           // bytes returned to callers
+    CounterBytesInflated,       // bytes produced by inflate
+    CounterDecompressedCacheHits,
+    CounterDeduplicatedBytes,   // bytes served or prefetched once for identical payloads
+    CounterIndexRebuilds,
+    CounterIndexUpdates,        // layers merged into a built index without a rebuild
+    CounterIndexBackgroundBuilds,
+    CounterStaleIndexLookups,   // answered by the previous index while a new one was built
+    CounterIndexDeltaUpdates,   // language or category switches applied without a rebuild
+    CounterIndexDeltaKeys,      // keys they resolved again
+    CounterLazyMounts,          // lazy archives whose central directory was read
+    CounterReadAheadBytes,      // bytes hinted ahead of sequential streams
+    CounterCrcVerifiedBytes,    // whole archive entries checked against their crc
+    CounterCrcSkippedBytes,     // and not checked because of the crc policy
+    CounterStreamsOpened,
+    CounterStreamsClosed,
+    CounterCount
+};
+
+enum ResourcesTimer {
+    TimerFindFileRecord,
+    TimerReadRegular,
+    TimerReadStored,
+    TimerReadCompressed,
+    TimerStreamOpen,
+    TimerStreamClose,
+    TimerRebuildIndex,
+    TimerUpdateVariants,
+    TimerVerifyCrc,
+    TimerCount
+};
+
+//
+// Log-linear latency histogram: exact below 8ns, above that every power of two
+// is split into 8 buckets, so any reported value is within 12.5% of the real one.
+//
+
+struct LatencyHistogram {
+    static const size_t kSubBucketBits = 3;
+    static const size_t kSubBucketCount = 1 << kSubBucketBits;
+    static const size_t kMaxExponent = 47;
+    static const size_t kBucketCount = kSubBucketCount + (kMaxExponent - kSubBucketBits + 1) * kSubBucketCount;
+    
+    uint64_t count;
+    uint64_t totalNanoseconds;
+    uint64_t minNanoseconds;
+    uint64_t maxNanoseconds;
+    std::vector<uint64_t> buckets;
+    
+    LatencyHistogram();
+    
+    uint64_t percentile(double percent) const;
+    
+    static size_t bucketIndex(uint64_t nanoseconds);
+    static uint64_t bucketUpperBound(size_t bucket);
+};
+
+struct ResourcesStats {
+    uint64_t counters[CounterCount];
+    LatencyHistogram timers[TimerCount];
+    
+    ResourcesStats();
+    
+    std::string toJSON() const;
+    
+    static const char* counterName(ResourcesCounter counter);
+    static const char* timerName(ResourcesTimer timer);
+};
+
+//
+// Per-resource access heat, see ResourcesManager::getResourceHeat()
+//
+
+enum ResourceHeatOrder {
+    HeatByReadCount,
+    HeatByBytesServed,
+    HeatByDecompressionTime
+};
+
+enum ResourceTemperature {
+    ResourceCold,   // never read
+    ResourceWarm,   // read once
+    ResourceHot     // read repeatedly, candidate for staying resident
+};
+
+struct ResourceHeat {
+    std::string relativePath;
+    std::string archivePath;  // empty for regular files
+    bool compressed;
+    uint64_t size;
+    
+    uint32_t readCount;
+    uint64_t bytesServed;
+    uint64_t decompressionNanoseconds;
+    ResourceTemperature temperature;
+};
@@ -0,0 +1,240 @@
+//
+//  StatsRecorder.cpp
+//  TestFileManager
+//
+//  Created by Stanislav on 24.01.14.
+//  Copyright (c) 2014 Redsteep. All rights reserved.
+//
+
+#include "StatsRecorder.h"
+
+#include <thread>
+#include <sstream>
+#include <functional>
+#include <algorithm>
+
+//
+// LatencyHistogram
+//
+
+LatencyHistogram::LatencyHistogram() :
+    count(0),
+    totalNanoseconds(0),
+    minNanoseconds(0),
+    maxNanoseconds(0),
+    buckets(kBucketCount, 0)
+{
+}
+
+size_t LatencyHistogram::bucketIndex(uint64_t nanoseconds) {
+    if (nanoseconds < kSubBucketCount) return (size_t)nanoseconds;
+    
+    size_t exponent = 63 - __builtin_clzll(nanoseconds);
+    if (exponent > kMaxExponent) return kBucketCount - 1;
+    
+    size_t subBucket = (nanoseconds >> (exponent - kSubBucketBits)) & (kSubBucketCount - 1);
+    return kSubBucketCount + (exponent - kSubBucketBits) * kSubBucketCount + subBucket;
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(size_t bucket) {
+    if (bucket < kSubBucketCount) return bucket;
+    
+    size_t exponent = (bucket - kSubBucketCount) / kSubBucketCount + kSubBucketBits;
+    uint64_t subBucket = (bucket - kSubBucketCount) % kSubBucketCount;
+    uint64_t step = 1ULL << (exponent - kSubBucketBits);
+    
+    return (kSubBucketCount + subBucket) * step + step - 1;
+}
+
+uint64_t LatencyHistogram::percentile(double percent) const {
+    if (count == 0) return 0;
+    
+    uint64_t rank = (uint64_t)(count * percent / 100.0);
+    if (rank >= count) rank = count - 1;
+    
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < buckets.size(); bucket++) {
+        seen += buckets[bucket];
+        if (seen > rank) return std::min(bucketUpperBound(bucket), maxNanoseconds);
+    }
+    
+    return maxNanoseconds;
+}
+
+//
+// ResourcesStats
+//
+
+ResourcesStats::ResourcesStats() {
+    for (auto& counter : counters) {
+        counter = 0;
+    }
+}
+
+const char* ResourcesStats::counterName(ResourcesCounter counter) {
+    switch (counter) {
+        case CounterLookups:               return "lookups";
+        case CounterLookupMisses:          return "lookup_misses";
+        case CounterBytesRead:             return "bytes_read";
+        case CounterBytesInflated:         return "bytes_inflated";
+        case CounterDecompressedCacheHits: return "decompressed_cache_hits";
+        case CounterDeduplicatedBytes:     return "deduplicated_bytes";
+        case CounterIndexRebuilds:         return "index_rebuilds";
+        case CounterIndexUpdates:          return "index_updates";
+        case CounterIndexBackgroundBuilds: return "index_background_builds";
+        case CounterStaleIndexLookups:     return "stale_index_lookups";
+        case CounterIndexDeltaUpdates:     return "index_delta_updates";
+        case CounterIndexDeltaKeys:        return "index_delta_keys";
+        case CounterLazyMounts:            return "lazy_mounts";
+        case CounterReadAheadBytes:        return "read_ahead_bytes";
+        case CounterCrcVerifiedBytes:      return "crc_verified_bytes";
+        case CounterCrcSkippedBytes:       return "crc_skipped_bytes";
+        case CounterStreamsOpened:         return "streams_opened";
+        case CounterStreamsClosed:         return "streams_closed";
+        case CounterCount:                 break;
+    }
+    return "";
+}
+
+const char* ResourcesStats::timerName(ResourcesTimer timer) {
+    switch (timer) {
+        case TimerFindFileRecord: return "find_file_record";
+        case TimerReadRegular:    return "read_regular";
+        case TimerReadStored:     return "read_stored";
+        case TimerReadCompressed: return "read_compressed";
+        case TimerStreamOpen:     return "stream_open";
+        case TimerStreamClose:    return "stream_close";
+        case TimerRebuildIndex:   return "rebuild_index";
+        case TimerUpdateVariants: return "update_variants";
+        case TimerVerifyCrc:      return "verify_crc";
+        case TimerCount:          break;
+    }
+    return "";
+}
+
+std::string ResourcesStats::toJSON() const {
+    std::stringstream out;
+    
+    out << "{\"counters\":{";
+    for (int counter = 0; counter < CounterCount; counter++) {
+        if (counter > 0) out << ",";
+        out << "\"" << counterName((ResourcesCounter)counter) << "\":" << counters[counter];
+    }
+    
+    out << "},\"timers\":{";
+    for (int timer = 0; timer < TimerCount; timer++) {
+        const LatencyHistogram& histogram = timers[timer];
+        
+        if (timer > 0) out << ",";
+        out << "\"" << timerName((ResourcesTimer)timer) << "\":{"
+            << "\"count\":" << histogram.count << ","
+            << "\"total_ns\":" << histogram.totalNanoseconds << ","
+            << "\"min_ns\":" << histogram.minNanoseconds << ","
+            << "\"max_ns\":" << histogram.maxNanoseconds << ","
+            << "\"p50_ns\":" << histogram.percentile(50) << ","
+            << "\"p90_ns\":" << histogram.percentile(90) << ","
+            << "\"p99_ns\":" << histogram.percentile(99) << ","
+            << "\"buckets\":[";
+        
+        // only non-empty buckets, as [upper bound, count]
+        bool first = true;
+        for (size_t bucket = 0; bucket < histogram.buckets.size(); bucket++) {
+            if (histogram.buckets[bucket] == 0) continue;
+            
+            if (!first) out << ",";
+            out << "[" << LatencyHistogram::bucketUpperBound(bucket) << "," << histogram.buckets[bucket] << "]";
+            first = false;
+        }
+        out << "]}";
+    }
+    out << "}}";
+    
+    return out.str();
+}
+
+//
+// StatsRecorder
+//
+
+StatsRecorder::StatsRecorder() :
+    shards(new Shard[kShardCount])
+{
+    reset();
+}
+
+StatsRecorder::Shard& StatsRecorder::shard() {
+    static std::hash<std::thread::id> threadHash;
+    return shards[threadHash(std::this_thread::get_id()) % kShardCount];
+}
+
+void StatsRecorder::recordLatency(ResourcesTimer timer, uint64_t nanoseconds) {
+    TimerShard& timerShard = shard().timers[timer];
+    
+    timerShard.count.fetch_add(1, std::memory_order_relaxed);
+    timerShard.totalNanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+    timerShard.buckets[LatencyHistogram::bucketIndex(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+    
+    uint64_t minNanoseconds = timerShard.minNanoseconds.load(std::memory_order_relaxed);
+    while (nanoseconds < minNanoseconds &&
+           !timerShard.minNanoseconds.compare_exchange_weak(minNanoseconds, nanoseconds, std::memory_order_relaxed)) {
+    }
+    
+    uint64_t maxNanoseconds = timerShard.maxNanoseconds.load(std::memory_order_relaxed);
+    while (nanoseconds > maxNanoseconds &&
+           !timerShard.maxNanoseconds.compare_exchange_weak(maxNanoseconds, nanoseconds, std::memory_order_relaxed)) {
+    }
+}
+
+ResourcesStats StatsRecorder::snapshot() const {
+    ResourcesStats stats;
+    
+    for (size_t i = 0; i < kShardCount; i++) {
+        const Shard& shard = shards[i];
+        
+        for (int counter = 0; counter < CounterCount; counter++) {
+            stats.counters[counter] += shard.counters[counter].load(std::memory_order_relaxed);
+        }
+        
+        for (int timer = 0; timer < TimerCount; timer++) {
+            const TimerShard& timerShard = shard.timers[timer];
+            LatencyHistogram& histogram = stats.timers[timer];
+            
+            uint64_t count = timerShard.count.load(std::memory_order_relaxed);
+            if (count == 0) continue;
+            
+            uint64_t minNanoseconds = timerShard.minNanoseconds.load(std::memory_order_relaxed);
+            uint64_t maxNanoseconds = timerShard.maxNanoseconds.load(std::memory_order_relaxed);
+            histogram.minNanoseconds = (histogram.count == 0) ? minNanoseconds : std::min(histogram.minNanoseconds, minNanoseconds);
+            histogram.maxNanoseconds = std::max(histogram.maxNanoseconds, maxNanoseconds);
+            histogram.count += count;
+            histogram.totalNanoseconds += timerShard.totalNanoseconds.load(std::memory_order_relaxed);
+            
+            for (size_t bucket = 0; bucket < LatencyHistogram::kBucketCount; bucket++) {
+                histogram.buckets[bucket] += timerShard.buckets[bucket].load(std::memory_order_relaxed);
+            }
+        }
+    }
+    
+    return stats;
+}
+
+void StatsRecorder::reset() {
+    for (size_t i = 0; i < kShardCount; i++) {
+        Shard& shard = shards[i];
+        
+        for (auto& counter : shard.counters) {
+            counter.store(0, std::memory_order_relaxed);
+        }
+        
+        for (auto& timerShard : shard.timers) {
+            timerShard.count.store(0, std::memory_order_relaxed);
+            timerShard.totalNanoseconds.store(0, std::memory_order_relaxed);
+            timerShard.minNanoseconds.store(UINT64_MAX, std::memory_order_relaxed);
+            timerShard.maxNanoseconds.store(0, std::memory_order_relaxed);
+            
+            for (auto& bucket : timerShard.buckets) {
+                bucket.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+}
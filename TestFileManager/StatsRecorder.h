@@ -0,0 +1,79 @@
+//
+//  StatsRecorder.h
+//  TestFileManager
+//
+//  Created by Stanislav on 24.01.14.
+//  Copyright (c) 2014 Redsteep. All rights reserved.
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+#include "ResourcesStats.h"
+
+//
+// Counters and histograms are sharded by thread so that concurrent readers
+// don't bounce one cache line; all updates are relaxed atomics and a snapshot
+// sums the shards.
+//
+
+class StatsRecorder {
+public:
+    StatsRecorder();
+    
+    void increment(ResourcesCounter counter, uint64_t value = 1) {
+        shard().counters[counter].fetch_add(value, std::memory_order_relaxed);
+    }
+    
+    void recordLatency(ResourcesTimer timer, uint64_t nanoseconds);
+    
+    ResourcesStats snapshot() const;
+    void reset();
+    
+private:
+    static const size_t kShardCount = 8;
+    
+    struct TimerShard {
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> totalNanoseconds;
+        std::atomic<uint64_t> minNanoseconds;
+        std::atomic<uint64_t> maxNanoseconds;
+        std::atomic<uint64_t> buckets[LatencyHistogram::kBucketCount];
+    };
+    
+    struct Shard {
+        std::atomic<uint64_t> counters[CounterCount];
+        TimerShard timers[TimerCount];
+        char padding[64];
+    };
+    
+    std::unique_ptr<Shard[]> shards;
+    
+    Shard& shard();
+};
+
+class StatsTimerScope {
+public:
+    StatsTimerScope(StatsRecorder& recorder, ResourcesTimer timer) :
+        recorder(recorder),
+        timer(timer),
+        startTime(std::chrono::steady_clock::now())
+    {
+    }
+    
+    ~StatsTimerScope() {
+        auto elapsed = std::chrono::steady_clock::now() - startTime;
+        recorder.recordLatency(timer, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+    
+private:
+    StatsTimerScope(const StatsTimerScope&);
+    StatsTimerScope &operator=(const StatsTimerScope&);
+    
+    StatsRecorder& recorder;
+    ResourcesTimer timer;
+    std::chrono::steady_clock::time_point startTime;
+};
@@ -157,6 +157,12 @@ typedef struct
 #ifdef HAVE_BZIP2
     bz_stream bstream;                  /* bzLib stream structure for bziped */
 #endif
+#ifdef HAVE_ZSTD
+    ZSTD_DStream* zstd_stream;          /* zstd streaming decompression context */
+#endif
+#ifdef HAVE_LZ4
+    LZ4F_dctx* lz4_ctx;                 /* lz4 frame decompression context */
+#endif
 #ifdef HAVE_AES
     fcrypt_ctx aes_ctx;
 #endif
@@ -171,6 +177,7 @@ typedef struct
 
     uLong crc32;                        /* crc32 of all data uncompressed */
     uLong crc32_wait;                   /* crc32 we must obtain after decompress all */
+    int check_crc;                      /* crc32 is kept and compared on close */
     ZPOS64_T rest_read_compressed;      /* number of byte to be decompressed */
     ZPOS64_T rest_read_uncompressed;    /* number of byte to be obtained after decomp */
 
@@ -209,6 +216,11 @@ typedef struct
 #ifndef NOUNCRYPT
     unsigned long keys[3];              /* keys defining the pseudo-random sequence */
     const unsigned long* pcrc_32_tab;
+#endif
+    int check_crc;                      /* set by unzSetCrcCheck, 1 by default */
+#ifdef HAVE_ZSTD
+    const ZSTD_DDict* zstd_ddict;       /* digested dictionary, owned by the caller */
+    ZSTD_DStream* zstd_stream;          /* decompression context reused by all files */
 #endif
 } unz64_s;
 
@@ -573,6 +585,11 @@ local unzFile unzOpenInternal(const void *path, zlib_filefunc64_32_def* pzlib_fi
     us.central_pos = central_pos;
     us.pfile_in_zip_read = NULL;
     us.encrypted = 0;
+    us.check_crc = 1;
+#ifdef HAVE_ZSTD
+    us.zstd_ddict = NULL;
+    us.zstd_stream = NULL;
+#endif
 
     s =(unz64_s*)ALLOC(sizeof(unz64_s));
     if (s != NULL)
@@ -617,6 +634,28 @@ extern unzFile ZEXPORT unzOpen64(const void *path)
     return unzOpenInternal(path, NULL, 1);
 }
 
+#ifdef HAVE_ZSTD
+extern int ZEXPORT unzSetZstdDictionary(unzFile file, const ZSTD_DDict* ddict)
+{
+    unz64_s* s;
+    if (file == NULL)
+        return UNZ_PARAMERROR;
+    s = (unz64_s*)file;
+    s->zstd_ddict = ddict;
+    return UNZ_OK;
+}
+#endif
+
+extern int ZEXPORT unzSetCrcCheck(unzFile file, int check_crc)
+{
+    unz64_s* s;
+    if (file == NULL)
+        return UNZ_PARAMERROR;
+    s = (unz64_s*)file;
+    s->check_crc = check_crc;
+    return UNZ_OK;
+}
+
 extern int ZEXPORT unzClose(unzFile file)
 {
     unz64_s* s;
@@ -632,6 +671,11 @@ extern int ZEXPORT unzClose(unzFile file)
     if (s->filestream_with_CD != NULL)
         ZCLOSE64(s->z_filefunc, s->filestream_with_CD);
 
+#ifdef HAVE_ZSTD
+    ZSTD_freeDStream(s->zstd_stream);
+    s->zstd_stream = NULL;
+#endif
+
     s->filestream = NULL;
     s->filestream_with_CD = NULL;
     TRYFREE(s);
@@ -1084,6 +1128,12 @@ local int unz64local_CheckCurrentFileCoherencyHeader(unz64_s* s, uInt* piSizeVar
     if ((err == UNZ_OK) && (compression_method != 0) &&
 #ifdef HAVE_BZIP2
         (compression_method != Z_BZIP2ED) &&
+#endif
+#ifdef HAVE_ZSTD
+        (compression_method != Z_ZSTD) &&
+#endif
+#ifdef HAVE_LZ4
+        (compression_method != Z_LZ4) &&
 #endif
         (compression_method != Z_DEFLATED))
         err = UNZ_BADZIPFILE;
@@ -1159,6 +1209,7 @@ extern int ZEXPORT unzOpenCurrentFile3(unzFile file, int* method, int* level, in
     pfile_in_zip_read_info->size_local_extrafield = size_local_extrafield;
     pfile_in_zip_read_info->pos_local_extrafield = 0;
     pfile_in_zip_read_info->raw = raw;
+    pfile_in_zip_read_info->check_crc = s->check_crc;
 
     if (pfile_in_zip_read_info->read_buffer == NULL)
     {
@@ -1191,6 +1242,12 @@ extern int ZEXPORT unzOpenCurrentFile3(unzFile file, int* method, int* level, in
     if ((compression_method != 0) &&
 #ifdef HAVE_BZIP2
         (compression_method != Z_BZIP2ED) &&
+#endif
+#ifdef HAVE_ZSTD
+        (compression_method != Z_ZSTD) &&
+#endif
+#ifdef HAVE_LZ4
+        (compression_method != Z_LZ4) &&
 #endif
         (compression_method != Z_DEFLATED))
         err = UNZ_BADZIPFILE;
@@ -1261,6 +1318,39 @@ extern int ZEXPORT unzOpenCurrentFile3(unzFile file, int* method, int* level, in
              * size of both compressed and uncompressed data
              */
         }
+#ifdef HAVE_ZSTD
+        else if (compression_method == Z_ZSTD)
+        {
+            /* the context is created once per unzFile and only reset between files */
+            if (s->zstd_stream == NULL)
+                s->zstd_stream = ZSTD_createDStream();
+
+            pfile_in_zip_read_info->zstd_stream = s->zstd_stream;
+            if ((s->zstd_stream != NULL) &&
+                !ZSTD_isError(ZSTD_DCtx_reset(s->zstd_stream, ZSTD_reset_session_only)) &&
+                !ZSTD_isError(ZSTD_DCtx_refDDict(s->zstd_stream, s->zstd_ddict)))
+                pfile_in_zip_read_info->stream_initialised = Z_ZSTD;
+            else
+            {
+                TRYFREE(pfile_in_zip_read_info->read_buffer);
+                TRYFREE(pfile_in_zip_read_info);
+                return UNZ_INTERNALERROR;
+            }
+        }
+#endif
+#ifdef HAVE_LZ4
+        else if (compression_method == Z_LZ4)
+        {
+            if (!LZ4F_isError(LZ4F_createDecompressionContext(&pfile_in_zip_read_info->lz4_ctx, LZ4F_VERSION)))
+                pfile_in_zip_read_info->stream_initialised = Z_LZ4;
+            else
+            {
+                TRYFREE(pfile_in_zip_read_info->read_buffer);
+                TRYFREE(pfile_in_zip_read_info);
+                return UNZ_INTERNALERROR;
+            }
+        }
+#endif
     }
 
     pfile_in_zip_read_info->rest_read_compressed = s->cur_file_info.compressed_size;
@@ -1472,8 +1562,9 @@ extern int ZEXPORT unzReadCurrentFile(unzFile file, voidp buf, unsigned len)
 
             pfile_in_zip_read_info->total_out_64 = pfile_in_zip_read_info->total_out_64 + copy;
             pfile_in_zip_read_info->rest_read_uncompressed -= copy;
-            pfile_in_zip_read_info->crc32 = crc32(pfile_in_zip_read_info->crc32,
-                                pfile_in_zip_read_info->stream.next_out, copy);
+            if (pfile_in_zip_read_info->check_crc)
+                pfile_in_zip_read_info->crc32 = crc32(pfile_in_zip_read_info->crc32,
+                                    pfile_in_zip_read_info->stream.next_out, copy);
 
             pfile_in_zip_read_info->stream.avail_in -= copy;
             pfile_in_zip_read_info->stream.avail_out -= copy;
@@ -1508,7 +1599,8 @@ extern int ZEXPORT unzReadCurrentFile(unzFile file, voidp buf, unsigned len)
 
             pfile_in_zip_read_info->total_out_64 = pfile_in_zip_read_info->total_out_64 + out_bytes;
             pfile_in_zip_read_info->rest_read_uncompressed -= out_bytes;
-            pfile_in_zip_read_info->crc32 = crc32(pfile_in_zip_read_info->crc32,buf_before, (uInt)(out_bytes));
+            if (pfile_in_zip_read_info->check_crc)
+                pfile_in_zip_read_info->crc32 = crc32(pfile_in_zip_read_info->crc32,buf_before, (uInt)(out_bytes));
 
             read += (uInt)(total_out_after - total_out_before);
 
@@ -1525,6 +1617,81 @@ extern int ZEXPORT unzReadCurrentFile(unzFile file, voidp buf, unsigned len)
                 break;
 #endif
         }
+#ifdef HAVE_ZSTD
+        else if (pfile_in_zip_read_info->compression_method == Z_ZSTD)
+        {
+            ZSTD_inBuffer input;
+            ZSTD_outBuffer output;
+            size_t ret;
+
+            input.src = pfile_in_zip_read_info->stream.next_in;
+            input.size = pfile_in_zip_read_info->stream.avail_in;
+            input.pos = 0;
+            output.dst = pfile_in_zip_read_info->stream.next_out;
+            output.size = pfile_in_zip_read_info->stream.avail_out;
+            output.pos = 0;
+
+            ret = ZSTD_decompressStream(pfile_in_zip_read_info->zstd_stream, &output, &input);
+            if (ZSTD_isError(ret))
+                return UNZ_BADZIPFILE;
+
+            pfile_in_zip_read_info->total_out_64 += output.pos;
+            pfile_in_zip_read_info->rest_read_uncompressed -= output.pos;
+            if (pfile_in_zip_read_info->check_crc)
+                pfile_in_zip_read_info->crc32 =
+                    crc32(pfile_in_zip_read_info->crc32, pfile_in_zip_read_info->stream.next_out, (uInt)output.pos);
+
+            read += (uInt)output.pos;
+
+            pfile_in_zip_read_info->stream.next_in   += input.pos;
+            pfile_in_zip_read_info->stream.avail_in  -= (uInt)input.pos;
+            pfile_in_zip_read_info->stream.total_in  += (uLong)input.pos;
+            pfile_in_zip_read_info->stream.next_out  += output.pos;
+            pfile_in_zip_read_info->stream.avail_out -= (uInt)output.pos;
+            pfile_in_zip_read_info->stream.total_out += (uLong)output.pos;
+
+            /* 0 means the frame is complete */
+            if (ret == 0)
+                return (read == 0) ? UNZ_EOF : read;
+            if ((input.pos == 0) && (output.pos == 0) && (pfile_in_zip_read_info->rest_read_compressed == 0))
+                return UNZ_BADZIPFILE;
+        }
+#endif
+#ifdef HAVE_LZ4
+        else if (pfile_in_zip_read_info->compression_method == Z_LZ4)
+        {
+            size_t in_bytes = pfile_in_zip_read_info->stream.avail_in;
+            size_t out_bytes = pfile_in_zip_read_info->stream.avail_out;
+            size_t ret;
+
+            ret = LZ4F_decompress(pfile_in_zip_read_info->lz4_ctx,
+                                  pfile_in_zip_read_info->stream.next_out, &out_bytes,
+                                  pfile_in_zip_read_info->stream.next_in, &in_bytes, NULL);
+            if (LZ4F_isError(ret))
+                return UNZ_BADZIPFILE;
+
+            pfile_in_zip_read_info->total_out_64 += out_bytes;
+            pfile_in_zip_read_info->rest_read_uncompressed -= out_bytes;
+            if (pfile_in_zip_read_info->check_crc)
+                pfile_in_zip_read_info->crc32 =
+                    crc32(pfile_in_zip_read_info->crc32, pfile_in_zip_read_info->stream.next_out, (uInt)out_bytes);
+
+            read += (uInt)out_bytes;
+
+            pfile_in_zip_read_info->stream.next_in   += in_bytes;
+            pfile_in_zip_read_info->stream.avail_in  -= (uInt)in_bytes;
+            pfile_in_zip_read_info->stream.total_in  += (uLong)in_bytes;
+            pfile_in_zip_read_info->stream.next_out  += out_bytes;
+            pfile_in_zip_read_info->stream.avail_out -= (uInt)out_bytes;
+            pfile_in_zip_read_info->stream.total_out += (uLong)out_bytes;
+
+            /* 0 means the frame is complete */
+            if (ret == 0)
+                return (read == 0) ? UNZ_EOF : read;
+            if ((in_bytes == 0) && (out_bytes == 0) && (pfile_in_zip_read_info->rest_read_compressed == 0))
+                return UNZ_BADZIPFILE;
+        }
+#endif
         else
         {
             ZPOS64_T total_out_before, total_out_after;
@@ -1551,8 +1718,9 @@ extern int ZEXPORT unzReadCurrentFile(unzFile file, voidp buf, unsigned len)
 
             pfile_in_zip_read_info->total_out_64 += out_bytes;
             pfile_in_zip_read_info->rest_read_uncompressed -= out_bytes;
-            pfile_in_zip_read_info->crc32 =
-                crc32(pfile_in_zip_read_info->crc32,buf_before, (uInt)(out_bytes));
+            if (pfile_in_zip_read_info->check_crc)
+                pfile_in_zip_read_info->crc32 =
+                    crc32(pfile_in_zip_read_info->crc32,buf_before, (uInt)(out_bytes));
 
             read += (uInt)(total_out_after - total_out_before);
 
@@ -1583,6 +1751,17 @@ extern ZPOS64_T ZEXPORT unzGetCurrentFileZStreamPos64( unzFile file)
 }
 /* Addition for GDAL : END */
 
+extern ZPOS64_T ZEXPORT unzGetCurrentFileLocalHeaderOffset64(unzFile file)
+{
+    unz64_s* s;
+    if (file == NULL)
+        return 0; //UNZ_PARAMERROR;
+    s = (unz64_s*)file;
+    if (!s->current_file_ok)
+        return 0;
+    return s->cur_file_info_internal.offset_curfile + s->cur_file_info_internal.byte_before_the_zipfile;
+}
+
 extern int ZEXPORT unzGetLocalExtrafield(unzFile file, voidp buf, unsigned len)
 {
     unz64_s* s;
@@ -1654,7 +1833,7 @@ extern int ZEXPORT unzCloseCurrentFile(unzFile file)
 #endif
     {
         if ((pfile_in_zip_read_info->rest_read_uncompressed == 0) &&
-            (!pfile_in_zip_read_info->raw))
+            (!pfile_in_zip_read_info->raw) && (pfile_in_zip_read_info->check_crc))
         {
             if (pfile_in_zip_read_info->crc32 != pfile_in_zip_read_info->crc32_wait)
                 err = UNZ_CRCERROR;
@@ -1670,6 +1849,10 @@ extern int ZEXPORT unzCloseCurrentFile(unzFile file)
     else if (pfile_in_zip_read_info->stream_initialised == Z_BZIP2ED)
         BZ2_bzDecompressEnd(&pfile_in_zip_read_info->bstream);
 #endif
+#ifdef HAVE_LZ4
+    else if (pfile_in_zip_read_info->stream_initialised == Z_LZ4)
+        LZ4F_freeDecompressionContext(pfile_in_zip_read_info->lz4_ctx);
+#endif
 
     pfile_in_zip_read_info->stream_initialised = 0;
     TRYFREE(pfile_in_zip_read_info);
@@ -52,7 +52,19 @@ extern "C" {
 #include "bzlib.h"
 #endif
 
+#ifdef HAVE_ZSTD
+#include "zstd.h"
+#endif
+
+#ifdef HAVE_LZ4
+#include "lz4frame.h"
+#endif
+
 #define Z_BZIP2ED 12
+/* zstd frame, method id assigned by APPNOTE 6.3.7 */
+#define Z_ZSTD 93
+/* lz4 frame, method id is not assigned by APPNOTE, private to our packer */
+#define Z_LZ4 240
 
 #if defined(STRICTUNZIP) || defined(STRICTZIPUNZIP)
 /* like the STRICT of WIN32, we define a pointer that cannot be converted
@@ -235,6 +247,22 @@ extern int ZEXPORT unzGetCurrentFileInfo64 OF((unzFile file, unz_file_info64 *pf
 
 extern ZPOS64_T ZEXPORT unzGetCurrentFileZStreamPos64 OF((unzFile file));
 
+extern ZPOS64_T ZEXPORT unzGetCurrentFileLocalHeaderOffset64 OF((unzFile file));
+/* Get the absolute position of the local header of the current file in the zipfile,
+   usable without opening the file (for read-ahead hints) */
+
+extern int ZEXPORT unzSetCrcCheck OF((unzFile file, int check_crc));
+/* With check_crc 0 files opened afterwards are read without keeping their crc32,
+   and unzCloseCurrentFile does not return UNZ_CRCERROR; for callers that verify
+   data themselves or trust the archive */
+
+#ifdef HAVE_ZSTD
+extern int ZEXPORT unzSetZstdDictionary OF((unzFile file, const ZSTD_DDict* ddict));
+/* Set the digested dictionary zstd files of the zipfile were compressed with.
+   It is not copied, so it must outlive the unzFile; one dictionary can be shared
+   by any number of unzFiles */
+#endif
+
 extern int ZEXPORT unzGetLocalExtrafield OF((unzFile file, voidp buf, unsigned len));
 /* Read extra field from the current file (opened by unzOpenCurrentFile)
    This is the local-header version of the extra field (sometimes, there is
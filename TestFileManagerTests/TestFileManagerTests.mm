@@ -9,6 +9,12 @@
 #import "TestFileManagerTests.h"
 
 #include "ResourcesManager.h"
+#include "PathNormalizer.h"
+#include "ResourceAllocator.h"
+#include "ReadPipeline.h"
+
+#include <fcntl.h>
+#include <unistd.h>
 
 NSString *BufferToString(const char* buffer, size_t size) {
     if (!buffer) return @"";
@@ -362,4 +368,491 @@ NSString *BufferToString(const char* buffer, size_t size) {
     STAssertEqualObjects(@(buffer), @"es", @"");
 
 }
+
+- (void)testAccessTracePrefetch
+{
+    NSString *tracePath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"access_trace.txt"];
+    
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"archive1" ofType:@"zip"] UTF8String]);
+    ResourcesManager::sharedManager()->startAccessTrace();
+    
+    size_t bytesRead = 0;
+    ResourcesManager::sharedManager()->readData("test_compressed.txt", &bytesRead);
+    ResourcesManager::sharedManager()->readData("compressed_file_in_folder.txt", &bytesRead);
+    
+    ResourcesManager::sharedManager()->stopAccessTrace();
+    STAssertTrue(ResourcesManager::sharedManager()->saveAccessTrace([tracePath UTF8String]), @"");
+    
+    ResourcesManager::sharedManager()->reset();
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"archive1" ofType:@"zip"] UTF8String]);
+    ResourcesManager::sharedManager()->setDecompressedCacheSize(1024 * 1024);
+    STAssertTrue(ResourcesManager::sharedManager()->prefetchFromAccessTrace([tracePath UTF8String]), @"");
+    
+    auto buffer = ResourcesManager::sharedManager()->readData("compressed_file_in_folder.txt", &bytesRead);
+    STAssertEqualObjects(BufferToString(buffer.get(), bytesRead), @"compressed_file_in_folder", @"");
+    
+    ResourcesManager::sharedManager()->setDecompressedCacheSize(0);
+}
+
+- (void)testStats
+{
+    ResourcesManager::sharedManager()->resetStats();
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"archive1" ofType:@"zip"] UTF8String]);
+    
+    size_t bytesRead = 0;
+    ResourcesManager::sharedManager()->readData("test_compressed.txt", &bytesRead);
+    STAssertFalse(ResourcesManager::sharedManager()->exists("non-exising-filename"), @"");
+    
+    ResourcesStats stats = ResourcesManager::sharedManager()->getStats();
+    STAssertEquals(stats.counters[CounterLookups], (uint64_t)2, @"");
+    STAssertEquals(stats.counters[CounterLookupMisses], (uint64_t)1, @"");
+    STAssertEquals(stats.counters[CounterBytesInflated], (uint64_t)4, @"");
+    STAssertEquals(stats.counters[CounterIndexRebuilds], (uint64_t)1, @"");
+    STAssertEquals(stats.timers[TimerReadCompressed].count, (uint64_t)1, @"");
+    STAssertTrue(stats.toJSON().find("\"read_compressed\":{\"count\":1") != std::string::npos, @"");
+}
+
+- (void)testEventTrace
+{
+    ResourcesManager::sharedManager()->enableTrace(true);
+    ResourcesManager::sharedManager()->startEventTrace();
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"archive1" ofType:@"zip"] UTF8String]);
+    
+    size_t bytesRead = 0;
+    ResourcesManager::sharedManager()->readData("test_compressed.txt", &bytesRead);
+    ResourcesManager::sharedManager()->stopEventTrace();
+    
+    std::string json = ResourcesManager::sharedManager()->getEventTraceJSON();
+    STAssertTrue(json.find("\"name\":\"addArchive\"") != std::string::npos, @"");
+    STAssertTrue(json.find("\"name\":\"rebuildIndex\"") != std::string::npos, @"");
+    STAssertTrue(json.find("\"name\":\"inflate\"") != std::string::npos, @"");
+    STAssertTrue(json.find("\"name\":\"indexKey\"") != std::string::npos, @"");
+    STAssertTrue(json.find("\"ph\":\"X\"") != std::string::npos, @"");
+}
+
+- (void)testResourceHeat
+{
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"archive1" ofType:@"zip"] UTF8String]);
+    
+    size_t bytesRead = 0;
+    ResourcesManager::sharedManager()->readData("test_compressed.txt", &bytesRead);
+    ResourcesManager::sharedManager()->readData("test_compressed.txt", &bytesRead);
+    ResourcesManager::sharedManager()->readData("compressed_file_in_folder.txt", &bytesRead);
+    
+    auto heatList = ResourcesManager::sharedManager()->getResourceHeat(HeatByReadCount, 2);
+    STAssertEquals(heatList.size(), (size_t)2, @"");
+    STAssertEquals(heatList[0].relativePath, std::string("test_compressed.txt"), @"");
+    STAssertEquals(heatList[0].readCount, (uint32_t)2, @"");
+    STAssertEquals(heatList[0].bytesServed, (uint64_t)8, @"");
+    STAssertEquals(heatList[0].temperature, ResourceHot, @"");
+    STAssertEquals(heatList[1].temperature, ResourceWarm, @"");
+}
+
+- (void)testIndependentManagers
+{
+    ResourcesManager first;
+    ResourcesManager second;
+    first.addArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String]);
+    second.addRootFolder([[[[NSBundle mainBundle] resourcePath] stringByAppendingPathComponent:@"res"] UTF8String]);
+    
+    STAssertTrue(first.exists("test.txt"), @"");
+    STAssertFalse(first.exists("file_in_folder.txt"), @"");
+    STAssertTrue(second.exists("file_in_folder.txt"), @"");
+    STAssertFalse(second.exists("test.txt"), @"");
+    
+    auto stream = first.getStream("test.txt");
+    char buffer[3] = {0};
+    int bytesRead = stream->readData(&buffer, 2);
+    STAssertEquals(bytesRead, 2, @"");
+    STAssertEqualObjects(@(buffer), @"te", @"");
+}
+
+- (void)testPatchLayers
+{
+    std::string archivePath = [[[NSBundle mainBundle] pathForResource:@"category_res" ofType:@"zip"] UTF8String];
+    
+    ResourcesManager::sharedManager()->resetStats();
+    ResourcesManager::sharedManager()->setSearchByRelativePaths(true);
+    ResourcesManager::sharedManager()->addArchive(archivePath, "category_res");
+    STAssertEquals(ResourcesManager::sharedManager()->getSize("folder/file_in_folder.txt"), (size_t)15, @"");
+    
+    ResourcesManager::sharedManager()->addArchive(archivePath, "category_res/large-screen", 1);
+    STAssertEquals(ResourcesManager::sharedManager()->getSize("folder/file_in_folder.txt"), (size_t)20, @"");
+    
+    // lower priority layer doesn't override
+    ResourcesManager::sharedManager()->addArchive(archivePath, "category_res/small-screen", 0);
+    size_t bytesRead = 0;
+    auto buffer = ResourcesManager::sharedManager()->readData("folder/file_in_folder.txt", &bytesRead);
+    STAssertEqualObjects(BufferToString(buffer.get(), bytesRead), @"large screen version", @"");
+    
+    ResourcesManager::sharedManager()->addTombstone("folder/file_in_folder.txt", 2);
+    STAssertFalse(ResourcesManager::sharedManager()->exists("folder/file_in_folder.txt"), @"");
+    
+    ResourcesStats stats = ResourcesManager::sharedManager()->getStats();
+    STAssertEquals(stats.counters[CounterIndexRebuilds], (uint64_t)1, @"");
+    STAssertEquals(stats.counters[CounterIndexUpdates], (uint64_t)3, @"");
+}
+
+- (void)testContentDeduplication
+{
+    ResourcesManager::sharedManager()->resetStats();
+    // test.txt and test_compressed.txt have the same payload in different archives
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String]);
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"archive1" ofType:@"zip"] UTF8String]);
+    ResourcesManager::sharedManager()->setDecompressedCacheSize(1024 * 1024);
+    
+    size_t bytesRead = 0;
+    ResourcesManager::sharedManager()->readData("test.txt", &bytesRead);
+    auto buffer = ResourcesManager::sharedManager()->readData("test_compressed.txt", &bytesRead);
+    STAssertEqualObjects(BufferToString(buffer.get(), bytesRead), @"test", @"");
+    
+    ResourcesStats stats = ResourcesManager::sharedManager()->getStats();
+    STAssertEquals(stats.counters[CounterDecompressedCacheHits], (uint64_t)1, @"");
+    STAssertEquals(stats.counters[CounterDeduplicatedBytes], (uint64_t)4, @"");
+    
+    ResourcesManager::sharedManager()->setDecompressedCacheSize(0);
+}
+
+- (void)testEnumeration
+{
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"category_res" ofType:@"zip"] UTF8String], "category_res");
+    
+    auto resources = ResourcesManager::sharedManager()->findInDirectory("small-screen/folder");
+    STAssertEquals(resources.size(), (size_t)1, @"");
+    
+    size_t bytesRead = 0;
+    auto buffer = ResourcesManager::sharedManager()->readData(resources[0], &bytesRead);
+    STAssertEqualObjects(BufferToString(buffer.get(), bytesRead), @"small screen version", @"");
+    
+    STAssertEquals(ResourcesManager::sharedManager()->findInDirectory("", true).size(), (size_t)6, @"");
+    STAssertEquals(ResourcesManager::sharedManager()->findByPrefix("Large-Screen/").size(), (size_t)2, @"");
+    STAssertEquals(ResourcesManager::sharedManager()->findByGlob("*/folder/*.txt").size(), (size_t)2, @"");
+    STAssertEquals(ResourcesManager::sharedManager()->findByGlob("**/file_in_folder.txt").size(), (size_t)3, @"");
+}
+
+- (void)testSearchRootAddedAfterIndexing
+{
+    ResourcesManager::sharedManager()->resetStats();
+    ResourcesManager::sharedManager()->setSearchByRelativePaths(true);
+    ResourcesManager::sharedManager()->addRootFolder([[[[NSBundle mainBundle] resourcePath] stringByAppendingPathComponent:@"res_search"] UTF8String]);
+    STAssertFalse(ResourcesManager::sharedManager()->exists("folder1/test.txt"), @"");
+    
+    ResourcesManager::sharedManager()->addSearchRoot("folder1/search_root");
+    STAssertTrue(ResourcesManager::sharedManager()->exists("folder1/test.txt"), @"");
+    STAssertEquals(ResourcesManager::sharedManager()->findInDirectory("folder1").size(), (size_t)1, @"");
+    STAssertEquals(ResourcesManager::sharedManager()->getStats().counters[CounterIndexRebuilds], (uint64_t)1, @"");
+}
+
+- (void)testPathNormalization
+{
+    STAssertTrue(normalizePath("Res\\\\Folder//File.TXT") == "res/folder/file.txt", @"");
+    STAssertTrue(normalizePath("Localized\\RU\\Very/Long/Path/Crossing/Several/Vector/Blocks//Of/Input.json") ==
+                 "localized/ru/very/long/path/crossing/several/vector/blocks/of/input.json", @"");
+    
+    std::string longPath(kNormalizePathStackSize + 10, 'A');
+    STAssertTrue(normalizePath(longPath) == std::string(longPath.size(), 'a'), @"");
+    
+    ResourcesManager::sharedManager()->addRootFolder([[[NSBundle mainBundle] resourcePath] UTF8String]);
+    STAssertTrue(ResourcesManager::sharedManager()->exists("TEST.txt"), @"");
+}
+
+- (void)testLazyArchive
+{
+    std::string summaryPath = [[NSTemporaryDirectory() stringByAppendingPathComponent:@"test.summary"] UTF8String];
+    remove(summaryPath.c_str());
+    
+    ResourcesManager::sharedManager()->resetStats();
+    ResourcesManager::sharedManager()->addLazyArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String], "", 0, summaryPath);
+    STAssertEquals(ResourcesManager::sharedManager()->getStats().counters[CounterLazyMounts], (uint64_t)0, @"");
+    
+    STAssertTrue(ResourcesManager::sharedManager()->exists("test.txt"), @"");
+    STAssertEquals(ResourcesManager::sharedManager()->getStats().counters[CounterLazyMounts], (uint64_t)1, @"");
+    
+    // the summary written on mount keeps misses away from the archive
+    ResourcesManager::sharedManager()->reset();
+    ResourcesManager::sharedManager()->addLazyArchive([[[NSBundle mainBundle] pathForResource:@"test" ofType:@"zip"] UTF8String], "", 0, summaryPath);
+    STAssertFalse(ResourcesManager::sharedManager()->exists("missing.txt"), @"");
+    STAssertEquals(ResourcesManager::sharedManager()->getStats().counters[CounterLazyMounts], (uint64_t)1, @"");
+    
+    size_t bytesRead = 0;
+    auto buffer = ResourcesManager::sharedManager()->readData("test.txt", &bytesRead);
+    STAssertEqualObjects(BufferToString(buffer.get(), bytesRead), @"test", @"");
+    STAssertEquals(ResourcesManager::sharedManager()->getStats().counters[CounterLazyMounts], (uint64_t)2, @"");
+}
+
+- (void)testStreamReadAhead
+{
+    ResourcesManager::sharedManager()->resetStats();
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test_stored" ofType:@"zip"] UTF8String]);
+    
+    auto stream = ResourcesManager::sharedManager()->getStream("test.txt");
+    char buffer[5] = {0};
+    for (int i = 0; i < 4; i++) {
+        STAssertEquals(stream->readData(buffer + i, 1), (size_t)1, @"");
+    }
+    STAssertEquals(std::string(buffer), std::string("test"), @"");
+    stream.reset();
+    
+    STAssertTrue(ResourcesManager::sharedManager()->getStats().counters[CounterReadAheadBytes] > 0, @"");
+}
+
+- (void)testReadBatch
+{
+    ResourcesManager::sharedManager()->setIOEngine(IOEnginePread, 8);
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"archive1" ofType:@"zip"] UTF8String]);
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test_stored" ofType:@"zip"] UTF8String]);
+    
+    char buffers[3][32];
+    const char* filenames[3] = { "test_compressed.txt", "test.txt", "missing.txt" };
+    
+    std::vector<BatchRead> reads;
+    for (int i = 0; i < 3; i++) {
+        BatchRead read;
+        read.filename = filenames[i];
+        read.buffer = buffers[i];
+        read.size = sizeof(buffers[i]);
+        reads.push_back(read);
+    }
+    
+    STAssertEquals(ResourcesManager::sharedManager()->readBatch(reads), (size_t)2, @"");
+    STAssertEqualObjects(BufferToString(buffers[0], reads[0].bytesRead), @"test", @"");
+    STAssertEqualObjects(BufferToString(buffers[1], reads[1].bytesRead), @"test", @"");
+    STAssertEquals(reads[2].bytesRead, (size_t)0, @"");
+    
+    // the stored entry again without an engine
+    ResourcesManager::sharedManager()->setIOEngine(IOEngineStdio);
+    memset(buffers[1], 0, sizeof(buffers[1]));
+    
+    STAssertEquals(ResourcesManager::sharedManager()->readBatch(reads), (size_t)2, @"");
+    STAssertEqualObjects(BufferToString(buffers[1], reads[1].bytesRead), @"test", @"");
+}
+
+- (void)testReadIntoArena
+{
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"archive1" ofType:@"zip"] UTF8String]);
+    
+    ResourceArena arena(64);
+    size_t bytesRead = 0;
+    
+    char* first = (char*)ResourcesManager::sharedManager()->readData("test_compressed.txt", arena, &bytesRead);
+    STAssertEqualObjects(BufferToString(first, bytesRead), @"test", @"");
+    
+    char* second = (char*)ResourcesManager::sharedManager()->readData("compressed_file_in_folder.txt", arena, &bytesRead);
+    STAssertEqualObjects(BufferToString(second, bytesRead), @"compressed_file_in_folder", @"");
+    STAssertEquals((uintptr_t)second % ResourceAllocator::kDefaultAlignment, (uintptr_t)0, @"");
+    
+    STAssertTrue(ResourcesManager::sharedManager()->readData("missing.txt", arena, &bytesRead) == nullptr, @"");
+    
+    arena.reset();
+    STAssertEquals(arena.bytesAllocated(), (size_t)0, @"");
+    STAssertTrue(ResourcesManager::sharedManager()->readData("test_compressed.txt", arena, &bytesRead) == first, @"");
+}
+
+- (void)testReadSegments
+{
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"archive1" ofType:@"zip"] UTF8String]);
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test_stored" ofType:@"zip"] UTF8String]);
+    
+    char header[3];
+    char payload[32];
+    std::vector<ReadSegment> segments;
+    segments.push_back(ReadSegment { header, sizeof(header) });
+    segments.push_back(ReadSegment { payload, sizeof(payload) });
+    
+    uint64_t bytesRead = ResourcesManager::sharedManager()->readData("compressed_file_in_folder.txt", 2, segments);
+    STAssertEquals(bytesRead, (uint64_t)23, @"");
+    STAssertEqualObjects(BufferToString(header, sizeof(header)), @"mpr", @"");
+    STAssertEqualObjects(BufferToString(payload, bytesRead - sizeof(header)), @"essed_file_in_folder", @"");
+    
+    bytesRead = ResourcesManager::sharedManager()->readData("test.txt", 1, segments);
+    STAssertEquals(bytesRead, (uint64_t)3, @"");
+    STAssertEqualObjects(BufferToString(header, sizeof(header)), @"est", @"");
+    
+    STAssertEquals(ResourcesManager::sharedManager()->readData("missing.txt", 0, segments), (uint64_t)0, @"");
+}
+
+- (void)testRangedRead
+{
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"archive1" ofType:@"zip"] UTF8String]);
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"test_stored" ofType:@"zip"] UTF8String]);
+    
+    char buffer[32];
+    size_t bytesRead = ResourcesManager::sharedManager()->readData("compressed_file_in_folder.txt", 11, buffer, 4);
+    STAssertEqualObjects(BufferToString(buffer, bytesRead), @"file", @"");
+    
+    bytesRead = ResourcesManager::sharedManager()->readData("test.txt", 2, buffer, sizeof(buffer));
+    STAssertEqualObjects(BufferToString(buffer, bytesRead), @"st", @"");
+    
+    STAssertEquals(ResourcesManager::sharedManager()->readData("test.txt", 4, buffer, sizeof(buffer)), (size_t)0, @"");
+    STAssertEquals(ResourcesManager::sharedManager()->readData("missing.txt", 0, buffer, sizeof(buffer)), (size_t)0, @"");
+}
+
+- (void)testReadPipeline
+{
+    std::string path = [[NSTemporaryDirectory() stringByAppendingPathComponent:@"pipeline.bin"] UTF8String];
+    
+    std::string content;
+    for (int i = 0; i < 10000; i++) {
+        content += std::to_string(i) + ",";
+    }
+    
+    FILE* file = fopen(path.c_str(), "wb");
+    fwrite(content.data(), 1, content.size(), file);
+    fclose(file);
+    
+    int fd = open(path.c_str(), O_RDONLY);
+    
+    std::string result;
+    {
+        ReadPipeline pipeline(fd, 3, content.size() - 3, 1000, 3);
+        size_t size = 0;
+        while (const unsigned char* chunk = pipeline.next(&size)) {
+            result.append((const char*)chunk, size);
+        }
+    }
+    STAssertTrue(result == content.substr(3), @"");
+    
+    {
+        ReadPipeline pipeline(fd, content.size() - 10, 100, 16, 2);
+        size_t size = 0;
+        STAssertThrows(while (pipeline.next(&size)) {}, @"");
+    }
+    
+    close(fd);
+}
+
+- (void)testCrcPolicy
+{
+    ResourcesManager::sharedManager()->addArchive([[[NSBundle mainBundle] pathForResource:@"archive1" ofType:@"zip"] UTF8String]);
+    ResourcesManager::sharedManager()->setCrcPolicy(CrcVerifyOnce);
+    ResourcesManager::sharedManager()->resetStats();
+    
+    for (int i = 0; i < 3; i++) {
+        size_t bytesRead = 0;
+        auto data = ResourcesManager::sharedManager()->readData("test_compressed.txt", &bytesRead);
+        STAssertEqualObjects(BufferToString(data.get(), bytesRead), @"test", @"");
+    }
+    
+    ResourcesStats stats = ResourcesManager::sharedManager()->getStats();
+    STAssertEquals(stats.counters[CounterCrcVerifiedBytes], (uint64_t)4, @"");
+    STAssertEquals(stats.counters[CounterCrcSkippedBytes], (uint64_t)8, @"");
+    
+    ResourcesManager::sharedManager()->setCrcPolicy(CrcVerifyAlways);
+}
+
+- (void)testBackgroundIndexing
+{
+    ResourcesManager::sharedManager()->addRootFolder([[[[NSBundle mainBundle] resourcePath] stringByAppendingPathComponent:@"category_res"] UTF8String]);
+    
+    // nothing built yet, the lookup waits for the build
+    auto ready = ResourcesManager::sharedManager()->rebuildIndexAsync();
+    STAssertTrue(ResourcesManager::sharedManager()->exists("folder/file_in_folder.txt"), @"");
+    STAssertTrue(ready.wait_for(std::chrono::seconds(0)) == std::future_status::ready, @"");
+    
+    ResourcesManager::sharedManager()->setBackgroundIndexing(true);
+    ResourcesManager::sharedManager()->resetStats();
+    ResourcesManager::sharedManager()->setSearchByRelativePaths(true);
+    
+    // the previous index, by basename, answers while the new one is built
+    STAssertTrue(ResourcesManager::sharedManager()->exists("other_folder/file_in_folder.txt"), @"");
+    
+    ResourcesManager::sharedManager()->rebuildIndexAsync().wait();
+    STAssertFalse(ResourcesManager::sharedManager()->exists("other_folder/file_in_folder.txt"), @"");
+    STAssertTrue(ResourcesManager::sharedManager()->exists("folder/file_in_folder.txt"), @"");
+    
+    ResourcesStats stats = ResourcesManager::sharedManager()->getStats();
+    STAssertEquals(stats.counters[CounterIndexBackgroundBuilds], (uint64_t)1, @"");
+    STAssertEquals(stats.counters[CounterStaleIndexLookups], (uint64_t)1, @"");
+    
+    ResourcesManager::sharedManager()->setBackgroundIndexing(false);
+}
+
+- (void)testConfigurationTransaction
+{
+    ResourcesManager::sharedManager()->addCategoryFolder("small-screen", "small-screen");
+    ResourcesManager::sharedManager()->addCategoryFolder("large-screen", "large-screen");
+    ResourcesManager::sharedManager()->addRootFolder([[[[NSBundle mainBundle] resourcePath] stringByAppendingPathComponent:@"category_res"] UTF8String]);
+    
+    size_t bytesRead = 0;
+    auto buffer = ResourcesManager::sharedManager()->readData("file_in_folder.txt", &bytesRead);
+    STAssertEqualObjects(BufferToString(buffer.get(), bytesRead), @"regular version", @"");
+    
+    ResourcesManager::sharedManager()->resetStats();
+    
+    ResourcesManager::sharedManager()->beginConfiguration();
+    ResourcesManager::sharedManager()->enableCategory("small-screen");
+    ResourcesManager::sharedManager()->enableCategory("large-screen");
+    ResourcesManager::sharedManager()->disableCategory("large-screen");
+    
+    // lookups inside the transaction see the configuration before it
+    buffer = ResourcesManager::sharedManager()->readData("file_in_folder.txt", &bytesRead);
+    STAssertEqualObjects(BufferToString(buffer.get(), bytesRead), @"regular version", @"");
+    
+    ResourcesManager::sharedManager()->commitConfiguration();
+    
+    buffer = ResourcesManager::sharedManager()->readData("file_in_folder.txt", &bytesRead);
+    STAssertEqualObjects(BufferToString(buffer.get(), bytesRead), @"small screen version", @"");
+    
+    // the path key and the basename key of the one file with a small-screen version
+    ResourcesStats stats = ResourcesManager::sharedManager()->getStats();
+    STAssertEquals(stats.counters[CounterIndexRebuilds], (uint64_t)0, @"");
+    STAssertEquals(stats.counters[CounterIndexDeltaUpdates], (uint64_t)1, @"");
+    STAssertEquals(stats.counters[CounterIndexDeltaKeys], (uint64_t)2, @"");
+}
+
+- (void)testResolutionContext
+{
+    ResourcesManager::sharedManager()->addCategoryFolder("small-screen", "small-screen");
+    ResourcesManager::sharedManager()->addCategoryFolder("large-screen", "large-screen");
+    ResourcesManager::sharedManager()->addRootFolder([[[[NSBundle mainBundle] resourcePath] stringByAppendingPathComponent:@"category_res"] UTF8String]);
+    
+    ResolutionContext regular = { "", 0 };
+    ResolutionContext smallScreen = { "", ResourcesManager::sharedManager()->categoryMask("small-screen") };
+    STAssertTrue(smallScreen.categories != 0, @"");
+    STAssertEquals(ResourcesManager::sharedManager()->categoryMask("unknown"), (uint64_t)0, @"");
+    
+    char buffer[32];
+    size_t bytesRead = ResourcesManager::sharedManager()->readData("file_in_folder.txt", smallScreen, 0, buffer, sizeof(buffer));
+    STAssertEqualObjects(BufferToString(buffer, bytesRead), @"small screen version", @"");
+    
+    bytesRead = ResourcesManager::sharedManager()->readData("file_in_folder.txt", regular, 0, buffer, sizeof(buffer));
+    STAssertEqualObjects(BufferToString(buffer, bytesRead), @"regular version", @"");
+    STAssertEquals(ResourcesManager::sharedManager()->getSize("file_in_folder.txt", smallScreen), (size_t)20, @"");
+    
+    // the manager's own categories stay as they were
+    size_t size = 0;
+    auto data = ResourcesManager::sharedManager()->readData("file_in_folder.txt", &size);
+    STAssertEqualObjects(BufferToString(data.get(), size), @"regular version", @"");
+}
+
+- (void)testVariantFoldersMatchWholeComponents
+{
+    ResourcesManager::sharedManager()->setSearchByRelativePaths(true);
+    ResourcesManager::sharedManager()->addCategoryFolder("screen", "screen");
+    ResourcesManager::sharedManager()->enableCategory("screen");
+    ResourcesManager::sharedManager()->addRootFolder([[[[NSBundle mainBundle] resourcePath] stringByAppendingPathComponent:@"category_res"] UTF8String]);
+    
+    // "screen" is not a folder of small-screen/
+    STAssertTrue(ResourcesManager::sharedManager()->exists("small-screen/folder/file_in_folder.txt"), @"");
+    STAssertFalse(ResourcesManager::sharedManager()->exists("small-folder/file_in_folder.txt"), @"");
+    STAssertTrue(ResourcesManager::sharedManager()->categoryMask("screen") != 0, @"");
+}
+
+- (void)testSearchRootsInPatchLayer
+{
+    std::string archivePath = [[[NSBundle mainBundle] pathForResource:@"category_res" ofType:@"zip"] UTF8String];
+    
+    ResourcesManager::sharedManager()->setSearchByRelativePaths(true);
+    ResourcesManager::sharedManager()->addArchive(archivePath, "category_res");
+    ResourcesManager::sharedManager()->addSearchRoot("category_res/small-screen");
+    
+    size_t bytesRead = 0;
+    auto buffer = ResourcesManager::sharedManager()->readData("folder/file_in_folder.txt", &bytesRead);
+    STAssertEqualObjects(BufferToString(buffer.get(), bytesRead), @"regular version", @"");
+    
+    // equal priority patch layer has the file only under the search root
+    ResourcesManager::sharedManager()->addArchive(archivePath);
+    buffer = ResourcesManager::sharedManager()->readData("folder/file_in_folder.txt", &bytesRead);
+    STAssertEqualObjects(BufferToString(buffer.get(), bytesRead), @"small screen version", @"");
+}
 @end
@@ -0,0 +1,1109 @@
+//
+//  main.cpp
+//  ZipRepack
+//
+//  Created by Stanislav on 22.01.14.
+//  Copyright (c) 2014 Redsteep. All rights reserved.
+//
+//  Rewrites a zip archive so that entries are laid out in the order they were
+//  first read in an access trace saved by ResourcesManager::saveAccessTrace().
+//  Entries that were never read keep their original order after the traced
+//  ones. For every entry a store/deflate recommendation is printed; with
+//  --apply the recommendation is also applied while copying. --method picks
+//  what compressed entries are packed with, zstd and lz4 need the tool built
+//  with HAVE_ZSTD / HAVE_LZ4, the same options the reader is built with.
+//  With --dictionary small zstd entries are compressed against a dictionary
+//  trained on them and stored in the archive as .zstd_dictionary.
+//
+//  --benchmark decodes every entry of the given archives through unzip and
+//  prints decode throughput per compression method.
+//
+//  --benchmark-paths times index key normalization on the entry names of the
+//  given archives, grouped by name length, against the previous three pass
+//  lowercase / replace version.
+//
+//  --benchmark-io reads the payloads of all entries of the given archives
+//  with fseeko / fread one after another and with the pread pool and io_uring
+//  engines at growing queue depths; the page cache is dropped for the
+//  archives before every run where posix_fadvise allows it.
+//
+//  --benchmark-crc decodes every entry of the given archives through unzip
+//  with and without its crc and times zlib's crc32 against crc32Update on the
+//  decoded data, in CPU time per GB read, for picking a CrcPolicy.
+//
+//  usage: ZipRepack [--apply] [--method=deflate|zstd|lz4] [--dictionary] <trace> <input.zip> <output.zip>
+//         ZipRepack --benchmark <archive.zip>...
+//         ZipRepack --benchmark-paths <archive.zip>...
+//         ZipRepack --benchmark-io <archive.zip>...
+//         ZipRepack --benchmark-crc <archive.zip>...
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+
+#include "zlib.h"
+#include "unzip.h"
+#include "AccessTrace.h"
+#include "PathNormalizer.h"
+#include "IOEngine.h"
+#include "Crc32.h"
+
+#ifdef HAVE_ZSTD
+#include "zdict.h"
+#endif
+
+// entries up to this size that are read during the trace are cheaper to keep stored:
+// inflate setup and the extra buffer pass cost more than the saved disk bytes
+static const uint64_t kSmallHotEntrySize = 16 * 1024;
+// entries that deflate worse than this are not worth decompressing at all
+static const double kPoorCompressionRatio = 0.9;
+
+static const size_t kCopyBufferSize = 64 * 1024;
+
+// packing is done once, so the slow high ratio levels are fine
+static const int kZstdLevel = 19;
+static const int kLz4Level = 9;
+
+// every entry is decoded this many times in --benchmark
+static const int kBenchmarkRepeats = 20;
+// and every entry name normalized this many times in --benchmark-paths
+static const int kPathBenchmarkRepeats = 2000;
+
+// zstd entries up to this size are compressed with the shared dictionary,
+// larger ones have enough context of their own
+static const uint64_t kSmallEntrySize = 4 * 1024;
+static const size_t kDictionaryCapacity = 32 * 1024;
+static const char* kDictionaryEntryName = ".zstd_dictionary";
+
+struct ZipEntry {
+    std::string name;
+    unz_file_pos filePos;
+    unz_file_info64 fileInfo;
+    std::vector<char> extraField;
+    std::vector<char> comment;
+    
+    // from trace
+    size_t firstAccess;
+    uint64_t accessCount;
+    uint64_t bytesRead;
+    
+    // compressed size with deflate, measured for stored entries
+    uint64_t deflatedSize;
+    int recommendedMethod;
+};
+
+// trained dictionary for small zstd entries, empty when not used
+struct PackDictionary {
+    std::vector<unsigned char> data;
+#ifdef HAVE_ZSTD
+    ZSTD_CDict* cdict;
+#endif
+};
+
+struct CentralDirectoryRecord {
+    const ZipEntry* entry;
+    int method;
+    uint64_t compressedSize;
+    uint64_t localHeaderOffset;
+};
+
+static const char* methodName(int method) {
+    switch (method) {
+        case 0:          return "store";
+        case Z_DEFLATED: return "deflate";
+        case Z_BZIP2ED:  return "bzip2";
+        case Z_ZSTD:     return "zstd";
+        case Z_LZ4:      return "lz4";
+    }
+    return "unknown";
+}
+
+static std::string basename(const std::string& path) {
+    size_t pos = path.find_last_of("/\\");
+    return (pos == std::string::npos) ? path : path.substr(pos + 1);
+}
+
+//
+// little endian writer
+//
+
+static void putShort(std::vector<unsigned char>& out, uint32_t value) {
+    out.push_back(value & 0xff);
+    out.push_back((value >> 8) & 0xff);
+}
+
+static void putLong(std::vector<unsigned char>& out, uint32_t value) {
+    putShort(out, value & 0xffff);
+    putShort(out, (value >> 16) & 0xffff);
+}
+
+static bool writeBytes(FILE* file, const std::vector<unsigned char>& bytes) {
+    return fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+}
+
+//
+// reading input archive
+//
+
+static bool readEntries(unzFile zipFile, std::vector<ZipEntry>& entries) {
+    int ret = unzGoToFirstFile(zipFile);
+    
+    while (ret == UNZ_OK) {
+        ZipEntry entry;
+        char name[1024] = {0};
+        
+        if (unzGetCurrentFileInfo64(zipFile, &entry.fileInfo, name, sizeof(name), NULL, 0, NULL, 0) != UNZ_OK) return false;
+        if (unzGetFilePos(zipFile, &entry.filePos) != UNZ_OK) return false;
+        
+        entry.name = name;
+        entry.extraField.resize(entry.fileInfo.size_file_extra);
+        entry.comment.resize(entry.fileInfo.size_file_comment);
+        if (unzGetCurrentFileInfo64(zipFile, NULL, NULL, 0,
+                                    entry.extraField.data(), (uLong)entry.extraField.size(),
+                                    entry.comment.data(), (uLong)entry.comment.size()) != UNZ_OK) return false;
+        
+        entry.firstAccess = SIZE_MAX;
+        entry.accessCount = 0;
+        entry.bytesRead = 0;
+        entry.deflatedSize = entry.fileInfo.compressed_size;
+        entry.recommendedMethod = (int)entry.fileInfo.compression_method;
+        
+        entries.push_back(entry);
+        
+        ret = unzGoToNextFile(zipFile);
+    }
+    
+    return ret == UNZ_END_OF_LIST_OF_FILE;
+}
+
+static void applyTrace(const std::vector<AccessTraceEntry>& traceEntries, const std::string& archivePath, std::vector<ZipEntry>& entries) {
+    std::map<std::string, ZipEntry*> entriesByName;
+    for (auto& entry : entries) {
+        entriesByName[entry.name] = &entry;
+    }
+    
+    // traces come from devices, so archives are matched by file name only
+    std::string archiveName = basename(archivePath);
+    
+    for (size_t i = 0; i < traceEntries.size(); i++) {
+        const AccessTraceEntry& traceEntry = traceEntries[i];
+        if (basename(traceEntry.archivePath) != archiveName) continue;
+        
+        auto it = entriesByName.find(traceEntry.entryPath);
+        if (it == entriesByName.end()) continue;
+        
+        ZipEntry* entry = it->second;
+        entry->firstAccess = std::min(entry->firstAccess, i);
+        entry->accessCount++;
+        entry->bytesRead += traceEntry.size;
+    }
+}
+
+static uint64_t measureDeflatedSize(unzFile zipFile, const ZipEntry& entry) {
+    unz_file_pos filePos = entry.filePos;
+    if (unzGoToFilePos(zipFile, &filePos) != UNZ_OK) return entry.fileInfo.compressed_size;
+    if (unzOpenCurrentFile(zipFile) != UNZ_OK) return entry.fileInfo.compressed_size;
+    
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    
+    std::unique_ptr<unsigned char[]> in(new unsigned char[kCopyBufferSize]);
+    std::unique_ptr<unsigned char[]> out(new unsigned char[kCopyBufferSize]);
+    uint64_t deflatedSize = 0;
+    
+    int bytesRead = 0;
+    do {
+        bytesRead = unzReadCurrentFile(zipFile, in.get(), kCopyBufferSize);
+        if (bytesRead < 0) break;
+        
+        stream.next_in = in.get();
+        stream.avail_in = bytesRead;
+        int flush = (bytesRead == 0) ? Z_FINISH : Z_NO_FLUSH;
+        do {
+            stream.next_out = out.get();
+            stream.avail_out = kCopyBufferSize;
+            deflate(&stream, flush);
+            deflatedSize += kCopyBufferSize - stream.avail_out;
+        } while (stream.avail_out == 0);
+    } while (bytesRead > 0);
+    
+    deflateEnd(&stream);
+    unzCloseCurrentFile(zipFile);
+    
+    return deflatedSize;
+}
+
+static int recommendMethod(const ZipEntry& entry, int compressedMethod) {
+    uint64_t size = entry.fileInfo.uncompressed_size;
+    if (size == 0) return 0;
+    
+    if ((double)entry.deflatedSize >= kPoorCompressionRatio * size) return 0;
+    if (entry.accessCount > 0 && size <= kSmallHotEntrySize) return 0;
+    
+    return compressedMethod;
+}
+
+// zstd and lz4 entries are packed as a single frame from the whole entry
+static bool compressFrame(int method, const std::vector<unsigned char>& in, std::vector<unsigned char>& out, const PackDictionary& dictionary) {
+    // each used only by the codecs compiled in
+    (void)method;
+    (void)in;
+    (void)out;
+    (void)dictionary;
+    
+#ifdef HAVE_ZSTD
+    if (method == Z_ZSTD) {
+        out.resize(ZSTD_compressBound(in.size()));
+        size_t size = 0;
+        if (!dictionary.data.empty() && in.size() <= kSmallEntrySize) {
+            std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> context(ZSTD_createCCtx(), ZSTD_freeCCtx);
+            size = ZSTD_compress_usingCDict(context.get(), out.data(), out.size(), in.data(), in.size(), dictionary.cdict);
+        }
+        else
+            size = ZSTD_compress(out.data(), out.size(), in.data(), in.size(), kZstdLevel);
+        if (ZSTD_isError(size)) return false;
+        out.resize(size);
+        return true;
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (method == Z_LZ4) {
+        LZ4F_preferences_t preferences;
+        memset(&preferences, 0, sizeof(preferences));
+        preferences.compressionLevel = kLz4Level;
+        preferences.frameInfo.contentSize = in.size();
+        
+        out.resize(LZ4F_compressFrameBound(in.size(), &preferences));
+        size_t size = LZ4F_compressFrame(out.data(), out.size(), in.data(), in.size(), &preferences);
+        if (LZ4F_isError(size)) return false;
+        out.resize(size);
+        return true;
+    }
+#endif
+    return false;
+}
+
+static bool readEntryData(unzFile zipFile, const ZipEntry& entry, std::vector<unsigned char>& data) {
+    unz_file_pos filePos = entry.filePos;
+    if (unzGoToFilePos(zipFile, &filePos) != UNZ_OK) return false;
+    if (unzOpenCurrentFile(zipFile) != UNZ_OK) return false;
+    
+    data.resize(entry.fileInfo.uncompressed_size);
+    int bytesRead = data.empty() ? 0 : unzReadCurrentFile(zipFile, data.data(), (unsigned)data.size());
+    
+    return (unzCloseCurrentFile(zipFile) == UNZ_OK) && bytesRead == (int)data.size();
+}
+
+// trains on the entries that end up as small zstd frames
+static bool trainDictionary(unzFile zipFile, const std::vector<ZipEntry>& entries, PackDictionary& dictionary) {
+#ifdef HAVE_ZSTD
+    std::vector<unsigned char> samples;
+    std::vector<size_t> sampleSizes;
+    
+    for (auto& entry : entries) {
+        if (entry.recommendedMethod != Z_ZSTD || entry.fileInfo.uncompressed_size > kSmallEntrySize) continue;
+        
+        std::vector<unsigned char> data;
+        if (!readEntryData(zipFile, entry, data)) return false;
+        
+        samples.insert(samples.end(), data.begin(), data.end());
+        sampleSizes.push_back(data.size());
+    }
+    
+    dictionary.data.resize(kDictionaryCapacity);
+    size_t size = ZDICT_trainFromBuffer(dictionary.data.data(), dictionary.data.size(),
+                                        samples.data(), sampleSizes.data(), (unsigned)sampleSizes.size());
+    if (ZDICT_isError(size)) {
+        // too few or too uniform samples, pack without a dictionary
+        fprintf(stderr, "dictionary not trained: %s\n", ZDICT_getErrorName(size));
+        dictionary.data.clear();
+        return true;
+    }
+    
+    dictionary.data.resize(size);
+    dictionary.cdict = ZSTD_createCDict(dictionary.data.data(), dictionary.data.size(), kZstdLevel);
+    return dictionary.cdict != NULL;
+#else
+    (void)zipFile;
+    (void)entries;
+    (void)dictionary;
+    return false;
+#endif
+}
+
+//
+// writing output archive
+//
+
+static uint32_t versionNeeded(const ZipEntry& entry, int method) {
+    // 2.0 is the minimum for deflate, entries converted from store need it raised
+    if (method == Z_DEFLATED)
+        return std::max<uint32_t>((uint32_t)entry.fileInfo.version_needed, 20);
+    // 6.3 introduced the newer method ids
+    if (method == Z_ZSTD || method == Z_LZ4)
+        return std::max<uint32_t>((uint32_t)entry.fileInfo.version_needed, 63);
+    return (uint32_t)entry.fileInfo.version_needed;
+}
+
+static std::vector<unsigned char> makeLocalHeader(const ZipEntry& entry, int method, uint64_t compressedSize) {
+    std::vector<unsigned char> header;
+    putLong(header, 0x04034b50);
+    putShort(header, versionNeeded(entry, method));
+    // sizes are always known up front, no data descriptor
+    putShort(header, (uint32_t)(entry.fileInfo.flag & ~0x08));
+    putShort(header, method);
+    putLong(header, (uint32_t)entry.fileInfo.dosDate);
+    putLong(header, (uint32_t)entry.fileInfo.crc);
+    putLong(header, (uint32_t)compressedSize);
+    putLong(header, (uint32_t)entry.fileInfo.uncompressed_size);
+    putShort(header, (uint32_t)entry.name.size());
+    putShort(header, 0);
+    header.insert(header.end(), entry.name.begin(), entry.name.end());
+    return header;
+}
+
+// copies compressed bytes as is when the method does not change,
+// otherwise decodes and stores or recompresses the plain data
+static bool copyEntry(unzFile zipFile, FILE* outFile, const ZipEntry& entry, int method, const PackDictionary& dictionary, uint64_t* compressedSize) {
+    int sourceMethod = (int)entry.fileInfo.compression_method;
+    bool raw = (method == sourceMethod);
+    
+    unz_file_pos filePos = entry.filePos;
+    if (unzGoToFilePos(zipFile, &filePos) != UNZ_OK) return false;
+    if (unzOpenCurrentFile2(zipFile, NULL, NULL, raw ? 1 : 0) != UNZ_OK) return false;
+    
+    std::unique_ptr<unsigned char[]> in(new unsigned char[kCopyBufferSize]);
+    std::unique_ptr<unsigned char[]> out(new unsigned char[kCopyBufferSize]);
+    
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    bool deflating = (!raw && method == Z_DEFLATED);
+    if (deflating)
+        deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    bool framing = (!raw && (method == Z_ZSTD || method == Z_LZ4));
+    std::vector<unsigned char> plain;
+    
+    bool ok = true;
+    *compressedSize = 0;
+    
+    int bytesRead = 0;
+    do {
+        bytesRead = unzReadCurrentFile(zipFile, in.get(), kCopyBufferSize);
+        if (bytesRead < 0) {
+            ok = false;
+            break;
+        }
+        
+        if (framing) {
+            plain.insert(plain.end(), in.get(), in.get() + bytesRead);
+            continue;
+        }
+        
+        if (!deflating) {
+            if (fwrite(in.get(), 1, bytesRead, outFile) != (size_t)bytesRead) ok = false;
+            *compressedSize += bytesRead;
+            continue;
+        }
+        
+        stream.next_in = in.get();
+        stream.avail_in = bytesRead;
+        int flush = (bytesRead == 0) ? Z_FINISH : Z_NO_FLUSH;
+        do {
+            stream.next_out = out.get();
+            stream.avail_out = kCopyBufferSize;
+            deflate(&stream, flush);
+            
+            size_t produced = kCopyBufferSize - stream.avail_out;
+            if (fwrite(out.get(), 1, produced, outFile) != produced) ok = false;
+            *compressedSize += produced;
+        } while (stream.avail_out == 0);
+    } while (bytesRead > 0 && ok);
+    
+    if (deflating)
+        deflateEnd(&stream);
+    
+    if (framing && ok) {
+        std::vector<unsigned char> frame;
+        ok = compressFrame(method, plain, frame, dictionary) && writeBytes(outFile, frame);
+        *compressedSize = frame.size();
+    }
+    
+    // CRC mismatch of the source is reported on close when inflating
+    if (unzCloseCurrentFile(zipFile) != UNZ_OK) ok = false;
+    
+    return ok;
+}
+
+static bool writeArchive(unzFile zipFile, const std::string& outputPath, const std::vector<const ZipEntry*>& order, bool applyMethods, const PackDictionary& dictionary) {
+    FILE* outFile = fopen(outputPath.c_str(), "wb");
+    if (!outFile) return false;
+    
+    std::vector<CentralDirectoryRecord> centralDirectory;
+    bool ok = true;
+    
+    // the dictionary goes first and stored, readers load it while scanning the directory
+    ZipEntry dictionaryEntry;
+    if (!dictionary.data.empty() && !order.empty()) {
+        dictionaryEntry = *order.front();
+        dictionaryEntry.name = kDictionaryEntryName;
+        dictionaryEntry.extraField.clear();
+        dictionaryEntry.comment.clear();
+        dictionaryEntry.fileInfo.flag = 0;
+        dictionaryEntry.fileInfo.compression_method = 0;
+        dictionaryEntry.fileInfo.crc = crc32(0, dictionary.data.data(), (uInt)dictionary.data.size());
+        dictionaryEntry.fileInfo.compressed_size = dictionary.data.size();
+        dictionaryEntry.fileInfo.uncompressed_size = dictionary.data.size();
+        dictionaryEntry.fileInfo.internal_fa = 0;
+        dictionaryEntry.fileInfo.external_fa = 0;
+        
+        CentralDirectoryRecord record;
+        record.entry = &dictionaryEntry;
+        record.method = 0;
+        record.compressedSize = dictionary.data.size();
+        record.localHeaderOffset = ftello(outFile);
+        
+        ok = writeBytes(outFile, makeLocalHeader(dictionaryEntry, 0, record.compressedSize)) &&
+             writeBytes(outFile, dictionary.data);
+        
+        centralDirectory.push_back(record);
+    }
+    
+    for (const ZipEntry* entry : order) {
+        if (!ok) break;
+        
+        int method = applyMethods ? entry->recommendedMethod : (int)entry->fileInfo.compression_method;
+        
+        CentralDirectoryRecord record;
+        record.entry = entry;
+        record.method = method;
+        record.localHeaderOffset = ftello(outFile);
+        
+        // compressed size is patched after the data is written
+        ok = writeBytes(outFile, makeLocalHeader(*entry, method, 0)) &&
+             copyEntry(zipFile, outFile, *entry, method, dictionary, &record.compressedSize);
+        if (!ok) break;
+        
+        off_t endOffset = ftello(outFile);
+        fseeko(outFile, record.localHeaderOffset, SEEK_SET);
+        ok = writeBytes(outFile, makeLocalHeader(*entry, method, record.compressedSize));
+        fseeko(outFile, endOffset, SEEK_SET);
+        if (!ok) break;
+        
+        centralDirectory.push_back(record);
+    }
+    
+    uint64_t centralDirectoryOffset = ftello(outFile);
+    
+    for (auto& record : centralDirectory) {
+        if (!ok) break;
+        
+        const ZipEntry& entry = *record.entry;
+        std::vector<unsigned char> header;
+        putLong(header, 0x02014b50);
+        putShort(header, (uint32_t)entry.fileInfo.version);
+        putShort(header, versionNeeded(entry, record.method));
+        putShort(header, (uint32_t)(entry.fileInfo.flag & ~0x08));
+        putShort(header, record.method);
+        putLong(header, (uint32_t)entry.fileInfo.dosDate);
+        putLong(header, (uint32_t)entry.fileInfo.crc);
+        putLong(header, (uint32_t)record.compressedSize);
+        putLong(header, (uint32_t)entry.fileInfo.uncompressed_size);
+        putShort(header, (uint32_t)entry.name.size());
+        putShort(header, (uint32_t)entry.extraField.size());
+        putShort(header, (uint32_t)entry.comment.size());
+        putShort(header, 0);
+        putShort(header, (uint32_t)entry.fileInfo.internal_fa);
+        putLong(header, (uint32_t)entry.fileInfo.external_fa);
+        putLong(header, (uint32_t)record.localHeaderOffset);
+        header.insert(header.end(), entry.name.begin(), entry.name.end());
+        header.insert(header.end(), entry.extraField.begin(), entry.extraField.end());
+        header.insert(header.end(), entry.comment.begin(), entry.comment.end());
+        
+        ok = writeBytes(outFile, header);
+    }
+    
+    uint64_t centralDirectorySize = ftello(outFile) - centralDirectoryOffset;
+    
+    std::vector<unsigned char> endRecord;
+    putLong(endRecord, 0x06054b50);
+    putShort(endRecord, 0);
+    putShort(endRecord, 0);
+    putShort(endRecord, (uint32_t)centralDirectory.size());
+    putShort(endRecord, (uint32_t)centralDirectory.size());
+    putLong(endRecord, (uint32_t)centralDirectorySize);
+    putLong(endRecord, (uint32_t)centralDirectoryOffset);
+    putShort(endRecord, 0);
+    
+    ok = ok && writeBytes(outFile, endRecord) && centralDirectoryOffset <= 0xffffffff;
+    
+    if (fclose(outFile) != 0) ok = false;
+    
+    return ok;
+}
+
+static void printReport(const std::vector<const ZipEntry*>& order) {
+    printf("%-8s %-8s %10s %10s %10s  %s\n", "method", "advice", "accesses", "size", "deflated", "name");
+    
+    for (const ZipEntry* entry : order) {
+        printf("%-8s %-8s %10llu %10llu %10llu  %s\n",
+               methodName((int)entry->fileInfo.compression_method),
+               methodName(entry->recommendedMethod),
+               (unsigned long long)entry->accessCount,
+               (unsigned long long)entry->fileInfo.uncompressed_size,
+               (unsigned long long)entry->deflatedSize,
+               entry->name.c_str());
+    }
+}
+
+//
+// decode benchmark
+//
+
+struct MethodThroughput {
+    uint64_t entries;
+    uint64_t compressedBytes;
+    uint64_t decodedBytes;
+    uint64_t nanoseconds;
+};
+
+// results are grouped by method and by small / large entries
+typedef std::pair<int, bool> ThroughputKey;
+
+static bool benchmarkArchive(const std::string& archivePath, std::map<ThroughputKey, MethodThroughput>& throughput) {
+    unzFile zipFile = unzOpen64(archivePath.c_str());
+    if (!zipFile) return false;
+    
+    std::vector<ZipEntry> entries;
+    bool ok = readEntries(zipFile, entries);
+    
+#ifdef HAVE_ZSTD
+    // digested once, the way ResourcesManager does it per archive
+    std::unique_ptr<ZSTD_DDict, size_t (*)(ZSTD_DDict*)> ddict(nullptr, ZSTD_freeDDict);
+    for (auto& entry : entries) {
+        if (!ok || entry.name != kDictionaryEntryName) continue;
+        
+        std::vector<unsigned char> data;
+        ok = readEntryData(zipFile, entry, data);
+        ddict.reset(ZSTD_createDDict(data.data(), data.size()));
+        unzSetZstdDictionary(zipFile, ddict.get());
+    }
+#endif
+    
+    std::unique_ptr<unsigned char[]> buffer(new unsigned char[kCopyBufferSize]);
+    
+    for (auto& entry : entries) {
+        if (!ok) break;
+        if (entry.fileInfo.uncompressed_size == 0 || entry.name == kDictionaryEntryName) continue;
+        
+        ThroughputKey key((int)entry.fileInfo.compression_method, entry.fileInfo.uncompressed_size <= kSmallEntrySize);
+        MethodThroughput& methodThroughput = throughput[key];
+        
+        for (int i = 0; i < kBenchmarkRepeats && ok; i++) {
+            unz_file_pos filePos = entry.filePos;
+            auto startTime = std::chrono::steady_clock::now();
+            
+            ok = (unzGoToFilePos(zipFile, &filePos) == UNZ_OK && unzOpenCurrentFile(zipFile) == UNZ_OK);
+            
+            int bytesRead = 0;
+            while (ok && (bytesRead = unzReadCurrentFile(zipFile, buffer.get(), kCopyBufferSize)) > 0) {}
+            
+            // the close also verifies the crc of the decoded data
+            ok = ok && bytesRead == 0 && unzCloseCurrentFile(zipFile) == UNZ_OK;
+            
+            methodThroughput.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+        }
+        
+        methodThroughput.entries++;
+        methodThroughput.compressedBytes += entry.fileInfo.compressed_size;
+        methodThroughput.decodedBytes += entry.fileInfo.uncompressed_size * kBenchmarkRepeats;
+    }
+    
+    unzClose(zipFile);
+    
+    return ok;
+}
+
+static int benchmark(const std::vector<std::string>& archivePaths) {
+    printf("%-24s %-8s %-6s %8s %12s %12s %10s %10s\n", "archive", "method", "sizes", "entries", "compressed", "plain", "MB/s", "us/read");
+    
+    for (auto& archivePath : archivePaths) {
+        std::map<ThroughputKey, MethodThroughput> throughput;
+        if (!benchmarkArchive(archivePath, throughput)) {
+            fprintf(stderr, "can't decode %s\n", archivePath.c_str());
+            return 1;
+        }
+        
+        for (auto& methodThroughputPair : throughput) {
+            const MethodThroughput& methodThroughput = methodThroughputPair.second;
+            double seconds = methodThroughput.nanoseconds / 1e9;
+            
+            printf("%-24s %-8s %-6s %8llu %12llu %12llu %10.1f %10.2f\n",
+                   basename(archivePath).c_str(),
+                   methodName(methodThroughputPair.first.first),
+                   methodThroughputPair.first.second ? "small" : "large",
+                   (unsigned long long)methodThroughput.entries,
+                   (unsigned long long)methodThroughput.compressedBytes,
+                   (unsigned long long)(methodThroughput.decodedBytes / kBenchmarkRepeats),
+                   seconds > 0 ? methodThroughput.decodedBytes / seconds / (1024 * 1024) : 0.0,
+                   methodThroughput.nanoseconds / 1e3 / (methodThroughput.entries * kBenchmarkRepeats));
+        }
+    }
+    
+    return 0;
+}
+
+//
+// path normalization benchmark
+//
+
+// what makeKey did before normalizePath
+static std::string normalizePathThreePass(const std::string& path) {
+    std::string key = path;
+    std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+    for (size_t pos = 0; (pos = key.find("\\\\", pos)) != std::string::npos; pos++) {
+        key.erase(pos, 2);
+        key.insert(pos, "/");
+    }
+    std::replace(key.begin(), key.end(), '\\', '/');
+    
+    return key;
+}
+
+template <typename Normalize>
+static uint64_t timeNormalization(const std::vector<std::string>& paths, Normalize normalize) {
+    size_t checksum = 0;
+    auto startTime = std::chrono::steady_clock::now();
+    
+    for (int i = 0; i < kPathBenchmarkRepeats; i++) {
+        for (auto& path : paths)
+            checksum += normalize(path).size();
+    }
+    
+    uint64_t nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+    
+    // keeps the calls from being optimized away
+    if (checksum == 1) printf("\n");
+    
+    return nanoseconds;
+}
+
+static int benchmarkPaths(const std::vector<std::string>& archivePaths) {
+    // names grouped by the smallest length bucket they fit
+    static const size_t kLengthBuckets[] = { 16, 32, 64, 128, 256, SIZE_MAX };
+    std::map<size_t, std::vector<std::string>> pathsByLength;
+    
+    for (auto& archivePath : archivePaths) {
+        unzFile zipFile = unzOpen64(archivePath.c_str());
+        
+        std::vector<ZipEntry> entries;
+        if (!zipFile || !readEntries(zipFile, entries)) {
+            fprintf(stderr, "can't read %s\n", archivePath.c_str());
+            if (zipFile) unzClose(zipFile);
+            return 1;
+        }
+        unzClose(zipFile);
+        
+        for (auto& entry : entries) {
+            const size_t* bucket = std::lower_bound(std::begin(kLengthBuckets), std::end(kLengthBuckets), entry.name.size());
+            pathsByLength[*bucket].push_back(entry.name);
+        }
+    }
+    
+    printf("normalizePath: %s\n", normalizePathImplementation());
+    printf("%-8s %8s %14s %14s %8s\n", "length", "paths", "3 pass ns", "1 pass ns", "speedup");
+    
+    for (auto& lengthPathsPair : pathsByLength) {
+        const std::vector<std::string>& paths = lengthPathsPair.second;
+        uint64_t calls = (uint64_t)paths.size() * kPathBenchmarkRepeats;
+        
+        uint64_t threePass = timeNormalization(paths, normalizePathThreePass);
+        uint64_t onePass = timeNormalization(paths, [](const std::string& path) { return normalizePath(path); });
+        
+        char length[32];
+        if (lengthPathsPair.first == SIZE_MAX) snprintf(length, sizeof(length), "longer");
+        else snprintf(length, sizeof(length), "<= %zu", lengthPathsPair.first);
+        
+        printf("%-8s %8zu %14.1f %14.1f %7.2fx\n", length, paths.size(),
+               (double)threePass / calls, (double)onePass / calls,
+               onePass > 0 ? (double)threePass / onePass : 0.0);
+    }
+    
+    return 0;
+}
+
+//
+// batched read benchmark
+//
+
+struct PayloadRange {
+    size_t archive;
+    uint64_t offset;
+    uint64_t length;
+};
+
+static const unsigned kQueueDepths[] = { 1, 4, 16, 64, 256 };
+
+static void dropCache(const std::vector<std::string>& archivePaths) {
+#ifdef POSIX_FADV_DONTNEED
+    for (auto& archivePath : archivePaths) {
+        int fd = open(archivePath.c_str(), O_RDONLY);
+        if (fd < 0) continue;
+        
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+#endif
+}
+
+static void printIOResult(const char* engine, unsigned queueDepth, uint64_t bytes, size_t reads, uint64_t nanoseconds) {
+    double seconds = nanoseconds / 1e9;
+    printf("%-10s %6u %10.1f %12.0f\n", engine, queueDepth,
+           seconds > 0 ? bytes / seconds / (1024 * 1024) : 0.0,
+           seconds > 0 ? reads / seconds : 0.0);
+}
+
+static int benchmarkIO(const std::vector<std::string>& archivePaths) {
+    std::vector<PayloadRange> ranges;
+    uint64_t totalBytes = 0;
+    
+    for (size_t archive = 0; archive < archivePaths.size(); archive++) {
+        unzFile zipFile = unzOpen64(archivePaths[archive].c_str());
+        
+        std::vector<ZipEntry> entries;
+        bool ok = zipFile && readEntries(zipFile, entries);
+        
+        for (auto& entry : entries) {
+            if (!ok) break;
+            if (entry.fileInfo.compressed_size == 0) continue;
+            
+            unz_file_pos filePos = entry.filePos;
+            ok = unzGoToFilePos(zipFile, &filePos) == UNZ_OK && unzOpenCurrentFile(zipFile) == UNZ_OK;
+            if (!ok) break;
+            
+            PayloadRange range = { archive, unzGetCurrentFileZStreamPos64(zipFile), entry.fileInfo.compressed_size };
+            ranges.push_back(range);
+            totalBytes += range.length;
+            
+            unzCloseCurrentFile(zipFile);
+        }
+        
+        if (zipFile) unzClose(zipFile);
+        
+        if (!ok) {
+            fprintf(stderr, "can't read %s\n", archivePaths[archive].c_str());
+            return 1;
+        }
+    }
+    
+    std::unique_ptr<char[]> buffer(new char[totalBytes]);
+    
+    printf("%zu reads, %llu bytes\n", ranges.size(), (unsigned long long)totalBytes);
+    printf("%-10s %6s %10s %12s\n", "engine", "depth", "MB/s", "reads/s");
+    
+    // current path: a FILE* per archive, seek and read per entry
+    {
+        dropCache(archivePaths);
+        auto startTime = std::chrono::steady_clock::now();
+        
+        std::vector<FILE*> files;
+        for (auto& archivePath : archivePaths) {
+            files.push_back(fopen(archivePath.c_str(), "rb"));
+        }
+        
+        char* data = buffer.get();
+        for (auto& range : ranges) {
+            FILE* file = files[range.archive];
+            if (fseeko(file, range.offset, SEEK_SET) != 0 || fread(data, 1, range.length, file) != range.length) {
+                fprintf(stderr, "read failed\n");
+                return 1;
+            }
+            data += range.length;
+        }
+        
+        for (auto file : files) {
+            fclose(file);
+        }
+        
+        printIOResult("stdio", 1, totalBytes, ranges.size(),
+                      std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count());
+    }
+    
+    std::vector<int> fds;
+    for (auto& archivePath : archivePaths) {
+        fds.push_back(open(archivePath.c_str(), O_RDONLY));
+    }
+    
+    for (auto type : { IOEnginePread, IOEngineUring }) {
+        for (auto queueDepth : kQueueDepths) {
+            std::unique_ptr<IOEngine> engine = IOEngine::create(type, queueDepth);
+            
+            // a fallback engine was already measured
+            if (engine->type() != type) break;
+            
+            std::vector<IORequest> requests;
+            char* data = buffer.get();
+            for (auto& range : ranges) {
+                IORequest request = { fds[range.archive], range.offset, data, (size_t)range.length, 0 };
+                requests.push_back(request);
+                data += range.length;
+            }
+            
+            dropCache(archivePaths);
+            auto startTime = std::chrono::steady_clock::now();
+            
+            engine->submit(requests);
+            
+            uint64_t nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+            
+            for (auto& request : requests) {
+                if (request.result != (ssize_t)request.length) {
+                    fprintf(stderr, "read failed\n");
+                    return 1;
+                }
+            }
+            
+            printIOResult(engine->name(), queueDepth, totalBytes, ranges.size(), nanoseconds);
+        }
+    }
+    
+    for (auto fd : fds) {
+        if (fd >= 0) close(fd);
+    }
+    
+    return 0;
+}
+
+//
+// crc benchmark
+//
+
+// every entry is decoded and checksummed this many times in --benchmark-crc
+static const int kCrcBenchmarkRepeats = 5;
+
+template <typename Work>
+static uint64_t timeRepeated(Work work) {
+    auto startTime = std::chrono::steady_clock::now();
+    for (int i = 0; i < kCrcBenchmarkRepeats; i++) {
+        work();
+    }
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+static double millisecondsPerGB(uint64_t nanoseconds, uint64_t bytes) {
+    return bytes > 0 ? nanoseconds / 1e6 * (1024.0 * 1024 * 1024) / bytes : 0.0;
+}
+
+static int benchmarkCrc(const std::vector<std::string>& archivePaths) {
+    uint64_t decodedBytes = 0;
+    uint64_t unzipWithCrc = 0;
+    uint64_t unzipWithoutCrc = 0;
+    uint64_t zlibCrc = 0;
+    uint64_t fastCrc = 0;
+    uint32_t checksum = 0;
+    
+    for (auto& archivePath : archivePaths) {
+        unzFile zipFile = unzOpen64(archivePath.c_str());
+        
+        std::vector<ZipEntry> entries;
+        bool ok = zipFile && readEntries(zipFile, entries);
+        
+        std::vector<unsigned char> data;
+        for (auto& entry : entries) {
+            if (!ok) break;
+            // zstd entries against a dictionary are left to --benchmark
+            if (entry.fileInfo.uncompressed_size == 0 || entry.name == kDictionaryEntryName) continue;
+            
+            unzSetCrcCheck(zipFile, 1);
+            unzipWithCrc += timeRepeated([&] { ok = ok && readEntryData(zipFile, entry, data); });
+            
+            unzSetCrcCheck(zipFile, 0);
+            unzipWithoutCrc += timeRepeated([&] { ok = ok && readEntryData(zipFile, entry, data); });
+            
+            zlibCrc += timeRepeated([&] { checksum ^= (uint32_t)crc32(0, data.data(), (uInt)data.size()); });
+            fastCrc += timeRepeated([&] { checksum ^= crc32Update(0, data.data(), data.size()); });
+            
+            ok = ok && crc32Update(0, data.data(), data.size()) == entry.fileInfo.crc;
+            decodedBytes += (uint64_t)data.size() * kCrcBenchmarkRepeats;
+        }
+        
+        if (zipFile) unzClose(zipFile);
+        
+        if (!ok) {
+            fprintf(stderr, "can't decode %s\n", archivePath.c_str());
+            return 1;
+        }
+    }
+    
+    // keeps the checksums from being optimized away
+    if (checksum == 1) printf("\n");
+    
+    printf("crc32Update: %s, %llu bytes decoded\n", crc32Implementation(), (unsigned long long)(decodedBytes / kCrcBenchmarkRepeats));
+    printf("%-28s %12s\n", "", "ms CPU / GB");
+    printf("%-28s %12.1f\n", "unzip with crc", millisecondsPerGB(unzipWithCrc, decodedBytes));
+    printf("%-28s %12.1f\n", "unzip without crc", millisecondsPerGB(unzipWithoutCrc, decodedBytes));
+    printf("%-28s %12.1f\n", "zlib crc32", millisecondsPerGB(zlibCrc, decodedBytes));
+    printf("%-28s %12.1f\n", "crc32Update", millisecondsPerGB(fastCrc, decodedBytes));
+    printf("saved per GB read: %.1f ms with CrcVerifyAlways, %.1f ms with CrcVerifyNever or once verified\n",
+           millisecondsPerGB(zlibCrc - std::min(zlibCrc, fastCrc), decodedBytes),
+           millisecondsPerGB(zlibCrc, decodedBytes));
+    
+    return 0;
+}
+
+static bool parseMethod(const char* name, int* method) {
+    if (strcmp(name, "deflate") == 0)
+        *method = Z_DEFLATED;
+#ifdef HAVE_ZSTD
+    else if (strcmp(name, "zstd") == 0)
+        *method = Z_ZSTD;
+#endif
+#ifdef HAVE_LZ4
+    else if (strcmp(name, "lz4") == 0)
+        *method = Z_LZ4;
+#endif
+    else
+        return false;
+    return true;
+}
+
+int main(int argc, const char * argv[]) {
+    bool applyMethods = false;
+    bool runBenchmark = false;
+    bool runPathBenchmark = false;
+    bool runIOBenchmark = false;
+    bool runCrcBenchmark = false;
+    bool useDictionary = false;
+    int compressedMethod = Z_DEFLATED;
+    std::vector<std::string> arguments;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--apply") == 0)
+            applyMethods = true;
+        else if (strcmp(argv[i], "--benchmark") == 0)
+            runBenchmark = true;
+        else if (strcmp(argv[i], "--benchmark-paths") == 0)
+            runPathBenchmark = true;
+        else if (strcmp(argv[i], "--benchmark-io") == 0)
+            runIOBenchmark = true;
+        else if (strcmp(argv[i], "--benchmark-crc") == 0)
+            runCrcBenchmark = true;
+        else if (strcmp(argv[i], "--dictionary") == 0)
+            useDictionary = true;
+        else if (strncmp(argv[i], "--method=", 9) == 0) {
+            if (!parseMethod(argv[i] + 9, &compressedMethod)) {
+                fprintf(stderr, "unsupported method %s\n", argv[i] + 9);
+                return 1;
+            }
+        }
+        else
+            arguments.push_back(argv[i]);
+    }
+    
+    if (runBenchmark && !arguments.empty())
+        return benchmark(arguments);
+    
+    if (runPathBenchmark && !arguments.empty())
+        return benchmarkPaths(arguments);
+    
+    if (runIOBenchmark && !arguments.empty())
+        return benchmarkIO(arguments);
+    
+    if (runCrcBenchmark && !arguments.empty())
+        return benchmarkCrc(arguments);
+    
+    if (useDictionary && (!applyMethods || compressedMethod != Z_ZSTD)) {
+        fprintf(stderr, "--dictionary needs --apply --method=zstd\n");
+        return 1;
+    }
+    
+    if (arguments.size() != 3) {
+        fprintf(stderr, "usage: %s [--apply] [--method=deflate|zstd|lz4] [--dictionary] <trace> <input.zip> <output.zip>\n", argv[0]);
+        fprintf(stderr, "       %s --benchmark <archive.zip>...\n", argv[0]);
+        fprintf(stderr, "       %s --benchmark-paths <archive.zip>...\n", argv[0]);
+        fprintf(stderr, "       %s --benchmark-io <archive.zip>...\n", argv[0]);
+        fprintf(stderr, "       %s --benchmark-crc <archive.zip>...\n", argv[0]);
+        return 1;
+    }
+    
+    const std::string& tracePath  = arguments[0];
+    const std::string& inputPath  = arguments[1];
+    const std::string& outputPath = arguments[2];
+    
+    std::vector<AccessTraceEntry> traceEntries;
+    if (!AccessTrace::load(tracePath, traceEntries)) {
+        fprintf(stderr, "can't read trace %s\n", tracePath.c_str());
+        return 1;
+    }
+    
+    unzFile zipFile = unzOpen64(inputPath.c_str());
+    if (!zipFile) {
+        fprintf(stderr, "can't open %s\n", inputPath.c_str());
+        return 1;
+    }
+    
+    std::vector<ZipEntry> entries;
+    if (!readEntries(zipFile, entries)) {
+        fprintf(stderr, "can't read central directory of %s\n", inputPath.c_str());
+        unzClose(zipFile);
+        return 1;
+    }
+    
+    applyTrace(traceEntries, inputPath, entries);
+    
+    for (auto& entry : entries) {
+        if (entry.fileInfo.compression_method == 0 && entry.fileInfo.uncompressed_size > 0)
+            entry.deflatedSize = measureDeflatedSize(zipFile, entry);
+        
+        entry.recommendedMethod = recommendMethod(entry, compressedMethod);
+        
+        // only store and deflate are rewritten, anything else is copied verbatim
+        bool knownMethod = (entry.fileInfo.compression_method == 0 || entry.fileInfo.compression_method == Z_DEFLATED);
+        if (!knownMethod || (entry.fileInfo.flag & 1))
+            entry.recommendedMethod = (int)entry.fileInfo.compression_method;
+    }
+    
+    // traced entries in first access order, the rest in original order
+    std::vector<const ZipEntry*> order;
+    for (auto& entry : entries) {
+        // a dictionary from an earlier repack is replaced by the new one
+        if (useDictionary && entry.name == kDictionaryEntryName) continue;
+        order.push_back(&entry);
+    }
+    std::stable_sort(order.begin(), order.end(), [](const ZipEntry* a, const ZipEntry* b) {
+        return a->firstAccess < b->firstAccess;
+    });
+    
+    printReport(order);
+    
+    PackDictionary dictionary;
+    if (useDictionary && !trainDictionary(zipFile, entries, dictionary)) {
+        fprintf(stderr, "can't train dictionary on %s\n", inputPath.c_str());
+        unzClose(zipFile);
+        return 1;
+    }
+    
+    bool ok = writeArchive(zipFile, outputPath, order, applyMethods, dictionary);
+    unzClose(zipFile);
+#ifdef HAVE_ZSTD
+    if (!dictionary.data.empty())
+        ZSTD_freeCDict(dictionary.cdict);
+#endif
+    
+    if (!ok) {
+        fprintf(stderr, "can't write %s\n", outputPath.c_str());
+        return 1;
+    }
+    
+    return 0;
+}